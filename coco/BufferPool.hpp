@@ -0,0 +1,79 @@
+#pragma once
+
+
+namespace coco {
+
+/**
+ * Size class of a buffer pool: A fixed set of buffers of the same capacity that can be borrowed and returned in O(1).
+ * Keeps statistics (high-water mark, failed allocations) so that the pool can be sized for the application.
+ * Does not lock, therefore the owner (e.g. a SPI master) has to guard against concurrent access from interrupts.
+ * @tparam B buffer type
+ */
+template <typename B>
+class BufferPool {
+public:
+    /**
+     * Constructor
+     * @param capacity capacity of the buffers
+     * @param buffers array of pointers to the buffers, used as stack of free buffers
+     * @param count number of buffers
+     */
+    BufferPool(int capacity, B **buffers, int count)
+        : cap(capacity), stack(buffers), freeCount(count), total(count)
+    {}
+
+    /**
+     * Get the capacity of the buffers in this size class
+     */
+    int capacity() const {return this->cap;}
+
+    /**
+     * Borrow a buffer
+     * @return buffer or nullptr if all buffers are in use
+     */
+    B *allocate() {
+        if (this->freeCount == 0) {
+            ++this->failures;
+            return nullptr;
+        }
+        B *buffer = this->stack[--this->freeCount];
+        int used = this->total - this->freeCount;
+        if (used > this->highWater)
+            this->highWater = used;
+        return buffer;
+    }
+
+    /**
+     * Return a buffer
+     * @param buffer buffer that was borrowed from this pool
+     */
+    void release(B &buffer) {
+        this->stack[this->freeCount++] = &buffer;
+    }
+
+    /**
+     * Statistics: number of buffers, buffers in use, maximum of buffers in use and number of allocations that found
+     * this size class exhausted
+     */
+    int count() const {return this->total;}
+    int usedCount() const {return this->total - this->freeCount;}
+    int highWaterMark() const {return this->highWater;}
+    int failCount() const {return this->failures;}
+    void resetStatistics() {this->highWater = this->total - this->freeCount; this->failures = 0;}
+
+    // next size class with larger capacity, managed by the owner
+    BufferPool *next = nullptr;
+
+protected:
+    int cap;
+
+    // stack of free buffers
+    B **stack;
+    int freeCount;
+    int total;
+
+    int highWater = 0;
+    int failures = 0;
+};
+
+} // namespace coco
@@ -0,0 +1,135 @@
+#include "DisplayFlush.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+DisplayFlush::DisplayFlush(Buffer &buffer1, Buffer &buffer2, const uint16_t *frameBuffer, int width, int height,
+    int xOffset, int yOffset)
+    : buffers{&buffer1, &buffer2}, frameBuffer(frameBuffer), width(width), height(height)
+    , xOffset(xOffset), yOffset(yOffset)
+{
+}
+
+void DisplayFlush::invalidate(int x, int y, int width, int height) {
+    // clip to frame buffer
+    Rect rect = {std::max(x, 0), std::max(y, 0), std::min(x + width, this->width), std::min(y + height, this->height)};
+    if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+        return;
+
+    if (this->rectCount == MAX_RECT_COUNT) {
+        // no space left: merge the new rectangle with the one where the merged rectangle grows least
+        int best = 0;
+        int bestCost = 0x7fffffff;
+        for (int i = 0; i < this->rectCount; ++i) {
+            Rect &r = this->rects[i];
+            Rect u = {std::min(r.x1, rect.x1), std::min(r.y1, rect.y1), std::max(r.x2, rect.x2), std::max(r.y2, rect.y2)};
+            int cost = u.area() - r.area();
+            if (cost < bestCost) {
+                best = i;
+                bestCost = cost;
+            }
+        }
+        Rect &r = this->rects[best];
+        rect = {std::min(r.x1, rect.x1), std::min(r.y1, rect.y1), std::max(r.x2, rect.x2), std::max(r.y2, rect.y2)};
+        r = this->rects[--this->rectCount];
+    }
+    this->rects[this->rectCount++] = rect;
+
+    merge();
+}
+
+AwaitableCoroutine DisplayFlush::flush() {
+    while (this->rectCount > 0) {
+        Rect r = this->rects[--this->rectCount];
+        ++this->rectCountTotal;
+
+        // column address set (CASET) and row address set (RASET)
+        co_await next();
+        window(0x2a, r.x1 + this->xOffset, r.x2 - 1 + this->xOffset);
+        co_await next();
+        window(0x2b, r.y1 + this->yOffset, r.y2 - 1 + this->yOffset);
+
+        // memory write (RAMWR) for the first chunk, memory write continue (RAMWRC) for following chunks
+        int x = r.x1;
+        int y = r.y1;
+        int remaining = r.area();
+        uint8_t c = 0x2c;
+        while (remaining > 0) {
+            co_await next();
+            auto &buffer = *this->buffers[this->index];
+
+            // set header first as it may move the data
+            uint8_t header[] = {c};
+            buffer.setHeader(header);
+
+            // convert pixels to big endian while the other buffer is transferring
+            int count = std::min(remaining, (buffer.capacity() - 1) >> 1);
+            uint8_t *data = buffer.data();
+            for (int i = 0; i < count; ++i) {
+                uint16_t pixel = this->frameBuffer[x + y * this->width];
+                data[0] = pixel >> 8;
+                data[1] = pixel;
+                data += 2;
+                if (++x == r.x2) {
+                    x = r.x1;
+                    ++y;
+                }
+            }
+            buffer.startWrite(count * 2);
+
+            remaining -= count;
+            this->pixelCount += count;
+            c = 0x3c;
+        }
+    }
+
+    // wait until both buffers have finished
+    co_await this->buffers[0]->untilReadyOrDisabled();
+    co_await this->buffers[1]->untilReadyOrDisabled();
+}
+
+void DisplayFlush::merge() {
+    bool merged;
+    do {
+        merged = false;
+        for (int i = 0; i < this->rectCount && !merged; ++i) {
+            for (int j = i + 1; j < this->rectCount; ++j) {
+                Rect &a = this->rects[i];
+                Rect &b = this->rects[j];
+                Rect u = {std::min(a.x1, b.x1), std::min(a.y1, b.y1), std::max(a.x2, b.x2), std::max(a.y2, b.y2)};
+
+                // merge if transferring the bounding rectangle is not more expensive than transferring both
+                if (u.area() + RECT_OVERHEAD <= a.area() + b.area() + 2 * RECT_OVERHEAD) {
+                    a = u;
+                    b = this->rects[--this->rectCount];
+                    merged = true;
+                    break;
+                }
+            }
+        }
+    } while (merged);
+}
+
+AwaitableCoroutine DisplayFlush::next() {
+    this->index ^= 1;
+    co_await this->buffers[this->index]->untilReadyOrDisabled();
+}
+
+void DisplayFlush::window(uint8_t command, int start, int end) {
+    auto &buffer = *this->buffers[this->index];
+
+    // set header first as it may move the data
+    uint8_t header[] = {command};
+    buffer.setHeader(header);
+
+    // start and end address, big endian
+    uint8_t *data = buffer.data();
+    data[0] = start >> 8;
+    data[1] = start;
+    data[2] = end >> 8;
+    data[3] = end;
+    buffer.startWrite(4);
+}
+
+} // namespace coco
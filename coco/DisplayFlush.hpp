@@ -0,0 +1,104 @@
+#pragma once
+
+#include <coco/Buffer.hpp>
+#include <coco/Coroutine.hpp>
+
+
+namespace coco {
+
+/**
+ * Flush engine for displays with MIPI DCS command set (e.g. ST7789, ILI9341) on a SPI channel with data/command (DC)
+ * pin. Tracks dirty rectangles of a RGB565 frame buffer, merges them and transfers only the dirty regions using
+ * window-set (CASET, RASET) and memory write (RAMWR, RAMWRC) commands. The command byte is the header of the buffer,
+ * therefore the master sends it with DC low and the parameters or pixels with DC high.
+ * Two buffers are used alternately so that converting the pixels of the next chunk overlaps the transfer of the
+ * current chunk.
+ */
+class DisplayFlush {
+public:
+    // maximum number of dirty rectangles
+    static constexpr int MAX_RECT_COUNT = 8;
+
+    // cost of a rectangle in pixels in addition to its area (window-set commands), used to decide about merging
+    static constexpr int RECT_OVERHEAD = 32;
+
+    struct Rect {
+        int x1;
+        int y1;
+        int x2; // exclusive
+        int y2; // exclusive
+
+        int area() const {return (this->x2 - this->x1) * (this->y2 - this->y1);}
+    };
+
+    /**
+     * Constructor
+     * @param buffer1 first buffer on a channel with DC pin
+     * @param buffer2 second buffer on the same channel
+     * @param frameBuffer frame buffer in RGB565 format, native byte order
+     * @param width width of frame buffer
+     * @param height height of frame buffer
+     * @param xOffset horizontal offset of the visible area in the display memory
+     * @param yOffset vertical offset of the visible area in the display memory
+     */
+    DisplayFlush(Buffer &buffer1, Buffer &buffer2, const uint16_t *frameBuffer, int width, int height,
+        int xOffset = 0, int yOffset = 0);
+
+    /**
+     * Mark a region of the frame buffer as dirty
+     * @param x x coordinate of region
+     * @param y y coordinate of region
+     * @param width width of region
+     * @param height height of region
+     */
+    void invalidate(int x, int y, int width, int height);
+
+    /**
+     * Mark the whole frame buffer as dirty
+     */
+    void invalidate() {invalidate(0, 0, this->width, this->height);}
+
+    /**
+     * Check if there are dirty regions
+     */
+    bool dirty() {return this->rectCount > 0;}
+
+    /**
+     * Transfer all dirty regions to the display
+     */
+    [[nodiscard]] AwaitableCoroutine flush();
+
+    /**
+     * Statistics
+     */
+    int getRectCount() {return this->rectCountTotal;}
+    int64_t getPixelCount() {return this->pixelCount;}
+
+protected:
+    // merge rectangles as long as merging is cheaper than transferring them separately
+    void merge();
+
+    // get the buffer for the next transfer, waits until it is not in use anymore
+    [[nodiscard]] AwaitableCoroutine next();
+
+    // start a window-set command (CASET or RASET) on the current buffer
+    void window(uint8_t command, int start, int end);
+
+    Buffer *buffers[2];
+    int index = 0;
+
+    const uint16_t *frameBuffer;
+    int width;
+    int height;
+    int xOffset;
+    int yOffset;
+
+    // dirty rectangles
+    Rect rects[MAX_RECT_COUNT];
+    int rectCount = 0;
+
+    int rectCountTotal = 0;
+    int64_t pixelCount = 0;
+};
+
+} // namespace coco
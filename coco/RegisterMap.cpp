@@ -0,0 +1,171 @@
+#include "RegisterMap.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+RegisterMapBase::RegisterMapBase(Buffer &buffer, const RegisterLayout &layout, uint8_t *shadow, uint32_t *valid,
+    uint32_t *dirty)
+    : buffer(buffer), layout(layout), shadow(shadow), valid(valid), dirty(dirty)
+{
+    this->maxBurst = layout.autoIncrement ? buffer.capacity() - layout.addressSize : 1;
+}
+
+AwaitableCoroutine RegisterMapBase::read(int address, uint8_t &value) {
+    assert(address >= 0 && address < this->layout.registerCount);
+    if (!this->layout.isVolatile(address) && getBit(this->valid, address)) {
+        ++this->hitCount;
+        value = this->shadow[address];
+        co_return;
+    }
+    co_await read(address, &value, 1);
+}
+
+AwaitableCoroutine RegisterMapBase::read(int address, uint8_t *data, int count) {
+    assert(address >= 0 && count >= 0 && address + count <= this->layout.registerCount);
+    while (count > 0) {
+        int n = std::min(count, this->maxBurst);
+        co_await readBurst(address, n);
+        auto d = this->buffer.data();
+        for (int i = 0; i < n; ++i) {
+            int a = address + i;
+            if (this->layout.isVolatile(a)) {
+                data[i] = d[i];
+            } else {
+                // pending value replaces the value on the slave
+                if (!getBit(this->dirty, a)) {
+                    this->shadow[a] = d[i];
+                    setBit(this->valid, a);
+                }
+                data[i] = this->shadow[a];
+            }
+        }
+        address += n;
+        data += n;
+        count -= n;
+    }
+}
+
+AwaitableCoroutine RegisterMapBase::load(int address, int count) {
+    assert(address >= 0 && count >= 0 && address + count <= this->layout.registerCount);
+    while (count > 0) {
+        int n = std::min(count, this->maxBurst);
+        co_await readBurst(address, n);
+        auto d = this->buffer.data();
+        for (int i = 0; i < n; ++i) {
+            int a = address + i;
+            if (!this->layout.isVolatile(a) && !getBit(this->dirty, a)) {
+                this->shadow[a] = d[i];
+                setBit(this->valid, a);
+            }
+        }
+        address += n;
+        count -= n;
+    }
+}
+
+void RegisterMapBase::set(int address, uint8_t value) {
+    assert(address >= 0 && address < this->layout.registerCount);
+    assert(!this->layout.isVolatile(address));
+
+    // skip if the register has the value already
+    if (getBit(this->valid, address) && this->shadow[address] == value) {
+        ++this->skippedWriteCount;
+        return;
+    }
+
+    this->shadow[address] = value;
+    setBit(this->valid, address);
+    setBit(this->dirty, address);
+}
+
+AwaitableCoroutine RegisterMapBase::modify(int address, uint8_t mask, uint8_t value) {
+    uint8_t v;
+    co_await read(address, v);
+    v = (v & ~mask) | (value & mask);
+    if (this->layout.isVolatile(address))
+        co_await write(address, v);
+    else
+        set(address, v);
+}
+
+AwaitableCoroutine RegisterMapBase::flush() {
+    int registerCount = this->layout.registerCount;
+    int address = 0;
+    while (address < registerCount) {
+        if (!getBit(this->dirty, address)) {
+            ++address;
+            continue;
+        }
+
+        // extend the burst over dirty registers and small gaps of unchanged registers with valid shadow copy
+        int end = address + 1;
+        int maxEnd = std::min(address + this->maxBurst, registerCount);
+        for (int a = end; a < maxEnd; ++a) {
+            if (getBit(this->dirty, a))
+                end = a + 1;
+            else if (a - end >= MAX_GAP || this->layout.isVolatile(a) || !getBit(this->valid, a))
+                break;
+        }
+
+        co_await writeBurst(address, end - address);
+        address = end;
+    }
+}
+
+AwaitableCoroutine RegisterMapBase::write(int address, uint8_t value) {
+    assert(address >= 0 && address < this->layout.registerCount);
+    co_await flush();
+    if (!this->layout.isVolatile(address)) {
+        this->shadow[address] = value;
+        setBit(this->valid, address);
+    }
+    setAddress(address, false);
+    this->buffer.data()[0] = value;
+    co_await this->buffer.write(1);
+    ++this->transferCount;
+}
+
+void RegisterMapBase::invalidate() {
+    int wordCount = (this->layout.registerCount + 31) / 32;
+    std::fill(this->valid, this->valid + wordCount, 0);
+    std::fill(this->dirty, this->dirty + wordCount, 0);
+}
+
+void RegisterMapBase::setAddress(int address, bool read) {
+    auto &layout = this->layout;
+    address += layout.baseAddress;
+    uint8_t flags = (read ? layout.readFlag : 0) | layout.incrementFlag;
+    if (layout.addressSize == 1) {
+        uint8_t header[] = {uint8_t(flags | address)};
+        this->buffer.setHeader(header);
+    } else {
+        uint8_t header[] = {uint8_t(flags | (address >> 8)), uint8_t(address)};
+        this->buffer.setHeader(header);
+    }
+}
+
+AwaitableCoroutine RegisterMapBase::readBurst(int address, int count) {
+    // set header each time as reading overwrites it
+    setAddress(address, true);
+    co_await this->buffer.read(count);
+    ++this->transferCount;
+}
+
+AwaitableCoroutine RegisterMapBase::writeBurst(int address, int count) {
+    setAddress(address, false);
+    auto d = this->buffer.data();
+    std::copy(this->shadow + address, this->shadow + address + count, d);
+    co_await this->buffer.write(count);
+    ++this->transferCount;
+
+    // clear dirty bits when the write has completed so that a read in the meantime does not replace the pending
+    // values, registers that were set to a new value in the meantime stay dirty
+    for (int i = 0; i < count; ++i) {
+        int a = address + i;
+        if (this->shadow[a] == d[i])
+            clearBit(this->dirty, a);
+    }
+}
+
+} // namespace coco
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <coco/Buffer.hpp>
+#include <coco/Coroutine.hpp>
+
+
+namespace coco {
+
+/**
+ * Compile-time description of the register map of a SPI slave such as a sensor or display controller (see
+ * RegisterMap). A transfer starts with the address bytes, the first contains the read flag and the (upper) address bits.
+ * A map covers at most 256 consecutive registers starting at baseAddress, with 16 bit addresses it is a window of the
+ * address space. Addresses passed to RegisterMap are relative to baseAddress.
+ * Example:
+ *   constexpr auto LAYOUT = RegisterLayout{.registerCount = 64, .readFlag = 0x80}.withVolatile(0x27, 7);
+ */
+struct RegisterLayout {
+    static constexpr int MAX_REGISTER_COUNT = 256;
+
+    // number of registers
+    int registerCount = 128;
+
+    // address of the first register on the bus
+    int baseAddress = 0;
+
+    // size of the address in bytes (1 or 2)
+    int addressSize = 1;
+
+    // flag in the first address byte that indicates read
+    uint8_t readFlag = 0x80;
+
+    // flag in the first address byte that enables auto increment (e.g. 0x40), 0 if not needed
+    uint8_t incrementFlag = 0;
+
+    // set if consecutive registers can be accessed in one burst
+    bool autoIncrement = true;
+
+    // volatile registers (status, data, commands) that are not cached, one bit per register
+    uint32_t volatileMask[MAX_REGISTER_COUNT / 32] = {};
+
+    /**
+     * Get a copy of the layout where the given registers are volatile
+     * @param address address of first volatile register
+     * @param count number of volatile registers
+     */
+    constexpr RegisterLayout withVolatile(int address, int count = 1) const {
+        RegisterLayout layout = *this;
+        for (int i = address; i < address + count; ++i)
+            layout.volatileMask[i >> 5] |= 1u << (i & 31);
+        return layout;
+    }
+
+    /**
+     * Check if a register is volatile
+     */
+    constexpr bool isVolatile(int address) const {return ((this->volatileMask[address >> 5] >> (address & 31)) & 1) != 0;}
+
+    /**
+     * Check if the bus addresses of all registers fit into the address bytes without overlapping the read and increment
+     * flags in the first address byte
+     */
+    constexpr bool isAddressValid() const {
+        int shift = (this->addressSize - 1) * 8;
+        for (int address = this->baseAddress; address < this->baseAddress + this->registerCount; ++address) {
+            if ((address >> shift) > 0xff || ((address >> shift) & (this->readFlag | this->incrementFlag)) != 0)
+                return false;
+        }
+        return true;
+    }
+};
+
+/**
+ * Register map of a SPI slave with a shadow copy of the non-volatile registers on a buffer of a channel.
+ * Read-modify-write cycles on cached registers need no bus access, writes are deferred until flush() which skips
+ * registers that already have the written value and merges adjacent dirty registers into burst writes (also across
+ * small gaps of unchanged registers). Volatile registers are always accessed on the bus.
+ * Note that deferred writes get reordered, therefore call flush() where the slave needs a defined order
+ */
+class RegisterMapBase {
+public:
+    /**
+     * Constructor
+     * @param buffer buffer for register transfers, its capacity limits the length of bursts
+     * @param layout layout of the register map
+     * @param shadow shadow copy of the registers
+     * @param valid one bit per register that indicates a valid shadow copy
+     * @param dirty one bit per register that indicates a pending write
+     */
+    RegisterMapBase(Buffer &buffer, const RegisterLayout &layout, uint8_t *shadow, uint32_t *valid, uint32_t *dirty);
+
+    /**
+     * Read a register. Non-volatile registers are returned from the shadow copy after they were read or set once
+     * @param address address of register
+     * @param value value of the register
+     */
+    [[nodiscard]] AwaitableCoroutine read(int address, uint8_t &value);
+
+    /**
+     * Read consecutive registers from the slave in bursts, updates the shadow copy of non-volatile registers. Registers
+     * with a pending write return the pending value
+     * @param address address of first register
+     * @param data data to read into
+     * @param count number of registers
+     */
+    [[nodiscard]] AwaitableCoroutine read(int address, uint8_t *data, int count);
+
+    /**
+     * Load consecutive registers into the shadow copy in bursts, e.g. before a configuration sequence
+     * @param address address of first register
+     * @param count number of registers
+     */
+    [[nodiscard]] AwaitableCoroutine load(int address, int count);
+
+    /**
+     * Set a non-volatile register. The write is deferred until flush() and skipped if the register has the value already
+     * @param address address of register
+     * @param value new value of the register
+     */
+    void set(int address, uint8_t value);
+
+    /**
+     * Modify bits of a register. Reads the register only if it is volatile or not in the shadow copy, the write of
+     * a non-volatile register is deferred until flush()
+     * @param address address of register
+     * @param mask bits to modify
+     * @param value new value of the bits
+     */
+    [[nodiscard]] AwaitableCoroutine modify(int address, uint8_t mask, uint8_t value);
+
+    /**
+     * Write all pending registers
+     */
+    [[nodiscard]] AwaitableCoroutine flush();
+
+    /**
+     * Write a register immediately (e.g. a volatile command register) after the pending registers were written
+     * @param address address of register
+     * @param value value to write
+     */
+    [[nodiscard]] AwaitableCoroutine write(int address, uint8_t value);
+
+    /**
+     * Invalidate the shadow copy and discard pending writes, e.g. after a reset of the slave
+     */
+    void invalidate();
+
+    /**
+     * Statistics
+     */
+    int getTransferCount() {return this->transferCount;}
+    int getHitCount() {return this->hitCount;}
+    int getSkippedWriteCount() {return this->skippedWriteCount;}
+
+protected:
+    // maximum number of unchanged registers between dirty registers that get rewritten to merge two bursts, cheaper
+    // than a second transfer with address and gap between transfers
+    static constexpr int MAX_GAP = 2;
+
+    static bool getBit(const uint32_t *bits, int address) {return ((bits[address >> 5] >> (address & 31)) & 1) != 0;}
+    static void setBit(uint32_t *bits, int address) {bits[address >> 5] |= 1u << (address & 31);}
+    static void clearBit(uint32_t *bits, int address) {bits[address >> 5] &= ~(1u << (address & 31));}
+
+    // set address and read flag as header of the buffer
+    void setAddress(int address, bool read);
+
+    // transfer a burst of registers from or to the slave
+    [[nodiscard]] AwaitableCoroutine readBurst(int address, int count);
+    [[nodiscard]] AwaitableCoroutine writeBurst(int address, int count);
+
+    Buffer &buffer;
+    const RegisterLayout &layout;
+    uint8_t *shadow;
+    uint32_t *valid;
+    uint32_t *dirty;
+
+    // maximum number of registers in a burst
+    int maxBurst;
+
+    int transferCount = 0;
+    int hitCount = 0;
+    int skippedWriteCount = 0;
+};
+
+/**
+ * Register map with shadow copy
+ * @tparam L layout of the register map
+ */
+template <RegisterLayout L>
+class RegisterMap : public RegisterMapBase {
+public:
+    static_assert(L.registerCount > 0 && L.registerCount <= RegisterLayout::MAX_REGISTER_COUNT);
+    static_assert(L.addressSize == 1 || L.addressSize == 2);
+    static_assert(L.baseAddress >= 0 && L.isAddressValid(), "register addresses overlap the read or increment flag");
+
+    RegisterMap(Buffer &buffer) : RegisterMapBase(buffer, L, shadow, valid, dirty) {}
+
+protected:
+    static constexpr int WORD_COUNT = (L.registerCount + 31) / 32;
+
+    uint8_t shadow[L.registerCount];
+    uint32_t valid[WORD_COUNT] = {};
+    uint32_t dirty[WORD_COUNT] = {};
+};
+
+} // namespace coco
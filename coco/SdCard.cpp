@@ -0,0 +1,389 @@
+#include "SdCard.hpp"
+#include <coco/SpiCrc.hpp>
+#include <algorithm>
+#include <cstring>
+
+
+namespace coco {
+
+// tokens
+constexpr uint8_t START_BLOCK = 0xfe; // single-block read/write, multi-block read
+constexpr uint8_t START_BLOCK_MULTIPLE = 0xfc; // multi-block write
+constexpr uint8_t STOP_TRANSMISSION = 0xfd; // multi-block write
+
+// number of bytes read per poll when waiting for the end of the busy state
+constexpr int BUSY_POLL_SIZE = 8;
+
+// number of bytes read per poll when waiting for the start token of a data block, the bytes after the token already
+// belong to the block
+constexpr int TOKEN_POLL_SIZE = 8;
+
+// start reading and keep CS active: The masters send the contents of the buffer while reading, therefore fill it with
+// 0xff to keep MOSI high, otherwise the card may receive stale data that looks like a command (e.g. CMD12)
+static void startRead(Buffer &buffer, int size) {
+    buffer.resize(size);
+    std::fill(buffer.data(), buffer.data() + size, 0xff);
+    buffer.start(Buffer::Op::READ | Buffer::Op::PARTIAL);
+}
+
+// copy a block whose first bytes were read ahead when polling for the start token
+static void copyBlock(uint8_t *dst, const uint8_t *head, int headCount, const uint8_t *data) {
+    std::memcpy(dst, head, headCount);
+    std::memcpy(dst + headCount, data, SdCard::BLOCK_SIZE - headCount);
+}
+
+SdCard::SdCard(Buffer &command, Buffer &buffer1, Buffer &buffer2, Buffer *clock)
+    : cmd(command), buffers{&buffer1, &buffer2}, clock(clock)
+{
+}
+
+AwaitableCoroutine SdCard::init() {
+    auto &cmd = this->cmd;
+    this->initialized = false;
+
+    // at least 74 clocks with MOSI high, with CS high if a buffer on a different channel is available
+    auto &clock = this->clock != nullptr ? *this->clock : cmd;
+    clock.clearHeader();
+    std::fill(clock.data(), clock.data() + 10, 0xff);
+    co_await clock.write(10);
+
+    // go idle state (CMD0)
+    int retry = 0;
+    do {
+        co_await command(0, 0);
+    } while (this->r1 != 0x01 && ++retry < 10);
+    if (this->r1 != 0x01) {
+        ++this->errorCount;
+        co_await release();
+        co_return;
+    }
+
+    // send interface condition (CMD8) with check pattern, SD v1 cards reject it as illegal command
+    co_await command(8, 0x1aa, 4);
+    bool v2 = (this->r1 & 0x04) == 0;
+    if (v2 && cmd.data()[3] != 0xaa) {
+        ++this->errorCount;
+        co_await release();
+        co_return;
+    }
+
+    // initialize (ACMD41) until the card leaves the idle state, announce support of high capacity cards for SD v2
+    retry = 0;
+    do {
+        co_await appCommand(41, v2 ? 0x40000000 : 0);
+    } while (this->r1 == 0x01 && ++retry < 10000);
+    if (this->r1 != 0) {
+        ++this->errorCount;
+        co_await release();
+        co_return;
+    }
+
+    // read OCR (CMD58) to get the card capacity status (CCS)
+    this->blockAddressing = false;
+    if (v2) {
+        co_await command(58, 0, 4);
+        this->blockAddressing = (cmd.data()[0] & 0x40) != 0;
+    }
+
+    // set block length of standard capacity cards (CMD16)
+    if (!this->blockAddressing)
+        co_await command(16, BLOCK_SIZE);
+
+    co_await release();
+    this->initialized = this->r1 == 0;
+}
+
+AwaitableCoroutine SdCard::read(int block, void *data, int count) {
+    // single (CMD17) or multiple (CMD18) block read
+    co_await command(count == 1 ? 17 : 18, address(block));
+    if (this->r1 != 0) {
+        ++this->errorCount;
+        co_await release();
+        co_return;
+    }
+
+    auto dst = reinterpret_cast<uint8_t *>(data);
+    uint8_t heads[2][TOKEN_POLL_SIZE - 1];
+    int headCounts[2];
+    int previous = -1;
+    for (int i = 0; i < count; ++i) {
+        // wait for start token, gets queued after the transfer of the previous block
+        co_await pollToken(100000);
+        if (this->r1 != START_BLOCK) {
+            ++this->errorCount;
+            break;
+        }
+
+        // keep the start of the block that was read ahead, then read the rest of the block and CRC
+        int current = i & 1;
+        int headCount = TOKEN_POLL_SIZE - 1 - this->tokenIndex;
+        std::memcpy(heads[current], this->cmd.data() + this->tokenIndex + 1, headCount);
+        headCounts[current] = headCount;
+        auto &buffer = *this->buffers[current];
+        buffer.clearHeader();
+        startRead(buffer, BLOCK_SIZE + 2 - headCount);
+        ++this->blockReadCount;
+
+        // copy previous block while the current block is transferring
+        if (previous != -1) {
+            copyBlock(dst, heads[previous], headCounts[previous], this->buffers[previous]->data());
+            dst += BLOCK_SIZE;
+        }
+        previous = current;
+    }
+    if (previous != -1) {
+        auto &buffer = *this->buffers[previous];
+        co_await buffer.untilReadyOrDisabled();
+        copyBlock(dst, heads[previous], headCounts[previous], buffer.data());
+    }
+
+    // stop transmission (CMD12)
+    if (count > 1) {
+        co_await command(12, 0);
+        co_await waitReady();
+    }
+    co_await release();
+}
+
+AwaitableCoroutine SdCard::write(int block, const void *data, int count) {
+    if (count > 1) {
+        // multiple block write with pre-erase
+        co_await startStream(block, count);
+        if (!this->streaming)
+            co_return;
+        co_await append(data, count * BLOCK_SIZE);
+        co_await stopStream();
+        co_return;
+    }
+
+    // single block write (CMD24)
+    co_await command(24, address(block));
+    if (this->r1 != 0) {
+        ++this->errorCount;
+        co_await release();
+        co_return;
+    }
+
+    // set header first as it may move the data
+    auto &buffer = *this->buffers[this->index];
+    co_await buffer.untilReadyOrDisabled();
+    uint8_t token[] = {START_BLOCK};
+    buffer.setHeader(token);
+    std::memcpy(buffer.data(), data, BLOCK_SIZE);
+    startBlock(buffer);
+    this->index ^= 1;
+
+    co_await waitWritten();
+    co_await release();
+}
+
+AwaitableCoroutine SdCard::startStream(int block, int count) {
+    // set number of blocks to pre-erase (ACMD23)
+    if (count > 0) {
+        co_await appCommand(23, count);
+        if (this->r1 != 0)
+            ++this->errorCount;
+    }
+
+    // write multiple blocks (CMD25)
+    co_await command(25, address(block));
+    if (this->r1 != 0) {
+        ++this->errorCount;
+        co_await release();
+        co_return;
+    }
+
+    this->streaming = true;
+    this->fill = 0;
+}
+
+AwaitableCoroutine SdCard::append(const void *data, int size) {
+    assert(this->streaming);
+    auto src = reinterpret_cast<const uint8_t *>(data);
+    while (size > 0) {
+        auto &buffer = *this->buffers[this->index];
+        if (this->fill == 0) {
+            // wait until the buffer has been transferred, then set header first as it may move the data
+            co_await buffer.untilReadyOrDisabled();
+            uint8_t token[] = {START_BLOCK_MULTIPLE};
+            buffer.setHeader(token);
+        }
+
+        // fill block
+        int n = std::min(size, BLOCK_SIZE - this->fill);
+        std::memcpy(buffer.data() + this->fill, src, n);
+        this->fill += n;
+        src += n;
+        size -= n;
+
+        if (this->fill == BLOCK_SIZE) {
+            // wait until the card has programmed the previous block, then transfer this block and fill the other buffer
+            co_await waitWritten();
+            startBlock(buffer);
+            this->index ^= 1;
+            this->fill = 0;
+        }
+    }
+}
+
+AwaitableCoroutine SdCard::stopStream() {
+    assert(this->streaming);
+    auto &cmd = this->cmd;
+
+    // pad and transfer last block
+    if (this->fill > 0) {
+        auto &buffer = *this->buffers[this->index];
+        std::fill(buffer.data() + this->fill, buffer.data() + BLOCK_SIZE, 0xff);
+        co_await waitWritten();
+        startBlock(buffer);
+        this->index ^= 1;
+        this->fill = 0;
+    }
+    co_await waitWritten();
+
+    // stop token and one stuff byte, then wait until the card has finished
+    cmd.clearHeader();
+    cmd.data()[0] = STOP_TRANSMISSION;
+    cmd.data()[1] = 0xff;
+    cmd.resize(2);
+    cmd.start(Buffer::Op::WRITE | Buffer::Op::PARTIAL);
+    co_await cmd.untilReadyOrDisabled();
+    co_await waitReady();
+    co_await release();
+
+    this->streaming = false;
+}
+
+AwaitableCoroutine SdCard::command(int index, uint32_t argument, int responseSize) {
+    auto &cmd = this->cmd;
+
+    // command, argument and CRC7 (only checked for CMD0 and CMD8 unless CRC is enabled)
+    uint8_t header[] = {uint8_t(0x40 | index), uint8_t(argument >> 24), uint8_t(argument >> 16), uint8_t(argument >> 8),
+        uint8_t(argument), 0};
+    header[5] = (crc7(header, 5) << 1) | 1;
+    cmd.setHeader(header);
+
+    // read first response byte, keep CS active
+    startRead(cmd, 1);
+    co_await cmd.untilReadyOrDisabled();
+    this->r1 = cmd.data()[0];
+
+    // poll for R1 if the card needs more time (NCR), the first byte after CMD12 is a stuff byte
+    if (this->r1 == 0xff || index == 12)
+        co_await poll(8);
+
+    // read additional response bytes (e.g. R3, R7)
+    if (responseSize > 0) {
+        cmd.clearHeader();
+        startRead(cmd, responseSize);
+        co_await cmd.untilReadyOrDisabled();
+    }
+}
+
+AwaitableCoroutine SdCard::appCommand(int index, uint32_t argument) {
+    co_await command(55, 0);
+    co_await command(index, argument);
+}
+
+AwaitableCoroutine SdCard::poll(int maxCount) {
+    auto &cmd = this->cmd;
+    cmd.clearHeader();
+    for (int i = 0; i < maxCount; ++i) {
+        startRead(cmd, 1);
+        co_await cmd.untilReadyOrDisabled();
+        this->r1 = cmd.data()[0];
+        if (this->r1 != 0xff)
+            break;
+    }
+}
+
+AwaitableCoroutine SdCard::pollToken(int maxCount) {
+    auto &cmd = this->cmd;
+    cmd.clearHeader();
+    for (int i = 0; i < maxCount; i += TOKEN_POLL_SIZE) {
+        startRead(cmd, TOKEN_POLL_SIZE);
+        co_await cmd.untilReadyOrDisabled();
+        ++this->tokenPollCount;
+        auto data = cmd.data();
+        for (int j = 0; j < TOKEN_POLL_SIZE; ++j) {
+            if (data[j] != 0xff) {
+                this->r1 = data[j];
+                this->tokenIndex = j;
+                co_return;
+            }
+        }
+    }
+    this->r1 = 0xff;
+}
+
+AwaitableCoroutine SdCard::waitWritten() {
+    if (!this->written)
+        co_return;
+    this->written = false;
+    auto &cmd = this->cmd;
+
+    // the first poll was queued after the block (see startBlock())
+    co_await cmd.untilReadyOrDisabled();
+
+    // find data response token, then wait until the card releases MISO (end of busy state)
+    int response = -1;
+    for (int i = 0; i < 100000; ++i) {
+        auto data = cmd.data();
+        for (int j = 0; j < BUSY_POLL_SIZE; ++j) {
+            uint8_t b = data[j];
+            if (response == -1) {
+                if (b != 0xff)
+                    response = b;
+            } else if (b == 0xff) {
+                // accepted: xxx00101
+                if ((response & 0x1f) != 0x05)
+                    ++this->errorCount;
+                co_return;
+            }
+        }
+
+        ++this->busyPollCount;
+        startRead(cmd, BUSY_POLL_SIZE);
+        co_await cmd.untilReadyOrDisabled();
+    }
+    ++this->errorCount;
+}
+
+AwaitableCoroutine SdCard::waitReady() {
+    auto &cmd = this->cmd;
+    cmd.clearHeader();
+    for (int i = 0; i < 100000; ++i) {
+        startRead(cmd, BUSY_POLL_SIZE);
+        co_await cmd.untilReadyOrDisabled();
+        if (cmd.data()[BUSY_POLL_SIZE - 1] == 0xff)
+            co_return;
+        ++this->busyPollCount;
+    }
+    ++this->errorCount;
+}
+
+void SdCard::startBlock(Buffer &buffer) {
+    // data and CRC (not checked by the card unless enabled)
+    auto data = buffer.data();
+    data[BLOCK_SIZE] = 0xff;
+    data[BLOCK_SIZE + 1] = 0xff;
+    buffer.resize(BLOCK_SIZE + 2);
+    buffer.start(Buffer::Op::WRITE | Buffer::Op::PARTIAL);
+    ++this->blockWriteCount;
+
+    // queue first poll for the data response directly after the block
+    auto &cmd = this->cmd;
+    cmd.clearHeader();
+    startRead(cmd, BUSY_POLL_SIZE);
+    this->written = true;
+}
+
+AwaitableCoroutine SdCard::release() {
+    // one byte without Op::PARTIAL deactivates CS at the end
+    auto &cmd = this->cmd;
+    cmd.clearHeader();
+    cmd.data()[0] = 0xff;
+    co_await cmd.write(1);
+}
+
+} // namespace coco
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <coco/Buffer.hpp>
+#include <coco/Coroutine.hpp>
+
+
+namespace coco {
+
+/**
+ * Driver for SD cards in SPI mode on a channel of a SPI master.
+ * Features:
+ *   Initialization of SD v1 and v2 cards (byte and block addressing)
+ *   Multi-block read (CMD18) where copying a block overlaps the transfer of the next block
+ *   Multi-block write (CMD25) with pre-erase hint (ACMD23)
+ *   Streaming for logging: Data gets collected in two block buffers alternately, the next block is filled while the
+ *   current block is transferring and the card is programming
+ *
+ * The transfers of a command keep CS active (Op::PARTIAL), therefore the start and stop tokens, the data response
+ * and the first busy poll follow the data blocks directly in the interrupt handler of the master without a round
+ * trip through the event loop. The start token of a read block is polled several bytes at a time, the bytes after the
+ * token are kept as start of the block.
+ * The card needs the bus exclusively from a command until CS gets released at its end: The master deactivates CS
+ * that is kept active by Op::PARTIAL when a different channel transfers, which aborts a multi-block transfer.
+ * Therefore do not start transfers on other channels of the master while an operation of the card is running.
+ * Uses three buffers of the channel: A command buffer with capacity >= 16 and two block buffers with capacity
+ * >= 1 + BLOCK_SIZE + 2 (token, data and CRC). The data CRC is not checked by the card (default in SPI mode).
+ * Initialize the card on a clock <= 400kHz, then increase the clock of the channel (see Channel::setSpeed()).
+ * The card expects at least 74 wake-up clocks with CS high before the first command. The masters have no transfer
+ * without CS, therefore pass a buffer on a different channel of the same master (e.g. one whose CS is not connected)
+ * for the clocks. Without it the clocks are sent on the command buffer with CS low which most cards accept.
+ */
+class SdCard {
+public:
+    static constexpr int BLOCK_SIZE = 512;
+
+    /**
+     * Constructor
+     * @param command buffer for commands and polling
+     * @param buffer1 first block buffer
+     * @param buffer2 second block buffer
+     * @param clock optional buffer with capacity >= 10 on a different channel for the wake-up clocks with CS high
+     */
+    SdCard(Buffer &command, Buffer &buffer1, Buffer &buffer2, Buffer *clock = nullptr);
+
+    /**
+     * Initialize the card, check ready() for success
+     */
+    [[nodiscard]] AwaitableCoroutine init();
+
+    /**
+     * Check if the card was initialized successfully
+     */
+    bool ready() {return this->initialized;}
+
+    /**
+     * Read blocks
+     * @param block index of first block
+     * @param data data to read into
+     * @param count number of blocks
+     */
+    [[nodiscard]] AwaitableCoroutine read(int block, void *data, int count);
+
+    /**
+     * Write blocks
+     * @param block index of first block
+     * @param data data to write
+     * @param count number of blocks
+     */
+    [[nodiscard]] AwaitableCoroutine write(int block, const void *data, int count);
+
+    /**
+     * Start streaming data to consecutive blocks, e.g. for logging
+     * @param block index of first block
+     * @param count expected number of blocks, used as pre-erase hint (ACMD23), 0 if unknown
+     */
+    [[nodiscard]] AwaitableCoroutine startStream(int block, int count = 0);
+
+    /**
+     * Append data to the stream. A block gets transferred as soon as it is full
+     * @param data data to append
+     * @param size size of data
+     */
+    [[nodiscard]] AwaitableCoroutine append(const void *data, int size);
+
+    /**
+     * Stop streaming. A partially filled last block gets padded with 0xff
+     */
+    [[nodiscard]] AwaitableCoroutine stopStream();
+
+    /**
+     * Statistics
+     */
+    int getBlockReadCount() {return this->blockReadCount;}
+    int getBlockWriteCount() {return this->blockWriteCount;}
+    int getBusyPollCount() {return this->busyPollCount;}
+    int getTokenPollCount() {return this->tokenPollCount;}
+    int getErrorCount() {return this->errorCount;}
+
+protected:
+    // send a command and receive the R1 response and optional additional response bytes into the command buffer
+    [[nodiscard]] AwaitableCoroutine command(int index, uint32_t argument, int responseSize = 0);
+
+    // send an application command (CMD55 followed by the command)
+    [[nodiscard]] AwaitableCoroutine appCommand(int index, uint32_t argument);
+
+    // poll until the card returns a non-0xff byte (e.g. R1 or start token), the byte is stored in this->r1
+    [[nodiscard]] AwaitableCoroutine poll(int maxCount);
+
+    // poll several bytes at a time until the card returns a start token, the token is stored in this->r1 and its index
+    // in the command buffer in this->tokenIndex
+    [[nodiscard]] AwaitableCoroutine pollToken(int maxCount);
+
+    // wait for the data response of the last written block and until the card has finished programming
+    [[nodiscard]] AwaitableCoroutine waitWritten();
+
+    // wait until the card is not busy anymore
+    [[nodiscard]] AwaitableCoroutine waitReady();
+
+    // start transfer of a data block whose token was set as header and poll for the data response, does not wait
+    void startBlock(Buffer &buffer);
+
+    // release CS by a transfer without Op::PARTIAL
+    [[nodiscard]] AwaitableCoroutine release();
+
+    // address of a block (byte address for standard capacity cards)
+    uint32_t address(int block) {return this->blockAddressing ? block : block * BLOCK_SIZE;}
+
+    Buffer &cmd;
+    Buffer *buffers[2];
+    Buffer *clock;
+
+    bool initialized = false;
+    bool blockAddressing = false;
+
+    // response of last command or poll
+    uint8_t r1;
+
+    // index of the start token in the command buffer after pollToken()
+    int tokenIndex;
+
+    // set when the data response of a written block is pending
+    bool written = false;
+
+    // streaming: index of buffer that gets filled, fill level
+    bool streaming = false;
+    int index = 0;
+    int fill = 0;
+
+    int blockReadCount = 0;
+    int blockWriteCount = 0;
+    int busyPollCount = 0;
+    int tokenPollCount = 0;
+    int errorCount = 0;
+};
+
+} // namespace coco
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <coco/Buffer.hpp>
+#include <coco/Coroutine.hpp>
+#include <algorithm>
+
+
+namespace coco {
+
+/**
+ * Readback check for calibrate(): Reads a register with known content (e.g. WHO_AM_I or JEDEC ID) and compares it with
+ * the expected value.
+ * @tparam H size of the header (command and address)
+ * @tparam N size of the expected value
+ */
+template <int H, int N>
+struct SpiReadbackCheck {
+    /**
+     * Constructor
+     * @param buffer buffer on the channel to calibrate
+     * @param header header (command and address) to read the register
+     * @param expected expected value of the register
+     */
+    SpiReadbackCheck(Buffer &buffer, const uint8_t (&header)[H], const uint8_t (&expected)[N])
+        : buffer(buffer)
+    {
+        for (int i = 0; i < H; ++i)
+            this->header[i] = header[i];
+        for (int i = 0; i < N; ++i)
+            this->expected[i] = expected[i];
+    }
+
+    /**
+     * Read the register once
+     * @param ok set to true if the register has the expected value
+     */
+    [[nodiscard]] AwaitableCoroutine operator ()(bool &ok) {
+        this->buffer.setHeader(this->header);
+        co_await this->buffer.read(N);
+        ok = this->buffer.size() == N;
+        const uint8_t *data = this->buffer.data();
+        for (int i = 0; i < N; ++i) {
+            if (data[i] != this->expected[i])
+                ok = false;
+        }
+    }
+
+    Buffer &buffer;
+    uint8_t header[H];
+    uint8_t expected[N];
+};
+
+/**
+ * Find the fastest reliable clock of a channel: Steps the speed level of the channel (see Channel::setSpeed()) up from
+ * the configured clock and runs the check repeatedly on each level until a check fails or the maximum level is reached.
+ * The channel is left on the highest level where all checks passed, reduced by the margin (but not below level 0). The
+ * margin is applied also when the maximum level passes, because passing checks do not prove that the clock is reliable
+ * across temperature and supply voltage. Store the level to restore it with setSpeed() after a reset instead of
+ * calibrating again.
+ * @tparam C channel type (e.g. SpiMaster_SPI_DMA::Channel)
+ * @tparam F check type, e.g. SpiReadbackCheck or a lambda that returns an AwaitableCoroutine and takes a bool &
+ * @param channel channel to calibrate
+ * @param check check that sets its bool argument to true if the transfer was correct
+ * @param level set to the chosen level or -1 if the check fails on the configured clock, then the channel is left on
+ *   level 0
+ * @param repeat number of checks each level has to pass
+ * @param margin safety margin in levels below the highest passing level
+ */
+template <typename C, typename F>
+[[nodiscard]] AwaitableCoroutine calibrate(C &channel, F &check, int &level, int repeat = 8, int margin = 1) {
+    int maxLevel = channel.getMaxSpeed();
+    int passed = -1;
+    for (int l = 0; l <= maxLevel; ++l) {
+        channel.setSpeed(l);
+        bool ok = true;
+        for (int i = 0; i < repeat && ok; ++i) {
+            ok = false;
+            co_await check(ok);
+        }
+        if (!ok)
+            break;
+        passed = l;
+    }
+
+    // error if even the configured clock fails, otherwise the highest passing level reduced by the margin
+    level = passed < 0 ? -1 : std::max(passed - margin, 0);
+    channel.setSpeed(std::max(level, 0));
+}
+
+} // namespace coco
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <coco/Buffer.hpp>
+#include <concepts>
+
+
+namespace coco {
+
+/**
+ * Concepts for SPI drivers that are templates over the concrete types of a SPI master (e.g. SpiMaster_SPI_DMA,
+ * SpiMaster_SPIM3 or SpiMaster_native) instead of using the virtual interfaces coco::Buffer and BufferDevice. The
+ * Buffer and BufferDevice methods of the masters are final, therefore calls on the concrete types get resolved at
+ * compile time and can be inlined. Note that the transfer methods of coco::Buffer such as read() call start() through
+ * the vtable, use spi::read(), spi::write() and spi::transfer() instead.
+ * Example, the buffer type gets deduced from the argument (e.g. SpiMaster_SPI_DMA::Buffer<16>):
+ *   template <SpiBufferType B>
+ *   AwaitableCoroutine readSample(B &buffer) {
+ *       buffer.setHeader(command);
+ *       co_await spi::read(buffer, 6);
+ *   }
+ * A driver that needs the master types takes the master as explicit template argument, e.g.
+ * template <SpiMasterType M> class Sensor with a member typename M::template Buffer<16>.
+ */
+
+/**
+ * Buffer of a SPI channel, also satisfied by coco::Buffer itself (virtual dispatch)
+ */
+template <typename B>
+concept SpiBufferType = std::derived_from<B, Buffer> && requires(B &buffer, Buffer::Op op) {
+    {buffer.start(op)} -> std::same_as<bool>;
+    {buffer.cancel()} -> std::same_as<bool>;
+};
+
+/**
+ * Virtual channel of a SPI master that drives the CS pin of a slave
+ */
+template <typename C>
+concept SpiChannelType = requires(C &channel, int index) {
+    {channel.getBufferCount()} -> std::same_as<int>;
+    {channel.getBuffer(index)} -> std::convertible_to<Buffer &>;
+    channel.setSpeed(index);
+    {channel.getSpeed()} -> std::same_as<int>;
+    {channel.getMaxSpeed()} -> std::same_as<int>;
+};
+
+/**
+ * SPI master with virtual channels and buffers of the given capacity (Buffer<C>)
+ */
+template <typename M>
+concept SpiMasterType = requires {
+    typename M::Channel;
+    typename M::BufferBase;
+    typename M::template Buffer<1>;
+} && SpiChannelType<typename M::Channel> && SpiBufferType<typename M::BufferBase>
+    && std::derived_from<typename M::template Buffer<1>, typename M::BufferBase>
+    && std::constructible_from<typename M::template Buffer<1>, typename M::Channel &>;
+
+namespace spi {
+
+/**
+ * Read data into a buffer after sending its header, calls start() of the concrete buffer type
+ * @param buffer buffer
+ * @param size number of bytes to read after the header
+ * @return awaitable that completes when the buffer is ready again
+ */
+template <SpiBufferType B>
+[[nodiscard]] inline auto read(B &buffer, int size) {
+    buffer.resize(size);
+    buffer.start(Buffer::Op::READ);
+    return buffer.untilReadyOrDisabled();
+}
+
+/**
+ * Write header and data of a buffer, calls start() of the concrete buffer type
+ * @param buffer buffer
+ * @param size number of bytes to write after the header
+ * @return awaitable that completes when the buffer is ready again
+ */
+template <SpiBufferType B>
+[[nodiscard]] inline auto write(B &buffer, int size) {
+    buffer.resize(size);
+    buffer.start(Buffer::Op::WRITE);
+    return buffer.untilReadyOrDisabled();
+}
+
+/**
+ * Write header and data of a buffer and read into the data at the same time, calls start() of the concrete buffer type
+ * @param buffer buffer
+ * @param size number of bytes to transfer after the header
+ * @return awaitable that completes when the buffer is ready again
+ */
+template <SpiBufferType B>
+[[nodiscard]] inline auto transfer(B &buffer, int size) {
+    buffer.resize(size);
+    buffer.start(Buffer::Op::READ_WRITE);
+    return buffer.untilReadyOrDisabled();
+}
+
+} // namespace spi
+} // namespace coco
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+
+
+namespace coco {
+
+/**
+ * CRC configuration of a SPI buffer (see setCrc() of the buffers of the SPI masters). The CRC covers the data phase of
+ * a transfer, i.e. the bytes after the header, it is computed MSB first with initial value 0 as the CRC unit of the
+ * STM32 SPI peripheral does. Examples are CRC16_CCITT for SD card data blocks and CRC8 for sensor protocols.
+ */
+struct SpiCrc {
+    enum class Result : uint8_t {
+        // CRC not enabled or transfer did not read
+        NONE,
+
+        // received CRC matches the data
+        OK,
+
+        // received CRC does not match the data
+        ERROR
+    };
+
+    // width of the CRC in bits (0, 8 or 16)
+    uint8_t width = 0;
+
+    // polynomial without the highest bit
+    uint16_t polynomial = 0;
+
+    /**
+     * Get number of CRC bytes that get appended to the data
+     */
+    constexpr int byteCount() const {return this->width >> 3;}
+
+    /**
+     * Compute the CRC in software
+     * @param data data
+     * @param size size of data
+     * @param crc initial value or CRC of preceding data
+     * @return CRC
+     */
+    constexpr uint16_t compute(const uint8_t *data, int size, uint16_t crc = 0) const {
+        int shift = this->width - 8;
+        uint16_t mask = this->width == 16 ? 0xffff : 0xff;
+        for (int i = 0; i < size; ++i) {
+            crc ^= data[i] << shift;
+            for (int j = 0; j < 8; ++j) {
+                if ((crc >> (this->width - 1)) & 1)
+                    crc = (crc << 1) ^ this->polynomial;
+                else
+                    crc <<= 1;
+            }
+            crc &= mask;
+        }
+        return crc;
+    }
+};
+
+// no CRC
+constexpr SpiCrc SPI_CRC_NONE = {};
+
+// CRC-8 (x^8 + x^2 + x + 1)
+constexpr SpiCrc SPI_CRC8 = {8, 0x07};
+
+// CRC-16-CCITT (x^16 + x^12 + x^5 + 1), e.g. for SD card data blocks
+constexpr SpiCrc SPI_CRC16_CCITT = {16, 0x1021};
+
+/**
+ * Compute CRC7 (x^7 + x^3 + 1) as used by SD card commands in software. The command token contains (crc << 1) | 1
+ * @param data data
+ * @param size size of data
+ * @return CRC7
+ */
+constexpr uint8_t crc7(const uint8_t *data, int size) {
+    uint8_t crc = 0;
+    for (int i = 0; i < size; ++i) {
+        uint8_t d = data[i];
+        for (int j = 0; j < 8; ++j) {
+            crc <<= 1;
+            if (((d << j) ^ crc) & 0x80)
+                crc ^= 0x09;
+        }
+    }
+    return crc & 0x7f;
+}
+
+} // namespace coco
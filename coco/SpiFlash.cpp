@@ -0,0 +1,237 @@
+#include "SpiFlash.hpp"
+#include <algorithm>
+#include <cstring>
+
+
+namespace coco {
+
+SpiFlashBase::SpiFlashBase(Buffer &command, Buffer &buffer1, Buffer &buffer2, Line *lines, uint8_t *lineData,
+    int lineCount, int lineSize)
+    : command(command), buffers{&buffer1, &buffer2}
+    , lines(lines), lineData(lineData), lineCount(lineCount), lineSize(lineSize)
+{
+}
+
+AwaitableCoroutine SpiFlashBase::read(int address, void *data, int size) {
+    auto d = reinterpret_cast<uint8_t *>(data);
+    while (size > 0) {
+        int lineAddress = address & ~(this->lineSize - 1);
+        int offset = address - lineAddress;
+        int n = std::min(size, this->lineSize - offset);
+
+        Line *line = find(lineAddress);
+        if (line == nullptr) {
+            ++this->missCount;
+
+            // flush staged page if it overlaps with the line
+            if (this->stageAddress != -1 && this->stageAddress < lineAddress + this->lineSize
+                && lineAddress < this->stageAddress + PAGE_SIZE)
+            {
+                co_await program();
+            }
+
+            // reading is not possible while the flash is programming
+            co_await waitReady();
+
+            if (this->aheadAddress == lineAddress) {
+                // line is already being read ahead
+                ++this->readAheadHitCount;
+            } else {
+                // read line into a buffer that does not hold staged page data
+                this->aheadIndex = this->stageAddress == -1 ? 0 : this->stageIndex ^ 1;
+                co_await this->buffers[this->aheadIndex]->untilReadyOrDisabled();
+                startRead(*this->buffers[this->aheadIndex], lineAddress);
+            }
+            auto &buffer = *this->buffers[this->aheadIndex];
+            this->aheadIndex = -1;
+            this->aheadAddress = -1;
+
+            // read ahead next line into the other buffer on sequential access when it is free
+            int nextAddress = lineAddress + this->lineSize;
+            if (lineAddress == this->lastLineAddress + this->lineSize && this->stageAddress == -1
+                && find(nextAddress) == nullptr)
+            {
+                int index = &buffer == this->buffers[0] ? 1 : 0;
+                auto &next = *this->buffers[index];
+                if (next.ready()) {
+                    startRead(next, nextAddress);
+                    this->aheadIndex = index;
+                    this->aheadAddress = nextAddress;
+                }
+            }
+
+            co_await buffer.untilReadyOrDisabled();
+            insert(lineAddress, buffer.data());
+            line = find(lineAddress);
+        } else {
+            ++this->hitCount;
+        }
+        this->lastLineAddress = lineAddress;
+
+        // copy from cache line
+        line->access = ++this->access;
+        std::memcpy(d, this->lineData + (line - this->lines) * this->lineSize + offset, n);
+        address += n;
+        d += n;
+        size -= n;
+    }
+}
+
+AwaitableCoroutine SpiFlashBase::write(int address, const void *data, int size) {
+    auto d = reinterpret_cast<const uint8_t *>(data);
+    while (size > 0) {
+        int pageAddress = address & ~(PAGE_SIZE - 1);
+        int offset = address - pageAddress;
+        int n = std::min(size, PAGE_SIZE - offset);
+
+        // program staged page if data goes to a different page
+        if (this->stageAddress != -1 && this->stageAddress != pageAddress)
+            co_await program();
+
+        // start new staged page
+        auto &buffer = *this->buffers[this->stageIndex];
+        if (this->stageAddress == -1) {
+            // wait until the buffer is not in use (e.g. programming the page before the previous page or read-ahead)
+            if (this->aheadIndex == this->stageIndex) {
+                this->aheadIndex = -1;
+                this->aheadAddress = -1;
+            }
+            co_await buffer.untilReadyOrDisabled();
+
+            // set header for page program, unwritten bytes are 0xff which do not modify the flash
+            uint8_t header[] = {0x02, uint8_t(pageAddress >> 16), uint8_t(pageAddress >> 8), uint8_t(pageAddress)};
+            buffer.setHeader(header);
+            std::fill(buffer.data(), buffer.data() + PAGE_SIZE, 0xff);
+            this->stageAddress = pageAddress;
+            this->stageBegin = offset;
+            this->stageEnd = offset;
+        }
+
+        // copy data into staged page
+        std::memcpy(buffer.data() + offset, d, n);
+        this->stageBegin = std::min(this->stageBegin, offset);
+        this->stageEnd = std::max(this->stageEnd, offset + n);
+        invalidate(address, n);
+
+        // program when page is complete
+        if (this->stageBegin == 0 && this->stageEnd == PAGE_SIZE)
+            co_await program();
+
+        address += n;
+        d += n;
+        size -= n;
+    }
+}
+
+AwaitableCoroutine SpiFlashBase::flush() {
+    if (this->stageAddress != -1)
+        co_await program();
+    co_await waitReady();
+}
+
+AwaitableCoroutine SpiFlashBase::eraseSector(int address) {
+    address &= ~(SECTOR_SIZE - 1);
+
+    // program staged page if it is inside the sector
+    if (this->stageAddress != -1 && (this->stageAddress & ~(SECTOR_SIZE - 1)) == address)
+        co_await program();
+    co_await waitReady();
+
+    // write enable
+    const uint8_t writeEnable[] = {0x06};
+    this->command.setHeader(writeEnable);
+    co_await this->command.write(0);
+
+    // sector erase
+    const uint8_t erase[] = {0x20, uint8_t(address >> 16), uint8_t(address >> 8), uint8_t(address)};
+    this->command.setHeader(erase);
+    co_await this->command.write(0);
+    this->busy = true;
+
+    invalidate(address, SECTOR_SIZE);
+}
+
+void SpiFlashBase::invalidate() {
+    for (int i = 0; i < this->lineCount; ++i)
+        this->lines[i].address = -1;
+    this->aheadIndex = -1;
+    this->aheadAddress = -1;
+}
+
+AwaitableCoroutine SpiFlashBase::program() {
+    auto &buffer = *this->buffers[this->stageIndex];
+
+    // wait until the flash has finished programming the previous page which was done while staging this page
+    co_await waitReady();
+
+    // write enable
+    const uint8_t writeEnable[] = {0x06};
+    this->command.setHeader(writeEnable);
+    co_await this->command.write(0);
+
+    // start page program and return without waiting, the next page gets staged in the other buffer
+    buffer.startWrite(PAGE_SIZE);
+    this->busy = true;
+    ++this->programCount;
+
+    this->stageIndex ^= 1;
+    this->stageAddress = -1;
+}
+
+AwaitableCoroutine SpiFlashBase::waitReady() {
+    if (!this->busy)
+        co_return;
+
+    // read status register until write in progress (WIP) is cleared, gets queued after a running page program
+    // (set header each time as reading overwrites it)
+    const uint8_t readStatus[] = {0x05};
+    do {
+        this->command.setHeader(readStatus);
+        co_await this->command.read(1);
+    } while ((this->command.data()[0] & WIP) != 0);
+    this->busy = false;
+}
+
+void SpiFlashBase::startRead(Buffer &buffer, int address) {
+    // fast read with one dummy byte
+    uint8_t header[] = {0x0b, uint8_t(address >> 16), uint8_t(address >> 8), uint8_t(address), 0};
+    buffer.setHeader(header);
+    buffer.startRead(this->lineSize);
+}
+
+SpiFlashBase::Line *SpiFlashBase::find(int address) {
+    for (int i = 0; i < this->lineCount; ++i) {
+        if (this->lines[i].address == address)
+            return &this->lines[i];
+    }
+    return nullptr;
+}
+
+void SpiFlashBase::insert(int address, const uint8_t *data) {
+    // find least recently used line
+    Line *line = this->lines;
+    for (int i = 1; i < this->lineCount; ++i) {
+        Line &l = this->lines[i];
+        if (l.address == -1 || (line->address != -1 && l.access < line->access))
+            line = &l;
+    }
+    line->address = address;
+    line->access = ++this->access;
+    std::memcpy(this->lineData + (line - this->lines) * this->lineSize, data, this->lineSize);
+}
+
+void SpiFlashBase::invalidate(int address, int size) {
+    for (int i = 0; i < this->lineCount; ++i) {
+        Line &line = this->lines[i];
+        if (line.address != -1 && line.address < address + size && address < line.address + this->lineSize)
+            line.address = -1;
+    }
+
+    // discard line that is being read ahead
+    if (this->aheadAddress != -1 && this->aheadAddress < address + size && address < this->aheadAddress + this->lineSize) {
+        this->aheadIndex = -1;
+        this->aheadAddress = -1;
+    }
+}
+
+} // namespace coco
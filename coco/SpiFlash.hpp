@@ -0,0 +1,162 @@
+#pragma once
+
+#include <coco/Buffer.hpp>
+#include <coco/Coroutine.hpp>
+
+
+namespace coco {
+
+/**
+ * Driver for SPI NOR flash (e.g. W25Q series) with 3 byte addresses on a channel of a SPI master.
+ * Features:
+ *   Read cache of a configurable number of lines (LRU replacement)
+ *   Fast read (0x0b) with read-ahead of the next line for sequential access
+ *   Write coalescing into full 256 byte pages
+ *   Pipelined page programming: The next page gets staged while the flash programs the previous page, the write in
+ *   progress (WIP) bit is only polled when the next page is ready to be programmed
+ *
+ * Uses three buffers of the channel: A command buffer with capacity >= 4 and two transfer buffers with capacity
+ * >= 5 + max(PAGE_SIZE, line size). The transfer buffers are used alternately for page programming and reading.
+ */
+class SpiFlashBase {
+public:
+    static constexpr int PAGE_SIZE = 256;
+    static constexpr int SECTOR_SIZE = 4096;
+
+    // status register bits
+    static constexpr uint8_t WIP = 0x01;
+    static constexpr uint8_t WEL = 0x02;
+
+    struct Line {
+        // address of the cache line, -1 if unused
+        int address;
+
+        // last access for LRU replacement
+        uint32_t access;
+    };
+
+    /**
+     * Constructor
+     * @param command buffer for commands such as write enable and read status
+     * @param buffer1 first transfer buffer for page program and fast read
+     * @param buffer2 second transfer buffer for page program and fast read
+     * @param lines cache lines, not accessed by the constructor as they may be members of a derived class, call
+     *     invalidate() when they are constructed
+     * @param lineData data of cache lines
+     * @param lineCount number of cache lines
+     * @param lineSize size of a cache line, power of two
+     */
+    SpiFlashBase(Buffer &command, Buffer &buffer1, Buffer &buffer2, Line *lines, uint8_t *lineData,
+        int lineCount, int lineSize);
+
+    /**
+     * Read data. Cached data is returned without bus access, pending writes to the same line get flushed first
+     * @param address address in flash
+     * @param data data to read into
+     * @param size size of data to read
+     */
+    [[nodiscard]] AwaitableCoroutine read(int address, void *data, int size);
+
+    /**
+     * Write data. The data gets collected in page buffers and programmed when a page is complete, when a different
+     * page gets written or on flush(). Note that NOR flash can only change bits from 1 to 0, therefore erase first
+     * @param address address in flash
+     * @param data data to write
+     * @param size size of data to write
+     */
+    [[nodiscard]] AwaitableCoroutine write(int address, const void *data, int size);
+
+    /**
+     * Program pending page data and wait until the flash has finished programming
+     */
+    [[nodiscard]] AwaitableCoroutine flush();
+
+    /**
+     * Erase a sector (4K)
+     * @param address address of the sector
+     */
+    [[nodiscard]] AwaitableCoroutine eraseSector(int address);
+
+    /**
+     * Invalidate the read cache, e.g. when the flash was modified by other means
+     */
+    void invalidate();
+
+    /**
+     * Statistics
+     */
+    int getCacheHitCount() {return this->hitCount;}
+    int getCacheMissCount() {return this->missCount;}
+    int getReadAheadHitCount() {return this->readAheadHitCount;}
+    int getProgramCount() {return this->programCount;}
+
+protected:
+    // program the staged page, does not wait until the flash has finished
+    [[nodiscard]] AwaitableCoroutine program();
+
+    // wait until the flash is not busy anymore (poll WIP bit)
+    [[nodiscard]] AwaitableCoroutine waitReady();
+
+    // start fast read of a line into a transfer buffer
+    void startRead(Buffer &buffer, int address);
+
+    // get cache line for an address, returns nullptr if not cached
+    Line *find(int address);
+
+    // allocate least recently used cache line and copy data into it
+    void insert(int address, const uint8_t *data);
+
+    // invalidate cache lines that overlap with the given range
+    void invalidate(int address, int size);
+
+    Buffer &command;
+    Buffer *buffers[2];
+
+    // read cache
+    Line *lines;
+    uint8_t *lineData;
+    int lineCount;
+    int lineSize;
+    uint32_t access = 0;
+
+    // read-ahead: buffer index and address of the line that is currently being read ahead
+    int aheadIndex = -1;
+    int aheadAddress = -1;
+    int lastLineAddress = -1;
+
+    // write staging: index of buffer that receives page data, page address and staged range
+    int stageIndex = 0;
+    int stageAddress = -1;
+    int stageBegin;
+    int stageEnd;
+
+    // set when the flash may be busy programming or erasing
+    bool busy = false;
+
+    int hitCount = 0;
+    int missCount = 0;
+    int readAheadHitCount = 0;
+    int programCount = 0;
+};
+
+/**
+ * SPI NOR flash with read cache
+ * @tparam N number of cache lines
+ * @tparam L size of a cache line, power of two
+ */
+template <int N, int L = 256>
+class SpiFlash : public SpiFlashBase {
+public:
+    SpiFlash(Buffer &command, Buffer &buffer1, Buffer &buffer2)
+        : SpiFlashBase(command, buffer1, buffer2, lines, lineData, N, L)
+    {
+        // cache lines are constructed after the base class
+        invalidate();
+    }
+
+protected:
+    Line lines[N];
+    alignas(4) uint8_t lineData[N * L];
+};
+
+} // namespace coco
@@ -0,0 +1,91 @@
+#include "SpiPoll.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+SpiPollBase::SpiPollBase(const uint8_t *command, int commandSize, int size, uint32_t period, uint8_t *data,
+    uint32_t *timestamps, int capacity)
+    : command(command), commandSize(commandSize), size(size), period(period)
+    , data(data), timestamps(timestamps), capacity(capacity)
+{
+}
+
+bool SpiPollBase::read(uint8_t *data, uint32_t &timestamp) {
+    int tail = this->tail.load(std::memory_order_relaxed);
+    if (tail == this->head.load(std::memory_order_acquire))
+        return false;
+
+    auto d = this->data + tail * this->size;
+    std::copy(d, d + this->size, data);
+    timestamp = this->timestamps[tail];
+
+    this->tail.store(tail + 1 == this->capacity ? 0 : tail + 1, std::memory_order_release);
+    return true;
+}
+
+int SpiPollBase::available() {
+    int count = this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_relaxed);
+    return count >= 0 ? count : count + this->capacity;
+}
+
+bool SpiPollBase::due(uint32_t now, bool busy) {
+    if (!this->enabled)
+        return false;
+
+    // chained reads get started once and then restarted by the master on completion
+    if (this->period == 0)
+        return !busy;
+
+    // first read starts on the first tick
+    if (!this->started) {
+        this->started = true;
+        this->dueTime = now;
+    }
+
+    if (int32_t(now - this->dueTime) < 0)
+        return false;
+
+    // next read is due one period later, periods that have passed completely are missed
+    uint32_t skipped = (now - this->dueTime) / this->period;
+    this->missedCount += skipped;
+    this->dueTime += (skipped + 1) * this->period;
+
+    if (busy) {
+        ++this->missedCount;
+        return false;
+    }
+    return true;
+}
+
+void SpiPollBase::store(const uint8_t *data, uint32_t timestamp) {
+    // statistics of the interval between two samples, not across a pause of the poll or a missed read
+    if (!this->first && this->missedCount == this->lastMissedCount) {
+        uint32_t interval = timestamp - this->lastTimestamp;
+        ++this->intervalCount;
+        this->minInterval = std::min(this->minInterval, interval);
+        this->maxInterval = std::max(this->maxInterval, interval);
+        if (this->period > 0) {
+            uint32_t jitter = interval >= this->period ? interval - this->period : this->period - interval;
+            this->maxJitter = std::max(this->maxJitter, jitter);
+            this->jitterSum += jitter;
+        }
+    }
+    this->first = false;
+    this->lastTimestamp = timestamp;
+    this->lastMissedCount = this->missedCount;
+    ++this->sampleCount;
+
+    // append to ring buffer, drop the sample if the application did not take the samples in time
+    int head = this->head.load(std::memory_order_relaxed);
+    int next = head + 1 == this->capacity ? 0 : head + 1;
+    if (next == this->tail.load(std::memory_order_acquire)) {
+        ++this->overrunCount;
+        return;
+    }
+    std::copy(data, data + this->size, this->data + head * this->size);
+    this->timestamps[head] = timestamp;
+    this->head.store(next, std::memory_order_release);
+}
+
+} // namespace coco
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+
+namespace coco {
+
+/**
+ * Periodic read of a SPI slave, e.g. the sample registers of a sensor. The master starts the read from a hardware timer
+ * (see addPoll() and tick() of the SPI masters) or, if the period is 0, from the completion of the previous read. The
+ * samples are stored with timestamp in a ring buffer without involving the application, which takes them using read()
+ * when convenient, e.g. once per frame. The master is the only producer and the application the only consumer of the
+ * ring buffer. Reads that are due while the previous read is still in progress are skipped and counted as missed.
+ */
+class SpiPollBase {
+public:
+    /**
+     * Constructor
+     * @param command command (e.g. register address with read flag) that gets sent as header of each read
+     * @param commandSize size of the command
+     * @param size number of bytes to read after the command
+     * @param period period in timer ticks (unit of the time passed to tick() of the master), 0 to chain the reads
+     * @param data storage of the ring buffer for capacity samples of the given size
+     * @param timestamps storage of the ring buffer for capacity timestamps
+     * @param capacity capacity of the ring buffer plus one
+     */
+    SpiPollBase(const uint8_t *command, int commandSize, int size, uint32_t period, uint8_t *data,
+        uint32_t *timestamps, int capacity);
+
+    /**
+     * Enable or disable the poll, a read that is in progress completes normally. A periodic poll starts again on the
+     * next tick after it was enabled
+     */
+    void setEnabled(bool enabled) {this->enabled = enabled; this->started = false; this->first = true;}
+    bool isEnabled() {return this->enabled;}
+
+    /**
+     * Take the oldest sample from the ring buffer
+     * @param data data of the sample (size bytes)
+     * @param timestamp time when the read of the sample was started
+     * @return true if a sample was available
+     */
+    bool read(uint8_t *data, uint32_t &timestamp);
+
+    /**
+     * Get number of samples in the ring buffer
+     */
+    int available();
+
+    /**
+     * Statistics
+     */
+    int getSampleCount() {return this->sampleCount;}
+    int getMissedCount() {return this->missedCount;}
+    int getOverrunCount() {return this->overrunCount;}
+    uint32_t getMinInterval() {return this->minInterval;}
+    uint32_t getMaxInterval() {return this->maxInterval;}
+
+    /**
+     * Get maximum and mean deviation of the interval between two samples from the period in timer ticks, intervals
+     * that span a missed read are excluded
+     */
+    uint32_t getMaxJitter() {return this->maxJitter;}
+    uint32_t getMeanJitter() {return this->intervalCount > 0 ? uint32_t(this->jitterSum / this->intervalCount) : 0;}
+
+    /**
+     * Configuration, used by the master
+     */
+    const uint8_t *getCommand() {return this->command;}
+    int getCommandSize() {return this->commandSize;}
+    int getSize() {return this->size;}
+    uint32_t getPeriod() {return this->period;}
+
+    /**
+     * Check if a read is due, gets called by the master from tick(). Schedules the next read one period later
+     * @param now current time of the timer
+     * @param busy true if the previous read is still in progress
+     * @return true if the master should start the read
+     */
+    bool due(uint32_t now, bool busy);
+
+    /**
+     * Store a sample into the ring buffer and update the statistics, gets called by the master when a read has completed
+     * @param data data of the sample (size bytes)
+     * @param timestamp time when the read was started
+     */
+    void store(const uint8_t *data, uint32_t timestamp);
+
+    // time when the current read was started, set by the master
+    uint32_t startTime = 0;
+
+protected:
+    const uint8_t *command;
+    int commandSize;
+    int size;
+    uint32_t period;
+
+    bool enabled = true;
+    bool started = false;
+    uint32_t dueTime = 0;
+
+    // ring buffer, written by the master and read by the application
+    uint8_t *data;
+    uint32_t *timestamps;
+    int capacity;
+    std::atomic<int> head = 0;
+    std::atomic<int> tail = 0;
+
+    // statistics
+    int sampleCount = 0;
+    int missedCount = 0;
+    int overrunCount = 0;
+    bool first = true;
+    uint32_t lastTimestamp = 0;
+    int lastMissedCount = 0;
+    int intervalCount = 0;
+    uint32_t minInterval = UINT32_MAX;
+    uint32_t maxInterval = 0;
+    uint32_t maxJitter = 0;
+    uint64_t jitterSum = 0;
+};
+
+/**
+ * Periodic read of a SPI slave with ring buffer
+ * @tparam C size of the command
+ * @tparam S number of bytes to read after the command
+ * @tparam N capacity of the ring buffer in samples
+ */
+template <int C, int S, int N>
+class SpiPoll : public SpiPollBase {
+public:
+    /**
+     * Constructor
+     * @param command command that gets sent as header of each read
+     * @param period period in timer ticks, 0 to chain the reads
+     */
+    SpiPoll(const uint8_t (&command)[C], uint32_t period)
+        : SpiPollBase(commandData, C, S, period, &sampleData[0][0], timestampData, N + 1)
+    {
+        for (int i = 0; i < C; ++i)
+            this->commandData[i] = command[i];
+    }
+
+protected:
+    uint8_t commandData[C];
+    uint8_t sampleData[N + 1][S];
+    uint32_t timestampData[N + 1];
+};
+
+} // namespace coco
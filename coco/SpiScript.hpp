@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+
+
+namespace coco {
+
+/**
+ * Step of a SPI script, decoded by the master from the table of a SpiScript
+ */
+struct SpiScriptStep {
+    enum class Type : uint8_t {
+        // end of script
+        END = 0,
+
+        // write command (DC low) and data (DC high)
+        WRITE = 1,
+
+        // wait for a delay
+        DELAY = 2
+    };
+
+    // flag in the type byte of WRITE that keeps CS active after the write
+    static constexpr uint8_t KEEP_CS = 0x80;
+
+    Type type;
+    bool keepCs;
+
+    // WRITE: command followed by data
+    const uint8_t *data;
+    int commandSize;
+    int dataSize;
+
+    // DELAY: delay in ticks of the timer that calls tick() of the master
+    uint32_t delay;
+
+    /**
+     * Decode a step
+     * @param script current position in the script
+     * @return position of the next step
+     */
+    static const uint8_t *decode(const uint8_t *script, SpiScriptStep &step) {
+        uint8_t type = script[0];
+        step.type = Type(type & ~KEEP_CS);
+        step.keepCs = (type & KEEP_CS) != 0;
+        switch (step.type) {
+        case Type::WRITE:
+            step.commandSize = script[1];
+            step.dataSize = script[2];
+            step.data = script + 3;
+            return step.data + step.commandSize + step.dataSize;
+        case Type::DELAY:
+            step.delay = script[1] | (script[2] << 8) | (script[3] << 16) | (uint32_t(script[4]) << 24);
+            return script + 5;
+        default:
+            return script;
+        }
+    }
+};
+
+/**
+ * Compile-time builder of a script of SPI writes and delays, e.g. the init sequence of a display or sensor. The script
+ * is a compact constant table that the master runs from its interrupt handler (see startScript() of the buffers of the
+ * masters), delays are timed by the timer that calls tick() of the master. The application gets notified only once at
+ * the end of the script. On a channel with DC pin, the command bytes are sent with DC low and the data bytes with DC
+ * high. CS is released after each write unless keepCs is set.
+ * Example with the emulated timer of SpiMaster_native whose ticks are nanoseconds (see setTimer()):
+ *   constexpr auto INIT = SpiScript<64>()
+ *       .command(0x01).delay(150'000'000) // software reset, 150ms
+ *       .command(0x11).delay(10'000'000) // sleep out, 10ms
+ *       .command(0x3a, {0x55}) // 16 bit color
+ *       .command(0x29); // display on
+ * @tparam N capacity of the table in bytes
+ */
+template <int N>
+class SpiScript {
+public:
+    constexpr SpiScript() = default;
+
+    /**
+     * Write a command with optional data
+     * @param command command byte
+     * @param data data bytes (parameters of the command)
+     * @param keepCs keep CS active after the write
+     */
+    constexpr SpiScript &command(uint8_t command, std::initializer_list<uint8_t> data = {}, bool keepCs = false) {
+        return write({command}, data, keepCs);
+    }
+
+    /**
+     * Write command bytes and data bytes
+     * @param command command bytes, can be empty, at most 15 as the DC counter of the nRF52 (DCXCNT) has 4 bits
+     * @param data data bytes, can be empty
+     * @param keepCs keep CS active after the write
+     */
+    constexpr SpiScript &write(std::initializer_list<uint8_t> command, std::initializer_list<uint8_t> data,
+        bool keepCs = false)
+    {
+        assert(command.size() <= 15 && data.size() <= 255 && command.size() + data.size() > 0);
+        append(uint8_t(SpiScriptStep::Type::WRITE) | (keepCs ? SpiScriptStep::KEEP_CS : 0));
+        append(uint8_t(command.size()));
+        append(uint8_t(data.size()));
+        for (uint8_t b : command)
+            append(b);
+        for (uint8_t b : data)
+            append(b);
+        return *this;
+    }
+
+    /**
+     * Wait before the next step
+     * @param ticks delay in ticks of the timer that calls tick() of the master (nanoseconds for the emulated timer of
+     *     SpiMaster_native), has the resolution of the timer
+     */
+    constexpr SpiScript &delay(uint32_t ticks) {
+        append(uint8_t(SpiScriptStep::Type::DELAY));
+        append(uint8_t(ticks));
+        append(uint8_t(ticks >> 8));
+        append(uint8_t(ticks >> 16));
+        append(uint8_t(ticks >> 24));
+        return *this;
+    }
+
+    /**
+     * Get the table, ends with Type::END
+     */
+    constexpr const uint8_t *data() const {return this->table;}
+
+    /**
+     * Get size of the table including the end marker
+     */
+    constexpr int size() const {return this->count + 1;}
+
+protected:
+    constexpr void append(uint8_t value) {
+        // one byte stays zero for the end marker, fails to compile when the capacity is exceeded
+        assert(this->count < N - 1);
+        this->table[this->count++] = value;
+    }
+
+    uint8_t table[N] = {};
+    int count = 0;
+};
+
+} // namespace coco
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+
+namespace coco {
+
+/**
+ * Lock-free multi-producer single-consumer queue for submitting transfers to the interrupt handler of a SPI master.
+ * Producers (application code, interrupt handlers of any priority, threads on native) push without masking
+ * interrupts, the consumer (interrupt handler of the master) takes all submitted elements at once in FIFO order.
+ * The queue is intrusive, an element must not be pushed again before it was taken by the consumer.
+ * On ARMv6-M (Cortex-M0/M0+), which has no exclusive load/store instructions, push() and drain() mask all interrupts
+ * for a few instructions instead.
+ * @tparam T element type
+ * @tparam Next member of T that holds the pointer to the next element
+ */
+template <typename T, T *T::*Next>
+class SubmitQueue {
+public:
+    /**
+     * Push an element, safe from any interrupt priority and from multiple threads
+     * @param element element to push
+     */
+    void push(T &element) {
+#ifdef __ARM_ARCH_6M__
+        uint32_t primask;
+        asm volatile ("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+        element.*Next = this->head.load(std::memory_order_relaxed);
+        this->head.store(&element, std::memory_order_relaxed);
+        asm volatile ("msr primask, %0" :: "r" (primask) : "memory");
+#else
+        T *head = this->head.load(std::memory_order_relaxed);
+        do {
+            element.*Next = head;
+        } while (!this->head.compare_exchange_weak(head, &element, std::memory_order_release, std::memory_order_relaxed));
+#endif
+    }
+
+    /**
+     * Check if the queue is empty
+     */
+    bool empty() const {return this->head.load(std::memory_order_relaxed) == nullptr;}
+
+    /**
+     * Take all elements and call a function for each in the order they were pushed, only from the consumer
+     * @param function function to call for each element
+     */
+    template <typename F>
+    void drain(F function) {
+        // take the stack of elements (newest first) and reverse it
+#ifdef __ARM_ARCH_6M__
+        uint32_t primask;
+        asm volatile ("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+        T *element = this->head.load(std::memory_order_relaxed);
+        this->head.store(nullptr, std::memory_order_relaxed);
+        asm volatile ("msr primask, %0" :: "r" (primask) : "memory");
+#else
+        T *element = this->head.exchange(nullptr, std::memory_order_acquire);
+#endif
+        T *first = nullptr;
+        while (element != nullptr) {
+            T *next = element->*Next;
+            element->*Next = first;
+            first = element;
+            element = next;
+        }
+
+        while (first != nullptr) {
+            T *next = first->*Next;
+            function(*first);
+            first = next;
+        }
+    }
+
+protected:
+    std::atomic<T *> head = nullptr;
+};
+
+} // namespace coco
@@ -0,0 +1,587 @@
+#include "SpiMaster_native.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+// SpiMaster_native
+
+SpiMaster_native::SpiMaster_native(Loop_native &loop, int frequency, int gap, int csTime)
+    : loop(loop), frequency(frequency), gap(gap), csTime(csTime)
+{
+}
+
+SpiMaster_native::~SpiMaster_native() {
+}
+
+SpiSlaveModel *SpiMaster_native::getSlave(int csPin) {
+    auto it = this->slaves.find(csPin);
+    return it != this->slaves.end() ? it->second : nullptr;
+}
+
+void SpiMaster_native::transfer(BufferBase &buffer) {
+    auto &channel = *buffer.channel;
+
+    SpiSlaveModel *slave = getSlave(channel.csPin);
+
+    int headerSize = buffer.p.headerSize;
+    int size = buffer.p.size;
+    bool write = (buffer.op & BufferBase::Op::WRITE) != 0;
+    bool read = (buffer.op & BufferBase::Op::READ) != 0;
+    bool allCommand = (buffer.op & BufferBase::Op::COMMAND) != 0;
+    bool partial = (buffer.op & BufferBase::Op::PARTIAL) != 0;
+    auto data = buffer.p.data;
+
+    // hardware CS gets released at the end of each transfer
+    assert(!(partial && channel.hardwareCs));
+
+    // time of one byte in nanoseconds
+    int frequency = this->frequency << channel.speed;
+    int64_t byteTime = 8'000'000'000LL / frequency;
+
+    // emulate bit errors when the clock is too fast for the slave
+    bool corrupt = slave != nullptr && slave->maxFrequency > 0 && frequency > slave->maxFrequency;
+
+    // deactivate CS pin of a different channel that was kept active by a partial transfer
+    auto selected = this->selected;
+    if (selected != nullptr && selected != &channel) {
+        auto s = getSlave(selected->csPin);
+        if (s != nullptr)
+            s->deselect(this->time);
+    }
+    this->selected = nullptr;
+
+    // activate CS pin unless it is still active after a partial transfer on the same channel, hardware CS replaces
+    // the time for toggling CS in software by the setup and hold time
+    this->time += channel.hardwareCs ? this->gap - this->csTime + 2 * channel.csDelay : this->gap;
+    if (slave != nullptr && selected != &channel)
+        slave->select(this->time);
+
+    for (int i = 0; i < size; ++i) {
+        // the buffer contents are sent also when only reading like the hardware does (full duplex DMA)
+        uint8_t mosi = data[i];
+
+        // DC pin: low for command (header), high for data
+        bool dc = !channel.dcUsed || !(i < headerSize || allCommand);
+
+        uint8_t miso = slave != nullptr ? slave->transfer(this->time, mosi, dc) : 0xff;
+        if (corrupt)
+            miso ^= 1 << ((this->byteCount + i) * 5 & 7);
+        if (read)
+            data[i] = miso;
+        this->time += byteTime;
+    }
+
+    // CRC of the data phase: transmit on write, receive and check on read
+    buffer.crcResult = SpiCrc::Result::NONE;
+    int crcCount = buffer.crc.byteCount();
+    if (crcCount > 0) {
+        uint16_t crc = buffer.crc.compute(data + headerSize, size - headerSize);
+        uint16_t received = 0;
+        for (int i = crcCount - 1; i >= 0; --i) {
+            uint8_t mosi = write ? uint8_t(crc >> i * 8) : 0xff;
+            uint8_t miso = slave != nullptr ? slave->transfer(this->time, mosi, true) : 0xff;
+            if (corrupt)
+                miso ^= 1 << ((this->byteCount + size + i) * 5 & 7);
+            received = (received << 8) | miso;
+            this->time += byteTime;
+        }
+        if (read)
+            buffer.crcResult = crc == received ? SpiCrc::Result::OK : SpiCrc::Result::ERROR;
+        size += crcCount;
+    }
+
+    // deactivate CS pin unless the transfer is partial, then it gets deactivated lazily
+    if (partial)
+        this->selected = &channel;
+    else if (slave != nullptr)
+        slave->deselect(this->time);
+
+    this->byteCount += size;
+    ++this->transferCount;
+}
+
+void SpiMaster_native::addPoll(SpiPollBase &poll, BufferBase &buffer) {
+    assert(poll.getCommandSize() + poll.getSize() <= buffer.p.capacity);
+    buffer.poll = &poll;
+    buffer.nextPoll = this->polls;
+    this->polls = &buffer;
+}
+
+void SpiMaster_native::tick(uint32_t now) {
+    // scripts that have ended get completed after the lock as the app may resume
+    BufferBase *ended = nullptr;
+    {
+        std::lock_guard lock(this->mutex);
+        this->pollTime = now;
+        for (auto buffer = this->polls; buffer != nullptr; buffer = buffer->nextPoll) {
+            if (buffer->poll->due(now, buffer->st.state != BufferBase::State::READY)) {
+                preparePoll(*buffer);
+                buffer->start(BufferBase::Op::READ);
+            }
+        }
+
+        // continue scripts and status polls whose delay has elapsed
+        auto p = &this->delayed;
+        while (*p != nullptr) {
+            auto buffer = *p;
+            if (int32_t(now - buffer->delayTime) >= 0) {
+                *p = buffer->nextDelayed;
+                if (buffer->script == nullptr) {
+                    submit(*buffer); // next read of status poll
+                } else if (!continueScript(*buffer)) {
+                    buffer->nextDelayed = ended;
+                    ended = buffer;
+                }
+            } else {
+                p = &buffer->nextDelayed;
+            }
+        }
+    }
+
+    while (ended != nullptr) {
+        auto next = ended->nextDelayed;
+        complete(*ended);
+        ended = next;
+    }
+}
+
+void SpiMaster_native::setTimer(int period) {
+    std::lock_guard lock(this->mutex);
+    this->timerPeriod = period;
+    if (period > 0 && !this->timerPending) {
+        this->timerPending = true;
+        this->timerTime = this->time;
+        this->loop.yield(this->timer);
+    }
+}
+
+void SpiMaster_native::preparePoll(BufferBase &buffer) {
+    auto &poll = *buffer.poll;
+    auto command = poll.getCommand();
+    int commandSize = poll.getCommandSize();
+    std::copy(command, command + commandSize, buffer.p.data);
+    buffer.p.headerSize = commandSize;
+    buffer.p.size = commandSize + poll.getSize();
+}
+
+bool SpiMaster_native::continueScript(BufferBase &buffer) {
+    SpiScriptStep step;
+    buffer.script = SpiScriptStep::decode(buffer.script, step);
+    switch (step.type) {
+    case SpiScriptStep::Type::WRITE:
+        {
+            // copy the write into the buffer, all bytes are commands if there is no data
+            int size = step.commandSize + step.dataSize;
+            assert(size <= buffer.p.capacity);
+            std::copy(step.data, step.data + size, buffer.p.data);
+            buffer.p.headerSize = step.commandSize;
+            buffer.p.size = size;
+            auto op = BufferBase::Op::WRITE;
+            if (step.dataSize == 0)
+                op = op | BufferBase::Op::COMMAND;
+            if (step.keepCs)
+                op = op | BufferBase::Op::PARTIAL;
+            buffer.op = op;
+
+            submit(buffer);
+        }
+        return true;
+    case SpiScriptStep::Type::DELAY:
+        delay(buffer, step.delay);
+        return true;
+    default:
+        buffer.script = nullptr;
+        return false;
+    }
+}
+
+bool SpiMaster_native::repeatStatus(BufferBase &buffer) {
+    ++buffer.statusCount;
+    uint8_t status = buffer.p.data[buffer.p.headerSize];
+    if ((status & buffer.statusMask) == buffer.statusValue || buffer.statusCount == buffer.statusMaxCount) {
+        buffer.statusPoll = false;
+        return false;
+    }
+
+    // set header again as reading overwrites it
+    std::copy(buffer.statusHeader, buffer.statusHeader + buffer.p.headerSize, buffer.p.data);
+
+    // queue at the tail so that pending transfers of other channels go first
+    if (buffer.statusInterval > 0)
+        delay(buffer, buffer.statusInterval);
+    else
+        submit(buffer);
+    return true;
+}
+
+void SpiMaster_native::delay(BufferBase &buffer, uint32_t ticks) {
+    // wait until tick() reaches the end of the delay, one tick more because the current time is up to one tick later
+    // than the time of the last tick
+    buffer.delayTime = this->pollTime + ticks + 1;
+    buffer.nextDelayed = this->delayed;
+    this->delayed = &buffer;
+}
+
+void SpiMaster_native::deselect(Channel &channel) {
+    if (this->selected == &channel) {
+        auto slave = getSlave(channel.csPin);
+        if (slave != nullptr)
+            slave->deselect(this->time);
+        this->selected = nullptr;
+    }
+}
+
+void SpiMaster_native::drain() {
+    std::lock_guard lock(this->mutex);
+    this->submitted.drain([this](BufferBase &buffer) {
+        submit(buffer);
+    });
+}
+
+void SpiMaster_native::submit(BufferBase &buffer) {
+    this->transfers.push_back(&buffer);
+    if (this->transfers.size() == 1)
+        buffer.start();
+}
+
+void SpiMaster_native::complete(BufferBase &buffer) {
+    if (this->coalesceCount <= 1) {
+        // notify app for each buffer
+        buffer.notify();
+        return;
+    }
+    std::lock_guard lock(this->mutex);
+
+    // append to list of completed buffers
+    buffer.nextCompleted = nullptr;
+    if (this->completedFirst == nullptr)
+        this->completedFirst = &buffer;
+    else
+        this->completedLast->nextCompleted = &buffer;
+    this->completedLast = &buffer;
+    ++this->completedCount;
+
+    // notify app about coalesced completions at the end of a burst or when the threshold is reached
+    if (this->transfers.empty() || this->completedCount >= this->coalesceCount)
+        flushCompleted();
+}
+
+void SpiMaster_native::flushCompleted() {
+    // yield completion handler to the event loop unless it is already pending, then it takes the new buffers too
+    if (this->completedFirst != nullptr && !this->completionPending) {
+        this->completionPending = true;
+        ++this->batchCount;
+        this->loop.yield(this->completion);
+    }
+}
+
+void SpiMaster_native::Completion::handle() {
+    auto &device = this->device;
+
+    // take list of completed buffers
+    BufferBase *buffer;
+    {
+        std::lock_guard lock(device.mutex);
+        buffer = device.completedFirst;
+        device.completedFirst = nullptr;
+        device.completedCount = 0;
+        device.completionPending = false;
+    }
+
+    // notify app for each buffer (may start the buffer again)
+    while (buffer != nullptr) {
+        auto next = buffer->nextCompleted;
+        buffer->notify();
+        buffer = next;
+    }
+}
+
+void SpiMaster_native::Timer::handle() {
+    auto &device = this->device;
+    {
+        std::lock_guard lock(device.mutex);
+        if (device.timerPeriod == 0) {
+            device.timerPending = false;
+            return;
+        }
+
+        // let pending transfers run until the simulated clock reaches the next tick, otherwise the bus is idle until
+        // then
+        if (device.time < device.timerTime) {
+            if (!device.transfers.empty()) {
+                device.loop.yield(*this);
+                return;
+            }
+            device.time = device.timerTime;
+        }
+    }
+
+    // tick() locks by itself and completes ended scripts after the lock
+    device.tick(uint32_t(device.timerTime));
+
+    std::lock_guard lock(device.mutex);
+    device.timerTime += device.timerPeriod;
+    device.loop.yield(*this);
+}
+
+SpiMaster_native::BufferBase *SpiMaster_native::borrow(Channel &channel, int capacity, bool autoRelease) {
+    // find smallest size class with sufficient capacity that has a free buffer
+    for (auto pool = this->pools; pool != nullptr; pool = pool->next) {
+        if (pool->capacity() >= capacity) {
+            auto buffer = pool->allocate();
+            if (buffer != nullptr) {
+                buffer->channel = &channel;
+                buffer->autoRelease = autoRelease;
+                buffer->p.headerSize = 0;
+                buffer->p.size = 0;
+                return buffer;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void SpiMaster_native::addPool(BufferPool<BufferBase> &pool) {
+    // insert into list of size classes, sorted by capacity
+    auto p = &this->pools;
+    while (*p != nullptr && (*p)->capacity() < pool.capacity())
+        p = &(*p)->next;
+    pool.next = *p;
+    *p = &pool;
+}
+
+
+// BufferBase
+
+SpiMaster_native::BufferBase::BufferBase(uint8_t *data, int capacity, Channel &channel)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), channel(&channel)
+{
+    channel.buffers.add(*this);
+}
+
+SpiMaster_native::BufferBase::BufferBase(uint8_t *data, int capacity, BufferPool<BufferBase> &pool)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), channel(nullptr), pool(&pool)
+{
+}
+
+SpiMaster_native::BufferBase::~BufferBase() {
+}
+
+bool SpiMaster_native::BufferBase::start(Op op) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+
+    // check if READ or WRITE flag is set
+    assert((op & Op::READ_WRITE) != 0);
+
+    this->op = op;
+    auto &device = this->channel->device;
+
+    // set state first as the transfer may complete at any time after submitting it
+    setBusy();
+
+    // submit lock-free, the emulated interrupt handler adds the transfer to the list of pending transfers
+    device.submitted.push(*this);
+    device.drain();
+
+    return true;
+}
+
+bool SpiMaster_native::BufferBase::startScript(const uint8_t *script) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+    auto &device = this->channel->device;
+
+    // set state, an empty script completes immediately
+    setBusy();
+    this->script = script;
+    bool running;
+    {
+        std::lock_guard lock(device.mutex);
+        running = device.continueScript(*this);
+    }
+    if (!running)
+        setReady();
+
+    return true;
+}
+
+bool SpiMaster_native::BufferBase::startStatusPoll(uint8_t mask, uint8_t value, int maxCount, uint32_t interval) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+
+    // save header as reading overwrites it
+    int headerSize = this->p.headerSize;
+    assert(headerSize <= int(sizeof(this->statusHeader)));
+    std::copy(this->p.data, this->p.data + headerSize, this->statusHeader);
+    this->statusMask = mask;
+    this->statusValue = value;
+    this->statusMaxCount = maxCount;
+    this->statusInterval = interval;
+    this->statusCount = 0;
+    this->statusPoll = true;
+
+    // read one status byte
+    this->p.size = headerSize + 1;
+    return start(Op::READ);
+}
+
+bool SpiMaster_native::BufferBase::cancel() {
+    if (this->st.state != State::BUSY)
+        return false;
+    auto &device = this->channel->device;
+
+    bool canceled = false;
+    {
+        std::lock_guard lock(device.mutex);
+
+        // end a status poll after the current read and a script after the current step
+        this->statusPoll = false;
+        bool script = this->script != nullptr;
+        this->script = nullptr;
+
+        // remove from delayed buffers if waiting for the next step of a script or the next read of a status poll
+        for (auto p = &device.delayed; *p != nullptr; p = &(*p)->nextDelayed) {
+            if (*p == this) {
+                *p = this->nextDelayed;
+                canceled = true;
+                break;
+            }
+        }
+
+        // move submitted transfers to the list of pending transfers, then remove from pending transfers if not yet
+        // started, otherwise complete normally. The buffer is not queued anymore if its coalesced completion is pending
+        if (!canceled) {
+            device.drain();
+            auto &transfers = device.transfers;
+            if (!transfers.empty()) {
+                auto it = std::find(transfers.begin() + 1, transfers.end(), this);
+                if (it != transfers.end()) {
+                    transfers.erase(it);
+                    canceled = true;
+                }
+            }
+        }
+
+        // the emulated transfer of the current step has already happened, therefore release CS that a step of the
+        // script has kept active in any case
+        if (script)
+            device.deselect(*this->channel);
+    }
+
+    // cancel succeeded: set buffer ready again
+    // resume application code after the lock
+    if (canceled)
+        setReady(0);
+
+    return true;
+}
+
+void SpiMaster_native::BufferBase::release() {
+    assert(this->pool != nullptr && this->st.state == State::READY);
+
+    // return to size class of shared pool
+    this->pool->release(*this);
+}
+
+void SpiMaster_native::BufferBase::start() {
+    auto &device = this->channel->device;
+
+    // timestamp of a periodic read is the start of the transfer
+    if (this->poll != nullptr)
+        this->poll->startTime = uint32_t(device.time);
+
+    // the emulated transfer happens immediately on the simulated clock
+    device.transfer(*this);
+
+    // notify from event loop that the transfer has finished -> handle()
+    device.loop.yield(*this);
+}
+
+void SpiMaster_native::BufferBase::handle() {
+    auto &device = this->channel->device;
+    {
+        std::lock_guard lock(device.mutex);
+
+        // end of transfer
+        device.transfers.pop_front();
+
+        // start next buffer
+        if (!device.transfers.empty())
+            device.transfers.front()->start();
+
+        // store sample of a periodic read without notifying the app, a chained read starts again
+        auto poll = this->poll;
+        if (poll != nullptr) {
+            poll->store(this->p.data + this->p.headerSize, poll->startTime);
+            if (poll->getPeriod() == 0 && poll->isEnabled()) {
+                device.preparePoll(*this);
+                device.submit(*this);
+            } else {
+                // nobody waits for the buffer of a periodic read
+                setReady();
+            }
+            return;
+        }
+
+        // repeat a status read until the condition holds, the app gets notified once
+        if (this->statusPoll && device.repeatStatus(*this))
+            return;
+
+        // continue a script, the app gets notified at the end of the script
+        if (this->script != nullptr && device.continueScript(*this))
+            return;
+    }
+
+    // notify app that buffer has finished, after the lock as the app may resume
+    device.complete(*this);
+}
+
+void SpiMaster_native::BufferBase::notify() {
+    setReady();
+
+    // return borrowed buffer to the shared pool unless a waiter has started it again, then it gets returned when that
+    // transfer has completed
+    if (this->autoRelease && this->st.state == State::READY)
+        release();
+}
+
+
+// Channel
+
+SpiMaster_native::Channel::Channel(SpiMaster_native &device, int csPin, bool dcUsed)
+    : BufferDevice(State::READY)
+    , device(device), csPin(csPin), dcUsed(dcUsed)
+{
+}
+
+SpiMaster_native::Channel::~Channel() {
+}
+
+void SpiMaster_native::Channel::setSpeed(int level) {
+    this->speed = std::clamp(level, 0, getMaxSpeed());
+}
+
+int SpiMaster_native::Channel::getMaxSpeed() {
+    int level = 0;
+    while ((int64_t(this->device.frequency) << (level + 1)) <= MAX_FREQUENCY)
+        ++level;
+    return level;
+}
+
+int SpiMaster_native::Channel::getBufferCount() {
+    return this->buffers.count();
+}
+
+SpiMaster_native::BufferBase &SpiMaster_native::Channel::getBuffer(int index) {
+    return this->buffers.get(index);
+}
+
+} // namespace coco
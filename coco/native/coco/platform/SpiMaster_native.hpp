@@ -0,0 +1,487 @@
+#pragma once
+
+#include "SpiSlaveModel.hpp"
+#include <coco/BufferDevice.hpp>
+#include <coco/BufferPool.hpp>
+#include <coco/SpiConcepts.hpp>
+#include <coco/SpiCrc.hpp>
+#include <coco/SpiPoll.hpp>
+#include <coco/SpiScript.hpp>
+#include <coco/SubmitQueue.hpp>
+#include <coco/platform/Loop_native.hpp>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <utility>
+
+
+namespace coco {
+
+/**
+ * Emulation of a SPI master with multiple virtual channels for the native platform (Windows, MacOS, Linux).
+ * Emulated slaves (SpiSlaveModel) get attached to the CS pin of a channel and answer on MISO. The bus runs on a
+ * simulated clock that advances with every transferred byte, therefore driver throughput (e.g. pages/s of a flash or
+ * frames/s of a display) can be benchmarked without hardware using getTime().
+ * Like on hardware, Buffer::start() submits lock-free (see SubmitQueue) and the emulated interrupt handler moves the
+ * submitted transfers to the list of pending transfers. A recursive mutex emulates disabling the interrupt of the
+ * master, therefore start() and cancel() may be called from threads that stand in for interrupts. The event loop is
+ * not thread-safe, therefore it must not run handlers while these threads start transfers.
+ */
+class SpiMaster_native {
+public:
+    // maximum emulated clock frequency in Hz that channels can reach with Channel::setSpeed()
+    static constexpr int MAX_FREQUENCY = 64'000'000;
+
+    /**
+     * Constructor for the emulated SPI device. For each SPI slave a Channel is needed which drives the CS pin of the slave.
+     * @param loop event loop
+     * @param frequency emulated clock frequency in Hz
+     * @param gap time between two transfers in nanoseconds (emulates CS toggling and interrupt latency)
+     * @param csTime part of the gap that toggling CS in software takes, saved by channels with hardware CS
+     */
+    SpiMaster_native(Loop_native &loop, int frequency, int gap = 1000, int csTime = 400);
+
+    ~SpiMaster_native();
+
+
+    class Channel;
+
+    // internal buffer base class, derives from IntrusiveListNode for the list of buffers and Loop_native::YieldHandler to be notified from the event loop
+    class BufferBase : public coco::Buffer, public IntrusiveListNode, public Loop_native::YieldHandler {
+        friend class SpiMaster_native;
+        friend class Channel;
+    public:
+        /**
+         * Constructor
+         * @param data data of the buffer
+         * @param capacity capacity of the buffer
+         * @param channel channel to attach to
+         */
+        BufferBase(uint8_t *data, int capacity, Channel &channel);
+
+        /**
+         * Constructor for buffers of the shared pool (see Pool)
+         * @param data data of the buffer
+         * @param capacity capacity of the buffer
+         * @param pool size class of the pool the buffer belongs to
+         */
+        BufferBase(uint8_t *data, int capacity, BufferPool<BufferBase> &pool);
+        ~BufferBase() override;
+
+        // Buffer methods, final so that calls on the concrete type need no vtable (see SpiConcepts.hpp)
+        bool start(Op op) final;
+        bool cancel() final;
+
+        /**
+         * Return a buffer that was borrowed using Channel::borrow() to the shared pool of the master.
+         * Must not be called while the buffer is busy, ISR-safe
+         */
+        void release();
+
+        /**
+         * Enable CRC for the data phase of the transfers of this buffer (bytes after the header). On write the CRC
+         * gets appended to the data, on read the CRC that follows the data gets received and checked. The emulation
+         * computes the CRC in software and exchanges the CRC bytes with the slave after the data
+         * @param crc CRC configuration, SPI_CRC_NONE to disable
+         */
+        void setCrc(SpiCrc crc) {this->crc = crc;}
+
+        /**
+         * Get result of the CRC check of the last read transfer
+         */
+        SpiCrc::Result getCrcResult() {return this->crcResult;}
+
+        /**
+         * Start a script of writes and delays (see SpiScript) that the master runs without notifying the app for each
+         * step, the buffer gets ready at the end of the script. Each write gets copied into the buffer, therefore its
+         * capacity must hold the largest write of the script. Delays need the emulated timer (see setTimer())
+         * @param script table of the script
+         * @return true if the script was started
+         */
+        bool startScript(const uint8_t *script);
+
+        /**
+         * Run a script of writes and delays
+         * @param script script
+         * @return awaitable that completes at the end of the script
+         */
+        template <int N>
+        [[nodiscard]] auto runScript(const SpiScript<N> &script) {
+            startScript(script.data());
+            return untilReadyOrDisabled();
+        }
+
+        /**
+         * Start reading a status byte repeatedly until a condition holds (see Channel::pollStatus()). The header of the
+         * buffer is the command that reads the status
+         * @param mask mask applied to the status byte
+         * @param value expected value of the masked status byte
+         * @param maxCount maximum number of reads, 0 for no limit
+         * @param interval time between two reads in ticks of the emulated timer (see setTimer()), 0 for back to back reads
+         * @return true if the status poll was started
+         */
+        bool startStatusPoll(uint8_t mask, uint8_t value, int maxCount = 0, uint32_t interval = 0);
+
+        /**
+         * Get number of status reads of the last status poll
+         */
+        int getStatusCount() {return this->statusCount;}
+
+    protected:
+        void start();
+        void handle() final;
+
+        // notify app and return a borrowed buffer to the shared pool
+        void notify();
+
+        // channel, can change for buffers of the shared pool
+        Channel *channel;
+
+        // size class of the shared pool if the buffer was borrowed
+        BufferPool<BufferBase> *pool = nullptr;
+        bool autoRelease = false;
+
+        // next buffer in list of coalesced completions
+        BufferBase *nextCompleted;
+
+        // next buffer in queue of submitted transfers
+        BufferBase *nextSubmitted;
+
+        // CRC configuration and result of last transfer
+        SpiCrc crc;
+        SpiCrc::Result crcResult = SpiCrc::Result::NONE;
+
+        // periodic read that owns the buffer (see addPoll())
+        SpiPollBase *poll = nullptr;
+        BufferBase *nextPoll;
+
+        // next step of a running script
+        const uint8_t *script = nullptr;
+
+        // status poll: saved header, condition, maximum number of reads, interval and number of reads
+        bool statusPoll = false;
+        uint8_t statusHeader[4];
+        uint8_t statusMask;
+        uint8_t statusValue;
+        int statusMaxCount;
+        uint32_t statusInterval;
+        int statusCount = 0;
+
+        // end of the current delay of a script or status poll and next buffer in list of delayed buffers
+        uint32_t delayTime;
+        BufferBase *nextDelayed;
+
+        Op op;
+    };
+
+    /**
+     * Virtual channel to an emulated SPI slave using a dedicated CS pin
+     */
+    class Channel : public BufferDevice {
+        friend class SpiMaster_native;
+        friend class BufferBase;
+    public:
+        /**
+         * Constructor
+         * @param device the SPI device to operate on
+         * @param csPin chip select pin of the slave (CS), identifies the slave model attached with attach()
+         * @param dcUsed indicates if DC pin is used
+         */
+        Channel(SpiMaster_native &device, int csPin, bool dcUsed = false);
+        ~Channel();
+
+        // BufferDevice methods, final so that calls on the concrete type need no vtable
+        int getBufferCount() final;
+        BufferBase &getBuffer(int index) final;
+
+        /**
+         * Borrow a buffer from the shared pool of the master in O(1), ISR-safe. The smallest free buffer with sufficient
+         * capacity is returned, its header is cleared
+         * @param capacity minimum capacity of the buffer
+         * @param autoRelease return the buffer to the pool when the transfer has completed, e.g. for fire-and-forget writes
+         * @return buffer or nullptr if no buffer is available
+         */
+        BufferBase *borrow(int capacity, bool autoRelease = false) {return this->device.borrow(*this, capacity, autoRelease);}
+
+        /**
+         * Set speed level of the channel relative to the clock configured for the master, e.g. as result of calibrate()
+         * @param level speed level, 0 is the configured clock and each level doubles the clock (up to MAX_FREQUENCY), gets limited to getMaxSpeed()
+         */
+        void setSpeed(int level);
+
+        /**
+         * Get current speed level of the channel
+         */
+        int getSpeed() {return this->speed;}
+
+        /**
+         * Get maximum speed level of the channel
+         */
+        int getMaxSpeed();
+
+        /**
+         * Emulate CS driven by the SPI peripheral: The time for toggling CS in software is removed from the gap between
+         * transfers and the setup and hold time is added instead. Op::PARTIAL is not supported with hardware CS
+         * @param enable true to enable hardware CS
+         * @param delay setup time before the first and hold time after the last clock edge in nanoseconds
+         */
+        void setHardwareCs(bool enable, int delay = 0) {this->hardwareCs = enable; this->csDelay = delay;}
+
+
+        /**
+         * Read a status byte repeatedly until a condition holds, e.g. until the write in progress bit of a flash is
+         * cleared or the data ready bit of a sensor is set. The master issues the reads from its interrupt handler without
+         * notifying the app, each read is queued at the tail so that pending transfers of other channels run in between.
+         * The buffer gets ready once when the condition holds or the maximum number of reads is reached, then its data
+         * holds the last status. Canceling ends the status poll after the current read
+         * @param buffer buffer of this channel, the header is the command that reads the status
+         * @param mask mask applied to the status byte
+         * @param value expected value of the masked status byte
+         * @param maxCount maximum number of reads, 0 for no limit
+         * @param interval time between two reads in ticks of the emulated timer (see setTimer()), 0 for back to back reads
+         * @return awaitable that completes at the end of the status poll, getStatusCount() is 0 if the status poll
+         * was not started because the buffer was busy with a different transfer or disabled
+         */
+        [[nodiscard]] auto pollStatus(BufferBase &buffer, uint8_t mask, uint8_t value, int maxCount = 0,
+            uint32_t interval = 0)
+        {
+            assert(buffer.channel == this);
+
+            // if the status poll can't be started, the caller waits for the end of the current transfer and sees that
+            // no status was read
+            if (!buffer.startStatusPoll(mask, value, maxCount, interval) && !buffer.statusPoll)
+                buffer.statusCount = 0;
+            return buffer.untilReadyOrDisabled();
+        }
+
+    protected:
+        // list of buffers
+        IntrusiveList<BufferBase> buffers;
+
+        SpiMaster_native &device;
+        int csPin;
+        bool dcUsed;
+
+        // clock speed level
+        int speed = 0;
+
+        // hardware CS and its setup and hold time
+        bool hardwareCs = false;
+        int csDelay = 0;
+    };
+
+    /**
+     * Buffer for transferring data to/from an emulated SPI slave.
+     * Note that the header may get overwritten when reading data, therefore always set the header before read() or transfer()
+     * A transfer started with Op::PARTIAL keeps CS active, e.g. for protocols that poll for tokens. CS gets deactivated
+     * after the next transfer of the channel without Op::PARTIAL or before a transfer of a different channel starts,
+     * which ends the sequence for the slave. Therefore a sequence of partial transfers needs the bus exclusively, i.e.
+     * other channels must not start transfers until it is finished (e.g. SdCard)
+     * @tparam C capacity of buffer
+     */
+    template <int C>
+    class Buffer : public BufferBase {
+    public:
+        Buffer(Channel &channel) : BufferBase(data, C, channel) {}
+
+    protected:
+        alignas(4) uint8_t data[C];
+    };
+
+    /**
+     * Size class of the shared buffer pool of the master. Instead of provisioning buffers for each channel, channels
+     * borrow buffers on demand using Channel::borrow(), which saves RAM when only few transfers are in flight.
+     * Use BufferPool methods for statistics such as the high-water mark.
+     * @tparam C capacity of buffers
+     * @tparam N number of buffers
+     */
+    template <int C, int N>
+    class Pool : public BufferPool<BufferBase> {
+    public:
+        Pool(SpiMaster_native &device) : Pool(device, std::make_index_sequence<N>()) {}
+
+    protected:
+        template <std::size_t... I>
+        Pool(SpiMaster_native &device, std::index_sequence<I...>)
+            : BufferPool<BufferBase>(C, pointers, N)
+            , pointers{&buffers[I]...}
+            , buffers{BufferBase(data[I], C, *this)...}
+        {
+            device.addPool(*this);
+        }
+
+        BufferBase *pointers[N];
+        BufferBase buffers[N];
+        alignas(4) uint8_t data[N][C];
+    };
+
+    /**
+     * Set coalescing of completions: Completed buffers are collected and handed to the event loop as one batch when
+     * the given number of buffers has completed or when the last queued transfer has completed, as the interrupt
+     * handlers of the hardware masters do
+     * @param count number of buffers to collect, 1 to notify each buffer separately (default)
+     */
+    void setCoalescing(int count) {this->coalesceCount = count;}
+
+    /**
+     * Get number of batches of completed buffers handed to the event loop when coalescing is enabled
+     */
+    int getBatchCount() {return this->batchCount;}
+
+    /**
+     * Attach an emulated slave to a CS pin. Transfers on a CS pin without slave read 0xff
+     * @param csPin chip select pin of the slave
+     * @param slave emulated slave
+     */
+    void attach(int csPin, SpiSlaveModel &slave) {this->slaves[csPin] = &slave;}
+
+    /**
+     * Add a periodic read that gets started by tick() or, if its period is 0, by the completion of the previous read.
+     * The samples are stored in the ring buffer of the poll without notifying the application. The buffer is
+     * dedicated to the poll, its capacity must hold the command and the sample
+     * @param poll periodic read
+     * @param buffer buffer of the channel of the slave
+     */
+    void addPoll(SpiPollBase &poll, BufferBase &buffer);
+
+    /**
+     * Start periodic reads that are due and continue scripts whose delay has elapsed. On hardware this gets called
+     * from the interrupt handler of a timer, the emulation calls it from an emulated timer (see setTimer())
+     * @param now current time in the unit of the periods of the polls (nanoseconds for the emulated timer)
+     */
+    void tick(uint32_t now);
+
+    /**
+     * Emulate a hardware timer that calls tick() periodically on the simulated clock. The bus is idle until the next
+     * tick when no transfer is pending
+     * @param period period of the timer in nanoseconds, 0 to stop the timer
+     */
+    void setTimer(int period);
+
+    /**
+     * Get simulated bus time
+     * @return time in nanoseconds
+     */
+    int64_t getTime() {return this->time;}
+
+    /**
+     * Get number of transferred bytes
+     */
+    int64_t getByteCount() {return this->byteCount;}
+
+    /**
+     * Get number of transfers
+     */
+    int64_t getTransferCount() {return this->transferCount;}
+
+protected:
+    // shared buffer pool
+    BufferBase *borrow(Channel &channel, int capacity, bool autoRelease);
+    void addPool(BufferPool<BufferBase> &pool);
+
+    // get the slave model attached to a CS pin, nullptr if none
+    SpiSlaveModel *getSlave(int csPin);
+
+    // exchange the bytes of a buffer with the slave model and advance the simulated bus time
+    void transfer(BufferBase &buffer);
+
+    // set command and size of a periodic read, the command has to be set each time as reading overwrites it
+    void preparePoll(BufferBase &buffer);
+
+    // emulated interrupt handler: move submitted transfers to the list of pending transfers
+    void drain();
+
+    // add to list of pending transfers and start immediately if list was empty, only with mutex locked
+    void submit(BufferBase &buffer);
+
+    // execute the next step of a script, returns false at the end of the script
+    bool continueScript(BufferBase &buffer);
+
+    // check the status of a status poll and repeat the read, returns false when the status poll has ended
+    bool repeatStatus(BufferBase &buffer);
+
+    // wait until tick() reaches the end of a delay
+    void delay(BufferBase &buffer, uint32_t ticks);
+
+    // deactivate CS pin of a channel if it was kept active by a partial transfer
+    void deselect(Channel &channel);
+
+    // notify app about a completed buffer, directly or coalesced with other completions, only with mutex unlocked as the
+    // app may resume
+    void complete(BufferBase &buffer);
+    void flushCompleted();
+
+    // handler for a batch of coalesced completions
+    class Completion : public Loop_native::YieldHandler {
+    public:
+        Completion(SpiMaster_native &device) : device(device) {}
+        void handle() override;
+
+        SpiMaster_native &device;
+    };
+
+    // emulated hardware timer that calls tick()
+    class Timer : public Loop_native::YieldHandler {
+    public:
+        Timer(SpiMaster_native &device) : device(device) {}
+        void handle() override;
+
+        SpiMaster_native &device;
+    };
+
+    Loop_native &loop;
+
+    int frequency;
+    int gap;
+    int csTime;
+
+    // slave models by CS pin
+    std::map<int, SpiSlaveModel *> slaves;
+
+    // simulated bus time and statistics
+    int64_t time = 0;
+    int64_t byteCount = 0;
+    int64_t transferCount = 0;
+
+    // size classes of shared buffer pool, sorted by capacity
+    BufferPool<BufferBase> *pools = nullptr;
+
+    // emulates disabling the interrupt of the master, locked while the state of the master changes
+    std::recursive_mutex mutex;
+
+    // transfers submitted lock-free from any thread, moved to the list of active transfers by drain()
+    SubmitQueue<BufferBase, &BufferBase::nextSubmitted> submitted;
+
+    // list of active transfers
+    std::deque<BufferBase *> transfers;
+
+    // buffers of periodic reads and time of last tick
+    BufferBase *polls = nullptr;
+    uint32_t pollTime = 0;
+
+    // buffers of scripts and status polls that wait for a delay
+    BufferBase *delayed = nullptr;
+
+    // coalesced completions
+    int coalesceCount = 1;
+    BufferBase *completedFirst = nullptr;
+    BufferBase *completedLast;
+    int completedCount = 0;
+    bool completionPending = false;
+    int batchCount = 0;
+    Completion completion{*this};
+
+    // emulated hardware timer
+    int timerPeriod = 0;
+    int64_t timerTime;
+    bool timerPending = false;
+    Timer timer{*this};
+
+    // channel whose CS pin is still active after a partial transfer
+    Channel *selected = nullptr;
+};
+
+// usable by drivers that are templates over the concrete types of the master (see SpiConcepts.hpp)
+static_assert(SpiMasterType<SpiMaster_native>);
+
+} // namespace coco
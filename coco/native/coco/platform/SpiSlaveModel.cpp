@@ -0,0 +1,15 @@
+#include "SpiSlaveModel.hpp"
+
+
+namespace coco {
+
+SpiSlaveModel::~SpiSlaveModel() {
+}
+
+void SpiSlaveModel::select(int64_t) {
+}
+
+void SpiSlaveModel::deselect(int64_t) {
+}
+
+} // namespace coco
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+
+namespace coco {
+
+/**
+ * Interface for an emulated SPI slave that gets attached to a channel of SpiMaster_native.
+ * The emulated master calls select() when CS gets asserted, transfer() for each byte and deselect() when CS gets
+ * released. All calls receive the simulated bus time in nanoseconds so that a model can emulate internal timing
+ * such as the busy time of a flash page program.
+ */
+class SpiSlaveModel {
+public:
+    virtual ~SpiSlaveModel();
+
+    /**
+     * Chip select (CS) gets asserted
+     * @param time simulated bus time in nanoseconds
+     */
+    virtual void select(int64_t time);
+
+    /**
+     * Exchange one byte
+     * @param time simulated bus time in nanoseconds at the start of the byte
+     * @param mosi byte sent by the master
+     * @param data state of the data/command pin (DC), true for data or if the channel does not use DC
+     * @return byte returned to the master on MISO
+     */
+    virtual uint8_t transfer(int64_t time, uint8_t mosi, bool data) = 0;
+
+    /**
+     * Chip select (CS) gets released
+     * @param time simulated bus time in nanoseconds
+     */
+    virtual void deselect(int64_t time);
+
+    /**
+     * Maximum clock frequency in Hz at which the slave works reliably, the emulated master corrupts bits that the slave
+     * returns when the clock is faster. 0 for no limit
+     */
+    int maxFrequency = 0;
+};
+
+} // namespace coco
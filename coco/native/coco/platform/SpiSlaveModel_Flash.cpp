@@ -0,0 +1,131 @@
+#include "SpiSlaveModel_Flash.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+SpiSlaveModel_Flash::SpiSlaveModel_Flash(int size, uint32_t jedecId, const Timing &timing)
+    : memory(size, 0xff), jedecId(jedecId), timing(timing)
+{
+}
+
+SpiSlaveModel_Flash::~SpiSlaveModel_Flash() {
+}
+
+void SpiSlaveModel_Flash::select(int64_t) {
+    this->index = 0;
+    this->command = 0;
+    this->address = 0;
+    this->ignore = false;
+    this->pageCount = 0;
+    std::fill(std::begin(this->page), std::end(this->page), 0xff);
+}
+
+uint8_t SpiSlaveModel_Flash::transfer(int64_t time, uint8_t mosi, bool) {
+    int index = this->index++;
+    if (index == 0) {
+        this->command = mosi;
+
+        // only the status register can be read while the flash is busy
+        if (busy(time) && mosi != 0x05) {
+            this->ignore = true;
+            ++this->busyAccessCount;
+        }
+        return 0xff;
+    }
+    if (this->ignore)
+        return 0xff;
+
+    switch (this->command) {
+    case 0x05:
+        // read status register
+        return (busy(time) ? WIP : 0) | (this->writeEnabled ? WEL : 0);
+    case 0x9f:
+        // read JEDEC ID
+        return index <= 3 ? uint8_t(this->jedecId >> (24 - index * 8)) : 0xff;
+    case 0x03:
+    case 0x0b:
+    case 0x02:
+        // commands with 3 byte address
+        if (index <= 3) {
+            this->address = (this->address << 8) | mosi;
+            return 0xff;
+        }
+        if (this->command == 0x03) {
+            // read
+            return this->memory[(this->address + index - 4) % this->memory.size()];
+        } else if (this->command == 0x0b) {
+            // fast read with one dummy byte
+            if (index == 4)
+                return 0xff;
+            return this->memory[(this->address + index - 5) % this->memory.size()];
+        } else {
+            // page program: address wraps around at the end of the page
+            this->page[(this->address + index - 4) % PAGE_SIZE] = mosi;
+            ++this->pageCount;
+        }
+        break;
+    case 0x20:
+    case 0xd8:
+        // erase commands with 3 byte address
+        if (index <= 3)
+            this->address = (this->address << 8) | mosi;
+        break;
+    }
+    return 0xff;
+}
+
+void SpiSlaveModel_Flash::deselect(int64_t time) {
+    if (this->ignore || this->index == 0)
+        return;
+
+    switch (this->command) {
+    case 0x06:
+        // write enable
+        this->writeEnabled = true;
+        break;
+    case 0x04:
+        // write disable
+        this->writeEnabled = false;
+        break;
+    case 0x02:
+        // page program (can only change bits from 1 to 0)
+        if (this->writeEnabled && this->pageCount > 0) {
+            int base = (this->address & ~(PAGE_SIZE - 1)) % this->memory.size();
+            for (int i = 0; i < PAGE_SIZE; ++i)
+                this->memory[base + i] &= this->page[i];
+            this->writeEnabled = false;
+            this->busyUntil = time + this->timing.pageProgram;
+            ++this->pageProgramCount;
+        }
+        break;
+    case 0x20:
+        // sector erase
+        if (this->index >= 4)
+            erase(time, this->address & ~(SECTOR_SIZE - 1), SECTOR_SIZE, this->timing.sectorErase);
+        break;
+    case 0xd8:
+        // block erase
+        if (this->index >= 4)
+            erase(time, this->address & ~(BLOCK_SIZE - 1), BLOCK_SIZE, this->timing.blockErase);
+        break;
+    case 0xc7:
+    case 0x60:
+        // chip erase
+        erase(time, 0, int(this->memory.size()), this->timing.chipErase);
+        break;
+    }
+}
+
+void SpiSlaveModel_Flash::erase(int64_t time, int address, int size, int64_t duration) {
+    if (!this->writeEnabled)
+        return;
+    address %= this->memory.size();
+    size = std::min(size, int(this->memory.size()) - address);
+    std::fill(this->memory.begin() + address, this->memory.begin() + address + size, 0xff);
+    this->writeEnabled = false;
+    this->busyUntil = time + duration;
+    ++this->eraseCount;
+}
+
+} // namespace coco
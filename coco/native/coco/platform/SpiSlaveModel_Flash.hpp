@@ -0,0 +1,89 @@
+#pragma once
+
+#include "SpiSlaveModel.hpp"
+#include <vector>
+
+
+namespace coco {
+
+/**
+ * Emulated SPI NOR flash (e.g. W25Q series) with 3 byte addresses, 256 byte pages and 4K sectors.
+ * Supported commands: WREN (0x06), WRDI (0x04), RDSR (0x05), JEDEC ID (0x9f), READ (0x03), FAST_READ (0x0b),
+ * PP (0x02), SE (0x20), BE (0xd8) and CE (0xc7/0x60).
+ * Page program and erase set the WIP bit of the status register for the configured busy time.
+ */
+class SpiSlaveModel_Flash : public SpiSlaveModel {
+public:
+    static constexpr int PAGE_SIZE = 256;
+    static constexpr int SECTOR_SIZE = 4096;
+    static constexpr int BLOCK_SIZE = 65536;
+
+    // status register bits
+    static constexpr uint8_t WIP = 0x01;
+    static constexpr uint8_t WEL = 0x02;
+
+    /**
+     * Busy times in nanoseconds
+     */
+    struct Timing {
+        int64_t pageProgram = 700'000;
+        int64_t sectorErase = 45'000'000;
+        int64_t blockErase = 150'000'000;
+        int64_t chipErase = 5'000'000'000;
+    };
+
+    /**
+     * Constructor
+     * @param size size of the flash in bytes
+     * @param jedecId JEDEC ID (manufacturer, memory type, capacity) returned by command 0x9f
+     * @param timing busy times
+     */
+    SpiSlaveModel_Flash(int size, uint32_t jedecId, const Timing &timing);
+    SpiSlaveModel_Flash(int size, uint32_t jedecId = 0xef4016) : SpiSlaveModel_Flash(size, jedecId, Timing()) {}
+    ~SpiSlaveModel_Flash() override;
+
+    void select(int64_t time) override;
+    uint8_t transfer(int64_t time, uint8_t mosi, bool data) override;
+    void deselect(int64_t time) override;
+
+    /**
+     * Get flash contents
+     */
+    uint8_t *data() {return this->memory.data();}
+    int size() {return int(this->memory.size());}
+
+    /**
+     * Statistics
+     */
+    int getPageProgramCount() {return this->pageProgramCount;}
+    int getEraseCount() {return this->eraseCount;}
+    int getBusyAccessCount() {return this->busyAccessCount;}
+
+protected:
+    bool busy(int64_t time) {return time < this->busyUntil;}
+    void erase(int64_t time, int address, int size, int64_t duration);
+
+    std::vector<uint8_t> memory;
+    uint32_t jedecId;
+    Timing timing;
+
+    // state of current command
+    int index;
+    uint8_t command;
+    int address;
+    bool ignore;
+
+    // page program data
+    int pageCount;
+    uint8_t page[PAGE_SIZE];
+
+    // status
+    bool writeEnabled = false;
+    int64_t busyUntil = 0;
+
+    int pageProgramCount = 0;
+    int eraseCount = 0;
+    int busyAccessCount = 0;
+};
+
+} // namespace coco
@@ -0,0 +1,73 @@
+#include "SpiSlaveModel_Registers.hpp"
+
+
+namespace coco {
+
+SpiSlaveModel_Registers::SpiSlaveModel_Registers(const Config &config)
+    : config(config), registers(config.registerCount)
+{
+}
+
+SpiSlaveModel_Registers::~SpiSlaveModel_Registers() {
+}
+
+void SpiSlaveModel_Registers::select(int64_t time) {
+    this->index = 0;
+    update(time);
+}
+
+uint8_t SpiSlaveModel_Registers::transfer(int64_t, uint8_t mosi, bool) {
+    auto &config = this->config;
+    if (this->index++ == 0) {
+        // address byte
+        this->address = mosi & config.addressMask;
+        this->read = (mosi & config.readFlag) != 0;
+        this->increment = config.incrementFlag == 0 || (mosi & config.incrementFlag) != 0;
+        if (this->read)
+            ++this->readCount;
+        else
+            ++this->writeCount;
+        return 0xff;
+    }
+
+    int address = this->address % config.registerCount;
+    if (this->increment)
+        ++this->address;
+
+    if (this->read) {
+        // reading the first sample register clears data-ready
+        if (config.samplePeriod > 0 && address == config.sampleRegister)
+            this->registers[config.statusRegister] &= ~config.dataReadyMask;
+        return this->registers[address];
+    }
+    this->registers[address] = mosi;
+    return 0xff;
+}
+
+void SpiSlaveModel_Registers::update(int64_t time) {
+    auto &config = this->config;
+    if (config.samplePeriod <= 0)
+        return;
+
+    int64_t count = time / config.samplePeriod;
+
+    // sampling starts on first access
+    if (!this->started) {
+        this->started = true;
+        this->sampleCount = count;
+    }
+
+    if (count > this->sampleCount) {
+        // count samples that were overwritten before they were read
+        uint8_t &status = this->registers[config.statusRegister];
+        this->missedSampleCount += int(count - this->sampleCount) - ((status & config.dataReadyMask) != 0 ? 0 : 1);
+        this->sampleCount = count;
+
+        // store sample counter in sample registers and set data-ready
+        for (int i = 0; i < config.sampleSize; ++i)
+            this->registers[config.sampleRegister + i] = uint8_t(count >> i * 8);
+        status |= config.dataReadyMask;
+    }
+}
+
+} // namespace coco
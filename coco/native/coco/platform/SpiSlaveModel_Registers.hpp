@@ -0,0 +1,82 @@
+#pragma once
+
+#include "SpiSlaveModel.hpp"
+#include <vector>
+
+
+namespace coco {
+
+/**
+ * Emulated register-file sensor (e.g. accelerometer, pressure sensor). The first byte selects the register address
+ * and read/write, subsequent bytes read or write consecutive registers.
+ * Optionally the sensor produces samples with a fixed period: The sample registers receive a running sample counter
+ * (little endian) and the data-ready bit in the status register is set until the first sample register is read.
+ */
+class SpiSlaveModel_Registers : public SpiSlaveModel {
+public:
+    struct Config {
+        // number of registers
+        int registerCount = 128;
+
+        // address byte: mask of address bits, flag that indicates read
+        uint8_t addressMask = 0x7f;
+        uint8_t readFlag = 0x80;
+
+        // flag in address byte that enables auto increment (e.g. 0x40), 0 for always auto increment
+        uint8_t incrementFlag = 0;
+
+        // sampling: status register with data-ready bit, sample registers, sample period in nanoseconds (0 for no sampling)
+        int statusRegister = 0;
+        uint8_t dataReadyMask = 0x01;
+        int sampleRegister = 0;
+        int sampleSize = 0;
+        int64_t samplePeriod = 0;
+    };
+
+    /**
+     * Constructor
+     * @param config configuration of the register file
+     */
+    SpiSlaveModel_Registers(const Config &config);
+    SpiSlaveModel_Registers() : SpiSlaveModel_Registers(Config()) {}
+    ~SpiSlaveModel_Registers() override;
+
+    void select(int64_t time) override;
+    uint8_t transfer(int64_t time, uint8_t mosi, bool data) override;
+
+    /**
+     * Access registers directly
+     */
+    uint8_t get(int address) {return this->registers[address];}
+    void set(int address, uint8_t value) {this->registers[address] = value;}
+
+    /**
+     * Statistics
+     */
+    int getReadCount() {return this->readCount;}
+    int getWriteCount() {return this->writeCount;}
+    int64_t getSampleCount() {return this->sampleCount;}
+    int getMissedSampleCount() {return this->missedSampleCount;}
+
+protected:
+    void update(int64_t time);
+
+    Config config;
+    std::vector<uint8_t> registers;
+
+    // state of current access
+    int index;
+    int address;
+    bool read;
+    bool increment;
+
+    // sampling
+    bool started = false;
+    int64_t sampleCount = 0;
+    int missedSampleCount = 0;
+
+    int readCount = 0;
+    int writeCount = 0;
+};
+
+} // namespace coco
@@ -0,0 +1,113 @@
+#include "SpiSlaveModel_ST7789.hpp"
+
+
+namespace coco {
+
+SpiSlaveModel_ST7789::SpiSlaveModel_ST7789(int width, int height)
+    : width(width), height(height), memory(width * height)
+    , x1(width - 1), y1(height - 1)
+{
+}
+
+SpiSlaveModel_ST7789::~SpiSlaveModel_ST7789() {
+}
+
+uint8_t SpiSlaveModel_ST7789::transfer(int64_t time, uint8_t mosi, bool data) {
+    if (!data) {
+        // command
+        this->command = mosi;
+        this->index = 0;
+        ++this->commandCount;
+
+        // controller does not accept commands for some time after reset and sleep out
+        if (time < this->busyUntil)
+            ++this->violationCount;
+
+        switch (mosi) {
+        case 0x01:
+            // software reset: wait 5ms before next command
+            this->x0 = 0;
+            this->x1 = this->width - 1;
+            this->y0 = 0;
+            this->y1 = this->height - 1;
+            this->on = false;
+            this->sleep = true;
+            this->busyUntil = time + 5'000'000;
+            break;
+        case 0x10:
+            // sleep in
+            this->sleep = true;
+            this->busyUntil = time + 5'000'000;
+            break;
+        case 0x11:
+            // sleep out
+            this->sleep = false;
+            this->busyUntil = time + 5'000'000;
+            break;
+        case 0x28:
+            this->on = false;
+            break;
+        case 0x29:
+            this->on = true;
+            break;
+        case 0x2c:
+            // memory write: start at top left corner of window
+            this->x = this->x0;
+            this->y = this->y0;
+            break;
+        }
+        return 0xff;
+    }
+
+    // data
+    int index = this->index++;
+    switch (this->command) {
+    case 0x2a:
+    case 0x2b:
+        // column/row address set: start and end, each 16 bit big endian
+        if ((index & 1) == 0) {
+            this->parameter = mosi;
+        } else {
+            int value = (this->parameter << 8) | mosi;
+            if (this->command == 0x2a) {
+                if (index == 1)
+                    this->x0 = value;
+                else if (index == 3)
+                    this->x1 = value;
+            } else {
+                if (index == 1)
+                    this->y0 = value;
+                else if (index == 3)
+                    this->y1 = value;
+            }
+            if (index == 3)
+                ++this->windowCount;
+        }
+        break;
+    case 0x2c:
+    case 0x3c:
+        // memory write (continue)
+        if ((index & 1) == 0)
+            this->parameter = mosi;
+        else
+            writePixel((this->parameter << 8) | mosi);
+        break;
+    }
+    return 0xff;
+}
+
+void SpiSlaveModel_ST7789::writePixel(uint16_t pixel) {
+    if (this->x < this->width && this->y < this->height)
+        this->memory[this->x + this->y * this->width] = pixel;
+    ++this->pixelCount;
+
+    // advance write position inside the window
+    if (this->x < this->x1) {
+        ++this->x;
+    } else {
+        this->x = this->x0;
+        this->y = this->y < this->y1 ? this->y + 1 : this->y0;
+    }
+}
+
+} // namespace coco
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "SpiSlaveModel.hpp"
+#include <vector>
+
+
+namespace coco {
+
+/**
+ * Emulated display controller similar to ST7789 with a data/command (DC) aware command parser and 16 bit (RGB565)
+ * frame memory.
+ * Supported commands: SWRESET (0x01), SLPIN (0x10), SLPOUT (0x11), INVOFF/INVON (0x20/0x21), DISPOFF/DISPON (0x28/0x29),
+ * CASET (0x2a), RASET (0x2b), RAMWR (0x2c), MADCTL (0x36), COLMOD (0x3a) and RAMWRC (0x3c), other commands are ignored.
+ * Commands that arrive while the controller is busy after SWRESET or SLPOUT are counted as timing violations.
+ */
+class SpiSlaveModel_ST7789 : public SpiSlaveModel {
+public:
+    /**
+     * Constructor
+     * @param width width of the display in pixels
+     * @param height height of the display in pixels
+     */
+    SpiSlaveModel_ST7789(int width, int height);
+    ~SpiSlaveModel_ST7789() override;
+
+    uint8_t transfer(int64_t time, uint8_t mosi, bool data) override;
+
+    /**
+     * Get frame memory (RGB565)
+     */
+    uint16_t *data() {return this->memory.data();}
+    uint16_t get(int x, int y) {return this->memory[x + y * this->width];}
+
+    /**
+     * Statistics
+     */
+    int getCommandCount() {return this->commandCount;}
+    int getWindowCount() {return this->windowCount;}
+    int64_t getPixelCount() {return this->pixelCount;}
+    int getViolationCount() {return this->violationCount;}
+
+protected:
+    void writePixel(uint16_t pixel);
+
+    int width;
+    int height;
+    std::vector<uint16_t> memory;
+
+    // command parser
+    uint8_t command = 0;
+    int index = 0;
+    uint8_t parameter = 0;
+
+    // window and write position
+    int x0 = 0;
+    int x1;
+    int y0 = 0;
+    int y1;
+    int x = 0;
+    int y = 0;
+
+    bool on = false;
+    bool sleep = true;
+    int64_t busyUntil = 0;
+
+    int commandCount = 0;
+    int windowCount = 0;
+    int64_t pixelCount = 0;
+    int violationCount = 0;
+};
+
+} // namespace coco
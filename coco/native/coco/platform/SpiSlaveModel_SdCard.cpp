@@ -0,0 +1,246 @@
+#include "SpiSlaveModel_SdCard.hpp"
+#include <coco/SpiCrc.hpp>
+#include <algorithm>
+
+
+namespace coco {
+
+SpiSlaveModel_SdCard::SpiSlaveModel_SdCard(int blockCount, const Timing &timing)
+    : memory(blockCount * BLOCK_SIZE, 0xff), timing(timing)
+{
+}
+
+SpiSlaveModel_SdCard::~SpiSlaveModel_SdCard() {
+}
+
+void SpiSlaveModel_SdCard::select(int64_t) {
+    this->cmdIndex = 0;
+}
+
+uint8_t SpiSlaveModel_SdCard::transfer(int64_t time, uint8_t mosi, bool) {
+    // output: pending response, busy signal or read data
+    uint8_t miso = 0xff;
+    if (!this->response.empty()) {
+        miso = this->response.front();
+        this->response.pop_front();
+    } else if (busy(time)) {
+        miso = 0x00;
+    } else if (this->state == State::READ) {
+        // access time starts when the previous block has been read
+        if (this->readTime < 0)
+            this->readTime = time + this->timing.readAccess;
+        if (time >= this->readTime) {
+            // start token, data and CRC
+            auto block = this->memory.begin() + (this->blockIndex % getBlockCount()) * BLOCK_SIZE;
+            uint16_t crc = SPI_CRC16_CCITT.compute(&block[0], BLOCK_SIZE);
+            this->response.insert(this->response.end(), block, block + BLOCK_SIZE);
+            this->response.push_back(crc >> 8);
+            this->response.push_back(crc);
+            ++this->blockReadCount;
+            miso = 0xfe;
+
+            if (this->multiple) {
+                ++this->blockIndex;
+                this->readTime = -1;
+            } else {
+                this->state = State::IDLE;
+            }
+        }
+    }
+
+    // input: data block
+    if (this->state == State::RECEIVE) {
+        this->blockData[this->dataIndex++] = mosi;
+        if (this->dataIndex == BLOCK_SIZE + 2)
+            block(time);
+        return miso;
+    }
+
+    // input: command (also aborts a multi-block read with CMD12)
+    if (this->cmdIndex > 0 || (mosi & 0xc0) == 0x40) {
+        if (this->cmdIndex == 0 && busy(time)) {
+            // card ignores commands while it is busy
+            ++this->busyAccessCount;
+            return miso;
+        }
+        this->cmd[this->cmdIndex++] = mosi;
+        if (this->cmdIndex == 6) {
+            this->cmdIndex = 0;
+            command(time);
+        }
+        return miso;
+    }
+
+    // input: tokens of single and multi-block write
+    if (this->state == State::WRITE && (mosi == 0xfe || mosi == 0xfc || mosi == 0xfd)) {
+        if (busy(time)) {
+            // card ignores tokens while it is busy programming the previous block
+            ++this->busyAccessCount;
+        } else if (mosi == (this->multiple ? 0xfc : 0xfe)) {
+            // start token
+            this->state = State::RECEIVE;
+            this->dataIndex = 0;
+        } else if (mosi == 0xfd && this->multiple) {
+            // stop token: one stuff byte, then busy
+            this->response.push_back(0xff);
+            this->busyUntil = time + this->timing.stop;
+            this->preEraseCount = 0;
+            this->state = State::IDLE;
+        }
+    }
+    return miso;
+}
+
+void SpiSlaveModel_SdCard::command(int64_t time) {
+    ++this->commandCount;
+    int index = this->cmd[0] & 0x3f;
+    uint32_t arg = (this->cmd[1] << 24) | (this->cmd[2] << 16) | (this->cmd[3] << 8) | this->cmd[4];
+    bool app = this->appCommand;
+    this->appCommand = false;
+
+    // check CRC, always for CMD0 and CMD8
+    if ((this->crcEnabled || index == 0 || index == 8) && ((crc7(this->cmd, 5) << 1) | 1) != this->cmd[5]) {
+        ++this->crcErrorCount;
+        respond(CRC_ERROR | (this->idle ? IDLE : 0));
+        return;
+    }
+
+    uint8_t r1 = this->idle ? IDLE : 0;
+    if (app) {
+        switch (index) {
+        case 23:
+            // set number of pre-erased blocks for the next multi-block write
+            this->preEraseCount = arg & 0x7fffff;
+            respond(r1);
+            return;
+        case 41:
+            // initialize, card leaves idle state after the initialization time
+            if (this->readyTime < 0)
+                this->readyTime = time + this->timing.init;
+            if (time >= this->readyTime)
+                this->idle = false;
+            respond(this->idle ? IDLE : 0);
+            return;
+        }
+    }
+
+    // only few commands are allowed in idle state
+    if (this->idle && index != 0 && index != 8 && index != 55 && index != 58 && index != 59) {
+        respond(r1 | ILLEGAL_COMMAND);
+        return;
+    }
+
+    switch (index) {
+    case 0:
+        // go idle state
+        this->idle = true;
+        this->readyTime = -1;
+        this->crcEnabled = false;
+        this->state = State::IDLE;
+        this->response.clear();
+        respond(IDLE);
+        break;
+    case 8:
+        // send interface condition (R7): echo voltage and check pattern
+        respond(r1);
+        this->response.push_back(0x00);
+        this->response.push_back(0x00);
+        this->response.push_back((arg >> 8) & 0x0f);
+        this->response.push_back(arg);
+        break;
+    case 12:
+        // stop transmission: discard pending read data, one stuff byte before the response
+        if (this->state == State::READ) {
+            this->state = State::IDLE;
+            this->response.clear();
+            respond(r1);
+        } else {
+            respond(r1 | ILLEGAL_COMMAND);
+        }
+        break;
+    case 13:
+        // send status (R2)
+        respond(r1);
+        this->response.push_back(0x00);
+        break;
+    case 16:
+        // set block length, only 512 is supported
+        respond(arg == BLOCK_SIZE ? r1 : r1 | PARAMETER_ERROR);
+        break;
+    case 17:
+    case 18:
+    case 24:
+    case 25:
+        // single/multiple block read/write
+        if (arg >= uint32_t(getBlockCount())) {
+            respond(r1 | ADDRESS_ERROR);
+            break;
+        }
+        this->blockIndex = arg;
+        this->multiple = index == 18 || index == 25;
+        if (index <= 18) {
+            this->state = State::READ;
+            this->readTime = time + this->timing.readAccess;
+        } else {
+            this->state = State::WRITE;
+        }
+        respond(r1);
+        break;
+    case 55:
+        // application command follows
+        this->appCommand = true;
+        respond(r1);
+        break;
+    case 58:
+        // read OCR (R3): power up status and card capacity status (CCS) set
+        respond(r1);
+        this->response.push_back(0xc0);
+        this->response.push_back(0xff);
+        this->response.push_back(0x80);
+        this->response.push_back(0x00);
+        break;
+    case 59:
+        // CRC on/off
+        this->crcEnabled = (arg & 1) != 0;
+        respond(r1);
+        break;
+    default:
+        respond(r1 | ILLEGAL_COMMAND);
+    }
+}
+
+void SpiSlaveModel_SdCard::block(int64_t time) {
+    this->state = this->multiple ? State::WRITE : State::IDLE;
+
+    // check CRC if enabled, data response token for CRC error
+    uint16_t crc = (this->blockData[BLOCK_SIZE] << 8) | this->blockData[BLOCK_SIZE + 1];
+    if (this->crcEnabled && crc != SPI_CRC16_CCITT.compute(this->blockData, BLOCK_SIZE)) {
+        ++this->crcErrorCount;
+        this->response.push_back(0x0b);
+        return;
+    }
+
+    // data response token for write error
+    if (this->blockIndex >= getBlockCount()) {
+        this->response.push_back(0x0d);
+        return;
+    }
+
+    // program the block, card is busy until finished
+    std::copy(this->blockData, this->blockData + BLOCK_SIZE, this->memory.begin() + this->blockIndex * BLOCK_SIZE);
+    ++this->blockIndex;
+    ++this->blockWriteCount;
+    this->response.push_back(0x05);
+    int64_t duration = this->timing.blockWrite;
+    if (this->multiple) {
+        if (this->preEraseCount > 0) {
+            duration = this->timing.preErasedBlockWrite;
+            --this->preEraseCount;
+        } else {
+            duration = this->timing.streamBlockWrite;
+        }
+    }
+    this->busyUntil = time + duration;
+}
+
+} // namespace coco
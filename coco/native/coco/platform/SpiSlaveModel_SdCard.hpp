@@ -0,0 +1,143 @@
+#pragma once
+
+#include "SpiSlaveModel.hpp"
+#include <deque>
+#include <vector>
+
+
+namespace coco {
+
+/**
+ * Emulated SD card (SDHC, block addressing) in SPI mode.
+ * Supported commands: CMD0, CMD8, CMD12, CMD13, CMD16, CMD17, CMD18, CMD24, CMD25, CMD55, CMD58, CMD59 and the
+ * application commands ACMD23 (pre-erase hint for multi-block write) and ACMD41.
+ * Responses follow the command after one byte (NCR), read data follows the start token after the configured access
+ * time and written blocks keep the card busy (MISO low) for the configured program time. A multi-block write that was
+ * announced with ACMD23 uses the shorter program time of pre-erased blocks. The CRC of commands is checked for CMD0
+ * and CMD8 and for all commands and data blocks when CRC was enabled with CMD59.
+ */
+class SpiSlaveModel_SdCard : public SpiSlaveModel {
+public:
+    static constexpr int BLOCK_SIZE = 512;
+
+    // R1 response bits
+    static constexpr uint8_t IDLE = 0x01;
+    static constexpr uint8_t ILLEGAL_COMMAND = 0x04;
+    static constexpr uint8_t CRC_ERROR = 0x08;
+    static constexpr uint8_t ADDRESS_ERROR = 0x20;
+    static constexpr uint8_t PARAMETER_ERROR = 0x40;
+
+    /**
+     * Timing in nanoseconds
+     */
+    struct Timing {
+        // time from the first ACMD41 until the card leaves the idle state
+        int64_t init = 2'000'000;
+
+        // time until the start token of a read block
+        int64_t readAccess = 100'000;
+
+        // program time of a block written with CMD24
+        int64_t blockWrite = 500'000;
+
+        // program time of a block of a multi-block write with CMD25
+        int64_t streamBlockWrite = 150'000;
+
+        // program time of a block of a multi-block write that was pre-erased with ACMD23
+        int64_t preErasedBlockWrite = 50'000;
+
+        // busy time after the stop token of a multi-block write
+        int64_t stop = 200'000;
+    };
+
+    /**
+     * Constructor
+     * @param blockCount number of 512 byte blocks
+     * @param timing timing of the card
+     */
+    SpiSlaveModel_SdCard(int blockCount, const Timing &timing);
+    SpiSlaveModel_SdCard(int blockCount) : SpiSlaveModel_SdCard(blockCount, Timing()) {}
+    ~SpiSlaveModel_SdCard() override;
+
+    void select(int64_t time) override;
+    uint8_t transfer(int64_t time, uint8_t mosi, bool data) override;
+
+    /**
+     * Get card contents
+     */
+    uint8_t *data() {return this->memory.data();}
+    int getBlockCount() {return int(this->memory.size() / BLOCK_SIZE);}
+
+    /**
+     * Get timing of the card
+     */
+    const Timing &getTiming() {return this->timing;}
+
+    /**
+     * Statistics
+     */
+    int getCommandCount() {return this->commandCount;}
+    int getBlockReadCount() {return this->blockReadCount;}
+    int getBlockWriteCount() {return this->blockWriteCount;}
+    int getCrcErrorCount() {return this->crcErrorCount;}
+    int getBusyAccessCount() {return this->busyAccessCount;}
+
+protected:
+    enum class State {
+        // waiting for a command
+        IDLE,
+
+        // single or multi-block read
+        READ,
+
+        // waiting for the start token of a single or multi-block write
+        WRITE,
+
+        // receiving a data block
+        RECEIVE
+    };
+
+    bool busy(int64_t time) {return time < this->busyUntil;}
+    void command(int64_t time);
+    void respond(uint8_t r1) {this->response.push_back(0xff); this->response.push_back(r1);}
+    void block(int64_t time);
+
+    std::vector<uint8_t> memory;
+    Timing timing;
+
+    State state = State::IDLE;
+    bool multiple;
+
+    // command that is being received
+    uint8_t cmd[6];
+    int cmdIndex = 0;
+    bool appCommand = false;
+
+    // initialization
+    bool idle = true;
+    int64_t readyTime = -1;
+    bool crcEnabled = false;
+
+    // bytes returned on MISO
+    std::deque<uint8_t> response;
+
+    // current block and time when the next read block is available (-1: when the previous block has been read)
+    int blockIndex;
+    int64_t readTime;
+
+    // data block and CRC that is being received
+    uint8_t blockData[BLOCK_SIZE + 2];
+    int dataIndex;
+
+    // number of pre-erased blocks for the next multi-block write
+    int preEraseCount = 0;
+    int64_t busyUntil = 0;
+
+    int commandCount = 0;
+    int blockReadCount = 0;
+    int blockWriteCount = 0;
+    int crcErrorCount = 0;
+    int busyAccessCount = 0;
+};
+
+} // namespace coco
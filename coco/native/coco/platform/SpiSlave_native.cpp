@@ -0,0 +1,137 @@
+#include "SpiSlave_native.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+// SpiSlave_native
+
+SpiSlave_native::SpiSlave_native(Loop_native &loop)
+    : BufferDevice(State::READY), loop(loop)
+{
+}
+
+SpiSlave_native::~SpiSlave_native() {
+}
+
+int SpiSlave_native::getBufferCount() {
+    return this->buffers.count();
+}
+
+SpiSlave_native::BufferBase &SpiSlave_native::getBuffer(int index) {
+    return this->buffers.get(index);
+}
+
+void SpiSlave_native::select(int64_t) {
+    // arm the first started buffer for this transaction
+    this->selected = true;
+    this->active = this->transfers.empty() ? nullptr : this->transfers.front();
+    this->count = 0;
+}
+
+uint8_t SpiSlave_native::transfer(int64_t, uint8_t mosi, bool) {
+    auto buffer = this->active;
+    int i = this->count++;
+    if (buffer == nullptr)
+        return 0xff;
+
+    // send header and data on write, 0xff after the end
+    uint8_t miso = 0xff;
+    if ((buffer->op & BufferBase::Op::WRITE) != 0 && i < buffer->p.size)
+        miso = buffer->p.data[i];
+
+    // receive into the buffer on read (after the byte to send was taken, as the DMA of a hardware slave does)
+    if ((buffer->op & BufferBase::Op::READ) != 0 && i < buffer->p.capacity)
+        buffer->p.data[i] = mosi;
+
+    return miso;
+}
+
+void SpiSlave_native::deselect(int64_t) {
+    if (!this->selected)
+        return;
+    this->selected = false;
+
+    auto buffer = this->active;
+    if (buffer == nullptr) {
+        if (this->count > 0)
+            ++this->missedCount;
+        return;
+    }
+
+    // the buffer stays armed if the master did not transfer any bytes
+    if (this->count == 0)
+        return;
+    this->active = nullptr;
+
+    // end of transaction
+    buffer->transferred = this->count;
+    if ((buffer->op & BufferBase::Op::READ) != 0) {
+        if (this->count > buffer->p.capacity)
+            ++this->overflowCount;
+        buffer->p.size = std::clamp(this->count, buffer->p.headerSize, buffer->p.capacity);
+    }
+    this->transfers.pop_front();
+
+    // notify from event loop that the transaction has finished -> handle()
+    this->loop.yield(*buffer);
+}
+
+
+// BufferBase
+
+SpiSlave_native::BufferBase::BufferBase(uint8_t *data, int capacity, SpiSlave_native &device)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), device(device)
+{
+    device.buffers.add(*this);
+}
+
+SpiSlave_native::BufferBase::~BufferBase() {
+}
+
+bool SpiSlave_native::BufferBase::start(Op op) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+
+    // check if READ or WRITE flag is set
+    assert((op & Op::READ_WRITE) != 0);
+
+    this->op = op;
+
+    // add to list of started transfers, gets armed at the next transaction of the master
+    this->device.transfers.push_back(this);
+
+    // set state
+    setBusy();
+
+    return true;
+}
+
+bool SpiSlave_native::BufferBase::cancel() {
+    if (this->st.state != State::BUSY)
+        return false;
+    auto &device = this->device;
+
+    // remove from started transfers if not yet armed, otherwise complete normally
+    if (device.active != this) {
+        auto &transfers = device.transfers;
+        auto it = std::find(transfers.begin(), transfers.end(), this);
+        if (it != transfers.end()) {
+            transfers.erase(it);
+
+            // cancel succeeded: set buffer ready again
+            setReady(0);
+        }
+    }
+
+    return true;
+}
+
+void SpiSlave_native::BufferBase::handle() {
+    // notify app that buffer has finished
+    setReady();
+}
+
+} // namespace coco
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "SpiSlaveModel.hpp"
+#include <coco/BufferDevice.hpp>
+#include <coco/platform/Loop_native.hpp>
+#include <deque>
+
+
+namespace coco {
+
+/**
+ * Emulation of a SPI slave for the native platform (Windows, MacOS, Linux). The slave gets attached to a CS pin of
+ * SpiMaster_native like a slave model, therefore a protocol between two devices can be tested on the simulated clock.
+ * Buffers are armed in the order they were started, the first buffer is armed for the next transaction of the master,
+ * i.e. when CS gets asserted, and completes when CS gets released. A transaction without bytes does not complete the
+ * buffer, it stays armed for the next transaction like on hardware. Start a second buffer to prepare the next response
+ * while the first is in use (double buffering). If no buffer is armed, the slave returns 0xff and the transaction is
+ * counted as missed.
+ */
+class SpiSlave_native : public BufferDevice, public SpiSlaveModel {
+public:
+    /**
+     * Constructor
+     * @param loop event loop
+     */
+    SpiSlave_native(Loop_native &loop);
+    ~SpiSlave_native() override;
+
+    // internal buffer base class, derives from IntrusiveListNode for the list of buffers and Loop_native::YieldHandler to be notified from the event loop
+    class BufferBase : public coco::Buffer, public IntrusiveListNode, public Loop_native::YieldHandler {
+        friend class SpiSlave_native;
+    public:
+        /**
+         * Constructor
+         * @param data data of the buffer
+         * @param capacity capacity of the buffer
+         * @param device slave device to attach to
+         */
+        BufferBase(uint8_t *data, int capacity, SpiSlave_native &device);
+        ~BufferBase() override;
+
+        // Buffer methods
+        bool start(Op op) override;
+        bool cancel() override;
+
+        /**
+         * Get number of bytes the master has transferred in the last transaction, may exceed the capacity
+         */
+        int getTransferredCount() {return this->transferred;}
+
+    protected:
+        void handle() override;
+
+        SpiSlave_native &device;
+
+        Op op;
+        int transferred = 0;
+    };
+
+    /**
+     * Buffer for a transaction of the master. On write, the header and data get returned to the master on MISO (0xff
+     * after the end), on read, the bytes received on MOSI fill the buffer from the start and size() is the number of
+     * bytes received after the header. Both can be combined (Op::READ_WRITE), then the received bytes replace the sent
+     * bytes. A transaction can be canceled only until it gets armed
+     * @tparam C capacity of buffer
+     */
+    template <int C>
+    class Buffer : public BufferBase {
+    public:
+        Buffer(SpiSlave_native &device) : BufferBase(data, C, device) {}
+
+    protected:
+        alignas(4) uint8_t data[C];
+    };
+
+    // BufferDevice methods
+    int getBufferCount() override;
+    BufferBase &getBuffer(int index) override;
+
+    // SpiSlaveModel methods
+    void select(int64_t time) override;
+    uint8_t transfer(int64_t time, uint8_t mosi, bool data) override;
+    void deselect(int64_t time) override;
+
+    /**
+     * Get number of transactions of the master while no buffer was armed
+     */
+    int getMissedCount() {return this->missedCount;}
+
+    /**
+     * Get number of transactions where the master sent more bytes than a read buffer could take
+     */
+    int getOverflowCount() {return this->overflowCount;}
+
+protected:
+    Loop_native &loop;
+
+    // list of buffers
+    IntrusiveList<BufferBase> buffers;
+
+    // list of started transfers, the first gets armed when CS gets asserted
+    std::deque<BufferBase *> transfers;
+
+    // armed buffer of the current or, after a transaction without bytes, the next transaction (nullptr if none was
+    // armed) and number of transferred bytes
+    bool selected = false;
+    BufferBase *active = nullptr;
+    int count = 0;
+
+    int missedCount = 0;
+    int overflowCount = 0;
+};
+
+} // namespace coco
@@ -1,10 +1,25 @@
 #include "SpiMaster_SPIM3.hpp"
 #include <coco/debug.hpp>
 #include <coco/platform/nvic.hpp>
+#include <algorithm>
+#include <iterator>
 
 
 namespace coco {
 
+// supported clock frequencies, each doubles the previous one
+static const uint32_t frequencies[] = {
+    SPIM_FREQUENCY_FREQUENCY_K125,
+    SPIM_FREQUENCY_FREQUENCY_K250,
+    SPIM_FREQUENCY_FREQUENCY_K500,
+    SPIM_FREQUENCY_FREQUENCY_M1,
+    SPIM_FREQUENCY_FREQUENCY_M2,
+    SPIM_FREQUENCY_FREQUENCY_M4,
+    SPIM_FREQUENCY_FREQUENCY_M8,
+    SPIM_FREQUENCY_FREQUENCY_M16,
+    SPIM_FREQUENCY_FREQUENCY_M32};
+static constexpr int FREQUENCY_COUNT = std::size(frequencies);
+
 SpiMaster_SPIM3::SpiMaster_SPIM3(Loop_Queue &loop,
     gpio::Config sckPin, gpio::Config misoPin, gpio::Config mosiPin, gpio::Config dcPin,
     spi::Config config)
@@ -39,7 +54,12 @@ SpiMaster_SPIM3::SpiMaster_SPIM3(Loop_Queue &loop,
 
     // configure SPI
     NRF_SPIM3->INTENSET = N(SPIM_INTENSET_END, Set);
-    NRF_SPIM3->FREQUENCY = int(config & spi::Config::SPEED_MASK);
+    nvic::enable(SPIM3_IRQn); // also handles submitted transfers (see BufferBase::start())
+    uint32_t frequency = int(config & spi::Config::SPEED_MASK);
+    NRF_SPIM3->FREQUENCY = frequency;
+    this->baseFrequencyIndex = 0;
+    while (this->baseFrequencyIndex < FREQUENCY_COUNT - 1 && frequencies[this->baseFrequencyIndex] != frequency)
+        ++this->baseFrequencyIndex;
     NRF_SPIM3->CONFIG = int(config & spi::Config::CONFIG_MASK);
 
     // permanently enable SPI to ensure the right idle level for the clock
@@ -51,33 +71,292 @@ void SpiMaster_SPIM3::SPIM3_IRQHandler() {
         // clear pending interrupt flags at peripheral and NVIC
         NRF_SPIM3->EVENTS_END = 0;
 
+        bool more = false;
         this->transfers.pop(
             [this](BufferBase &buffer) {
-                // deactivate CS pin
-                //if ((buffer.op & BufferBase::Op::PARTIAL) == 0)
-                    gpio::setOutput(buffer.channel.csPin, false);
+                // check CRC that was received after the data
+                int crcCount = buffer.crc.byteCount();
+                if (crcCount > 0 && (buffer.op & BufferBase::Op::READ) != 0) {
+                    int headerSize = buffer.p.headerSize;
+                    int size = buffer.p.size;
+                    auto data = buffer.p.data;
+                    uint16_t crc = buffer.crc.compute(data + headerSize, size - headerSize);
+                    uint16_t received = crcCount == 2 ? (data[size] << 8) | data[size + 1] : data[size];
+                    buffer.crcResult = crc == received ? SpiCrc::Result::OK : SpiCrc::Result::ERROR;
+                }
+
+                // deactivate CS pin unless the SPIM has released it already (hardware CS) or the transfer is partial,
+                // then it gets deactivated lazily
+                if ((buffer.op & BufferBase::Op::PARTIAL) != 0)
+                    this->selected = buffer.channel;
+                else if (!buffer.channel->hardwareCs)
+                    gpio::setOutput(buffer.channel->csPin, false);
 
                 // notify app that buffer has finished
-                this->loop.push(buffer);
+                complete(buffer);
                 return true;
             },
-            [](BufferBase &next) {
+            [&more](BufferBase &next) {
                 // start next buffer
+                more = true;
                 next.start();
             }
         );
+
+        // notify app about coalesced completions at the end of a burst or when the threshold is reached
+        if (!more || this->completedCount >= this->coalesceCount)
+            flushCompleted();
+    }
+
+    // continue scripts and status polls whose delay has elapsed, tick() triggers the interrupt
+    if (this->delayed != nullptr)
+        continueDelayed();
+
+    // take transfers that were submitted in the meantime
+    if (!this->submitted.empty())
+        drain(nvic::Guard(SPIM3_IRQn));
+}
+
+void SpiMaster_SPIM3::drain(const nvic::Guard &guard) {
+    this->submitted.drain([this, &guard](BufferBase &buffer) {
+        // add to list of pending transfers and start immediately if list was empty
+        if (this->transfers.push(guard, buffer))
+            buffer.start();
+    });
+}
+
+void SpiMaster_SPIM3::addPoll(SpiPollBase &poll, BufferBase &buffer) {
+    assert(poll.getCommandSize() + poll.getSize() <= buffer.p.capacity);
+    buffer.poll = &poll;
+    buffer.nextPoll = this->polls;
+    this->polls = &buffer;
+}
+
+void SpiMaster_SPIM3::tick(uint32_t now) {
+    this->pollTime = now;
+    for (auto buffer = this->polls; buffer != nullptr; buffer = buffer->nextPoll) {
+        if (buffer->poll->due(now, buffer->st.state != BufferBase::State::READY)) {
+            preparePoll(*buffer);
+            buffer->start(BufferBase::Op::READ);
+        }
+    }
+
+    // continue delayed scripts and status polls in the interrupt handler of the master
+    if (this->delayed != nullptr)
+        NVIC_SetPendingIRQ(SPIM3_IRQn);
+}
+
+void SpiMaster_SPIM3::preparePoll(BufferBase &buffer) {
+    auto &poll = *buffer.poll;
+    auto command = poll.getCommand();
+    int commandSize = poll.getCommandSize();
+    std::copy(command, command + commandSize, buffer.p.data);
+    buffer.p.headerSize = commandSize;
+    buffer.p.size = commandSize + poll.getSize();
+}
+
+void SpiMaster_SPIM3::continueScript(BufferBase &buffer) {
+    SpiScriptStep step;
+    buffer.script = SpiScriptStep::decode(buffer.script, step);
+    switch (step.type) {
+    case SpiScriptStep::Type::WRITE:
+        {
+            // copy the write into the buffer as EasyDMA can not read from flash, all bytes are commands if there is
+            // no data
+            int size = step.commandSize + step.dataSize;
+            assert(size <= buffer.p.capacity);
+            std::copy(step.data, step.data + size, buffer.p.data);
+            buffer.p.headerSize = step.commandSize;
+            buffer.p.size = size;
+            auto op = BufferBase::Op::WRITE;
+            if (step.dataSize == 0)
+                op = op | BufferBase::Op::COMMAND;
+            if (step.keepCs)
+                op = op | BufferBase::Op::PARTIAL;
+            buffer.op = op;
+
+            // buffer stays busy and gets taken from the submitted transfers at the end of the interrupt handler
+            this->submitted.push(buffer);
+        }
+        break;
+    case SpiScriptStep::Type::DELAY:
+        delay(buffer, step.delay);
+        break;
+    default:
+        // end of script: notify app
+        buffer.script = nullptr;
+        complete(buffer);
+        flushCompleted();
+    }
+}
+
+void SpiMaster_SPIM3::continueDelayed() {
+    uint32_t now = this->pollTime;
+    auto p = &this->delayed;
+    while (*p != nullptr) {
+        auto buffer = *p;
+        if (int32_t(now - buffer->delayTime) >= 0) {
+            *p = buffer->nextDelayed;
+            if (buffer->script == nullptr)
+                this->submitted.push(*buffer); // next read of status poll
+            else
+                continueScript(*buffer);
+        } else {
+            p = &buffer->nextDelayed;
+        }
+    }
+}
+
+bool SpiMaster_SPIM3::repeatStatus(BufferBase &buffer) {
+    ++buffer.statusCount;
+    uint8_t status = buffer.p.data[buffer.p.headerSize];
+    if ((status & buffer.statusMask) == buffer.statusValue || buffer.statusCount == buffer.statusMaxCount) {
+        buffer.statusPoll = false;
+        return false;
+    }
+
+    // set header again as reading overwrites it
+    std::copy(buffer.statusHeader, buffer.statusHeader + buffer.p.headerSize, buffer.p.data);
+
+    // buffer stays busy and gets taken from the submitted transfers at the end of the interrupt handler, behind the
+    // pending transfers of other channels
+    if (buffer.statusInterval > 0)
+        delay(buffer, buffer.statusInterval);
+    else
+        this->submitted.push(buffer);
+    return true;
+}
+
+void SpiMaster_SPIM3::delay(BufferBase &buffer, uint32_t ticks) {
+    // wait until tick() reaches the end of the delay, one tick more because the current time is up to one tick later
+    // than the time of the last tick
+    buffer.delayTime = this->pollTime + ticks + 1;
+    buffer.nextDelayed = this->delayed;
+    this->delayed = &buffer;
+}
+
+void SpiMaster_SPIM3::deselect(Channel &channel) {
+    if (this->selected == &channel) {
+        gpio::setOutput(channel.csPin, false);
+        this->selected = nullptr;
+    }
+}
+
+void SpiMaster_SPIM3::complete(BufferBase &buffer) {
+    // repeat a status read until the condition holds, the app gets notified once
+    if (buffer.statusPoll && repeatStatus(buffer))
+        return;
+
+    // continue a script, the app gets notified at the end of the script
+    if (buffer.script != nullptr) {
+        continueScript(buffer);
+        return;
+    }
+
+    auto poll = buffer.poll;
+    if (poll != nullptr) {
+        // store sample of a periodic read without notifying the app
+        poll->store(buffer.p.data + buffer.p.headerSize, poll->startTime);
+        if (poll->getPeriod() == 0 && poll->isEnabled()) {
+            // chained read starts again, stays busy and gets taken from the submitted transfers at the end of the
+            // interrupt handler
+            preparePoll(buffer);
+            this->submitted.push(buffer);
+        } else {
+            // nobody waits for the buffer of a periodic read, therefore it can be set ready in the interrupt handler
+            buffer.setReady();
+        }
+        return;
+    }
+
+    if (this->coalesceCount <= 1) {
+        // notify app for each buffer
+        this->loop.push(buffer);
+        return;
+    }
+
+    // append to list of completed buffers
+    buffer.nextCompleted = nullptr;
+    if (this->completedFirst == nullptr)
+        this->completedFirst = &buffer;
+    else
+        this->completedLast->nextCompleted = &buffer;
+    this->completedLast = &buffer;
+    ++this->completedCount;
+}
+
+void SpiMaster_SPIM3::flushCompleted() {
+    // push completion handler to the event loop unless it is already pending, then it takes the new buffers too
+    if (this->completedFirst != nullptr && !this->completionPending) {
+        this->completionPending = true;
+        ++this->batchCount;
+        this->loop.push(this->completion);
+    }
+}
+
+void SpiMaster_SPIM3::Completion::handle() {
+    auto &device = this->device;
+
+    // take list of completed buffers
+    BufferBase *buffer;
+    {
+        nvic::Guard guard(SPIM3_IRQn);
+        buffer = device.completedFirst;
+        device.completedFirst = nullptr;
+        device.completedCount = 0;
+        device.completionPending = false;
+    }
+
+    // notify app for each buffer (may start the buffer again)
+    while (buffer != nullptr) {
+        auto next = buffer->nextCompleted;
+        buffer->handle();
+        buffer = next;
+    }
+}
+
+SpiMaster_SPIM3::BufferBase *SpiMaster_SPIM3::borrow(Channel &channel, int capacity, bool autoRelease) {
+    nvic::Guard guard(SPIM3_IRQn);
+
+    // find smallest size class with sufficient capacity that has a free buffer
+    for (auto pool = this->pools; pool != nullptr; pool = pool->next) {
+        if (pool->capacity() >= capacity) {
+            auto buffer = pool->allocate();
+            if (buffer != nullptr) {
+                buffer->channel = &channel;
+                buffer->autoRelease = autoRelease;
+                buffer->p.headerSize = 0;
+                buffer->p.size = 0;
+                return buffer;
+            }
+        }
     }
+    return nullptr;
+}
+
+void SpiMaster_SPIM3::addPool(BufferPool<BufferBase> &pool) {
+    // insert into list of size classes, sorted by capacity
+    auto p = &this->pools;
+    while (*p != nullptr && (*p)->capacity() < pool.capacity())
+        p = &(*p)->next;
+    pool.next = *p;
+    *p = &pool;
 }
 
 
 // BufferBase
 
 SpiMaster_SPIM3::BufferBase::BufferBase(uint8_t *data, int capacity, Channel &channel)
-    : coco::Buffer(data, capacity, BufferBase::State::READY), channel(channel)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), channel(&channel)
 {
     channel.buffers.add(*this);
 }
 
+SpiMaster_SPIM3::BufferBase::BufferBase(uint8_t *data, int capacity, BufferPool<BufferBase> &pool)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), channel(nullptr), pool(&pool)
+{
+}
+
 SpiMaster_SPIM3::BufferBase::~BufferBase() {
 }
 
@@ -91,41 +370,151 @@ bool SpiMaster_SPIM3::BufferBase::start(Op op) {
     assert((op & Op::READ_WRITE) != 0);
 
     this->op = op;
-    auto &device = this->channel.device;
+    auto &device = this->channel->device;
+
+    // set state first as the transfer may complete at any time after submitting it
+    setBusy();
+
+    // submit lock-free, the interrupt handler adds the transfer to the list of pending transfers
+    device.submitted.push(*this);
+    NVIC_SetPendingIRQ(SPIM3_IRQn); // -> SPIM3_IRQHandler()
+
+    return true;
+}
 
-    // add to list of pending transfers and start immediately if list was empty
-    if (device.transfers.push(nvic::Guard(SPIM3_IRQn), *this))
-        start();
+bool SpiMaster_SPIM3::BufferBase::startScript(const uint8_t *script) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+    auto &device = this->channel->device;
 
-    // set state
+    // set state first as the script may complete at any time after the first step
     setBusy();
+    this->script = script;
+
+    // execute first step with interrupt disabled, the interrupt handler takes it from there
+    {
+        nvic::Guard guard(SPIM3_IRQn);
+        device.continueScript(*this);
+    }
+    NVIC_SetPendingIRQ(SPIM3_IRQn);
 
     return true;
 }
 
+bool SpiMaster_SPIM3::BufferBase::startStatusPoll(uint8_t mask, uint8_t value, int maxCount, uint32_t interval) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+
+    // save header as reading overwrites it
+    int headerSize = this->p.headerSize;
+    assert(headerSize <= int(sizeof(this->statusHeader)));
+    std::copy(this->p.data, this->p.data + headerSize, this->statusHeader);
+    this->statusMask = mask;
+    this->statusValue = value;
+    this->statusMaxCount = maxCount;
+    this->statusInterval = interval;
+    this->statusCount = 0;
+    this->statusPoll = true;
+
+    // read one status byte, the interrupt handler repeats the read
+    this->p.size = headerSize + 1;
+    return start(Op::READ);
+}
+
 bool SpiMaster_SPIM3::BufferBase::cancel() {
     if (this->st.state != State::BUSY)
         return false;
-    auto &device = this->channel.device;
+    auto &device = this->channel->device;
+
+    bool canceled = false;
+    {
+        nvic::Guard guard(SPIM3_IRQn);
+
+        // end a status poll after the current read and a script after the current step
+        this->statusPoll = false;
+        bool script = this->script != nullptr;
+        this->script = nullptr;
+
+        // remove from delayed buffers if waiting for the next step of a script or the next read of a status poll
+        for (auto p = &device.delayed; *p != nullptr; p = &(*p)->nextDelayed) {
+            if (*p == this) {
+                *p = this->nextDelayed;
+                canceled = true;
+                break;
+            }
+        }
 
-    // remove from pending transfers if not yet started, otherwise complete normally
-    if (device.transfers.remove(nvic::Guard(SPIM3_IRQn), *this, false)) {
-        // cancel succeeded: set buffer ready again
-        // resume application code, therefore interrupt should be enabled at this point
-        setReady(0);
+        // move submitted transfers to the list of pending transfers, then remove from pending transfers if not yet
+        // started, otherwise complete normally
+        if (!canceled) {
+            device.drain(guard);
+            canceled = device.transfers.remove(guard, *this, false);
+        }
+
+        if (canceled) {
+            // release CS that the previous step of the script has kept active
+            if (script)
+                device.deselect(*this->channel);
+        } else if (script) {
+            // the current step of the script completes normally and releases CS at its end
+            this->op = this->op & ~Op::PARTIAL;
+        }
     }
+
+    // cancel succeeded: set buffer ready again
+    // resume application code after the guard, therefore interrupt is enabled at this point
+    if (canceled)
+        setReady(0);
+
     return true;
 }
 
-void SpiMaster_SPIM3::BufferBase::start() {
-    auto &device = this->channel.device;
+void SpiMaster_SPIM3::BufferBase::release() {
+    assert(this->pool != nullptr && this->st.state == State::READY);
+    nvic::Guard guard(SPIM3_IRQn);
 
-    // activate CS pin
-    gpio::setOutput(this->channel.csPin, true);
+    // return to size class of shared pool
+    this->pool->release(*this);
+}
+
+void SpiMaster_SPIM3::BufferBase::start() {
+    auto &device = this->channel->device;
+
+    // timestamp of a periodic read is the start of the transfer if a clock is set, otherwise the time of the last tick
+    if (this->poll != nullptr)
+        this->poll->startTime = device.clock != nullptr ? device.clock() : device.pollTime;
+
+    // set clock frequency of the channel
+    NRF_SPIM3->FREQUENCY = this->channel->frequency;
+
+    // deactivate CS pin of a different channel that was kept active by a partial transfer
+    auto selected = device.selected;
+    if (selected != nullptr && selected != this->channel)
+        gpio::setOutput(selected->csPin, false);
+    device.selected = nullptr;
+
+    uint32_t csn = gpio::DISCONNECTED;
+    if (this->channel->hardwareCs) {
+        // the SPIM drives CSN including setup and hold time, released after END
+        assert((this->op & Op::PARTIAL) == 0);
+        csn = gpio::getPinIndex(this->channel->csPin);
+        NRF_SPIM3->IFTIMING.CSNDUR = this->channel->csDuration;
+    } else {
+        // activate CS pin (may already be active after a partial transfer on the same channel)
+        gpio::setOutput(this->channel->csPin, true);
+    }
+    if (csn != device.csn) {
+        device.csn = csn;
+        NRF_SPIM3->PSEL.CSN = csn;
+    }
 
     // check if MISO and DC (data/command) are on the same pin
     if (device.sharedPin) {
-        if (this->channel.dcUsed) {
+        if (this->channel->dcUsed) {
             // DC (data/command signal) overrides MISO, i.e. write-only mode
             NRF_SPIM3->PSEL.MISO = gpio::DISCONNECTED;
             NRF_SPIM3->PSELDCX = gpio::getPinIndex(device.dcPin);
@@ -140,6 +529,22 @@ void SpiMaster_SPIM3::BufferBase::start() {
     int headerSize = this->p.headerSize;
     int size = this->p.size;
 
+    // software CRC: append to data on write, receive after data on read (see SPIM3_IRQHandler())
+    this->crcResult = SpiCrc::Result::NONE;
+    int crcCount = this->crc.byteCount();
+    if (crcCount > 0) {
+        assert(size + crcCount <= this->p.capacity);
+        if ((this->op & Op::WRITE) != 0) {
+            auto d = this->p.data;
+            uint16_t crc = this->crc.compute(d + headerSize, size - headerSize);
+            if (crcCount == 2)
+                d[size++] = crc >> 8;
+            d[size++] = crc;
+        } else {
+            size += crcCount;
+        }
+    }
+
     int commandCount = (this->op & Op::COMMAND) != 0 ? 15 : headerSize;
     int writeCount = (this->op & Op::WRITE) != 0 ? size : headerSize;
     int readCount = (this->op & Op::READ) != 0 ? size : 0;
@@ -162,6 +567,11 @@ void SpiMaster_SPIM3::BufferBase::start() {
 
 void SpiMaster_SPIM3::BufferBase::handle() {
     setReady();
+
+    // return borrowed buffer to the shared pool unless a waiter has started it again, then it gets returned when that
+    // transfer has completed
+    if (this->autoRelease && this->st.state == State::READY)
+        release();
 }
 
 
@@ -170,6 +580,7 @@ void SpiMaster_SPIM3::BufferBase::handle() {
 SpiMaster_SPIM3::Channel::Channel(SpiMaster_SPIM3 &device, gpio::Config csPin, bool dcUsed)
     : BufferDevice(State::READY)
     , device(device), csPin(csPin), dcUsed(dcUsed)
+    , frequency(frequencies[device.baseFrequencyIndex])
 {
     // configure CS pin
     gpio::configureOutput(csPin, false);
@@ -178,6 +589,22 @@ SpiMaster_SPIM3::Channel::Channel(SpiMaster_SPIM3 &device, gpio::Config csPin, b
 SpiMaster_SPIM3::Channel::~Channel() {
 }
 
+void SpiMaster_SPIM3::Channel::setSpeed(int level) {
+    this->speed = std::clamp(level, 0, getMaxSpeed());
+    this->frequency = frequencies[this->device.baseFrequencyIndex + this->speed];
+}
+
+int SpiMaster_SPIM3::Channel::getMaxSpeed() {
+    return FREQUENCY_COUNT - 1 - this->device.baseFrequencyIndex;
+}
+
+void SpiMaster_SPIM3::Channel::setHardwareCs(bool enable, int delay) {
+    this->hardwareCs = enable;
+
+    // CSNDUR counts cycles of the 64MHz clock
+    this->csDuration = std::min((delay * 64 + 999) / 1000, 255);
+}
+
 int SpiMaster_SPIM3::Channel::getBufferCount() {
     return this->buffers.count();
 }
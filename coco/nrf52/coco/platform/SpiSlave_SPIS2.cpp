@@ -0,0 +1,180 @@
+#include "SpiSlave_SPIS2.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+SpiSlave_SPIS2::SpiSlave_SPIS2(Loop_Queue &loop,
+    gpio::Config sckPin, gpio::Config misoPin, gpio::Config mosiPin, gpio::Config csPin,
+    spi::Config config)
+    : BufferDevice(State::READY)
+    , loop(loop)
+{
+    // configure pins
+    gpio::configureAlternate(sckPin);
+    NRF_SPIS2->PSEL.SCK = gpio::getPinIndex(sckPin);
+    if (misoPin != gpio::Config::NONE) {
+        gpio::configureAlternate(misoPin);
+        NRF_SPIS2->PSEL.MISO = gpio::getPinIndex(misoPin);
+    }
+    if (mosiPin != gpio::Config::NONE) {
+        gpio::configureAlternate(mosiPin);
+        NRF_SPIS2->PSEL.MOSI = gpio::getPinIndex(mosiPin);
+    }
+    gpio::configureAlternate(csPin);
+    NRF_SPIS2->PSEL.CSN = gpio::getPinIndex(csPin);
+
+    // configure SPI, send 0xff when no buffer is armed (DEF) and after the end of the data (ORC)
+    NRF_SPIS2->CONFIG = int(config & spi::Config::CONFIG_MASK);
+    NRF_SPIS2->DEF = 0xff;
+    NRF_SPIS2->ORC = 0xff;
+
+    // hand the semaphore back to the CPU at the end of each transaction
+    NRF_SPIS2->SHORTS = N(SPIS_SHORTS_END_ACQUIRE, Enabled);
+    NRF_SPIS2->INTENSET = N(SPIS_INTENSET_END, Set) | N(SPIS_INTENSET_ACQUIRED, Set);
+    nvic::enable(SPIM2_SPIS2_SPI2_IRQn);
+
+    // enable SPI slave and acquire the semaphore to arm the SPIS -> SPIS2_IRQHandler()
+    NRF_SPIS2->ENABLE = N(SPIS_ENABLE_ENABLE, Enabled);
+    NRF_SPIS2->TASKS_ACQUIRE = TRIGGER;
+}
+
+int SpiSlave_SPIS2::getBufferCount() {
+    return this->buffers.count();
+}
+
+SpiSlave_SPIS2::BufferBase &SpiSlave_SPIS2::getBuffer(int index) {
+    return this->buffers.get(index);
+}
+
+void SpiSlave_SPIS2::SPIS2_IRQHandler() {
+    if (NRF_SPIS2->EVENTS_END) {
+        NRF_SPIS2->EVENTS_END = 0;
+
+        // the master sent more bytes than the receive buffer could take
+        uint32_t status = NRF_SPIS2->STATUS;
+        NRF_SPIS2->STATUS = status; // clear
+        bool overflow = (status & SPIS_STATUS_OVERFLOW_Msk) != 0;
+
+        if (!this->armed) {
+            // transaction without buffer (zero length receive)
+            if (overflow)
+                ++this->missedCount;
+        } else {
+            this->armed = false;
+
+            // end of transaction
+            int transferred = std::max(int(NRF_SPIS2->RXD.AMOUNT), int(NRF_SPIS2->TXD.AMOUNT));
+            this->transfers.pop(
+                [this, transferred, overflow](BufferBase &buffer) {
+                    buffer.transferred = transferred;
+                    if ((buffer.op & BufferBase::Op::READ) != 0) {
+                        if (overflow)
+                            ++this->overflowCount;
+                        buffer.p.size = std::max(transferred, buffer.p.headerSize);
+                    }
+
+                    // notify app that buffer has finished
+                    this->loop.push(buffer);
+                    return true;
+                },
+                [](BufferBase &) {
+                    // next buffer gets armed when the semaphore was acquired (END_ACQUIRE shortcut)
+                }
+            );
+        }
+    }
+
+    if (NRF_SPIS2->EVENTS_ACQUIRED) {
+        NRF_SPIS2->EVENTS_ACQUIRED = 0;
+
+        // arm first started buffer, otherwise receive nothing to detect missed transactions
+        if (!this->transfers.empty()) {
+            this->transfers.front().start();
+        } else {
+            NRF_SPIS2->TXD.MAXCNT = 0;
+            NRF_SPIS2->RXD.MAXCNT = 0;
+        }
+
+        // hand the semaphore to the SPIS for the next transaction
+        NRF_SPIS2->TASKS_RELEASE = TRIGGER;
+    }
+}
+
+
+// BufferBase
+
+SpiSlave_SPIS2::BufferBase::BufferBase(uint8_t *data, int capacity, SpiSlave_SPIS2 &device)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), device(device)
+{
+    device.buffers.add(*this);
+}
+
+SpiSlave_SPIS2::BufferBase::~BufferBase() {
+}
+
+bool SpiSlave_SPIS2::BufferBase::start(Op op) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+
+    // check if READ or WRITE flag is set
+    assert((op & Op::READ_WRITE) != 0);
+
+    this->op = op;
+    auto &device = this->device;
+
+    // add to list of started transfers and acquire the semaphore to arm it if list was empty, the semaphore gets
+    // granted after a transaction that is in progress -> SPIS2_IRQHandler()
+    if (device.transfers.push(nvic::Guard(SPIM2_SPIS2_SPI2_IRQn), *this))
+        NRF_SPIS2->TASKS_ACQUIRE = TRIGGER;
+
+    // set state
+    setBusy();
+
+    return true;
+}
+
+bool SpiSlave_SPIS2::BufferBase::cancel() {
+    if (this->st.state != State::BUSY)
+        return false;
+    auto &device = this->device;
+
+    bool canceled;
+    {
+        nvic::Guard guard(SPIM2_SPIS2_SPI2_IRQn);
+
+        // remove from started transfers if not yet armed, otherwise complete normally. The first buffer may be removed
+        // too while it is not armed, then SPIS2_IRQHandler() arms the next buffer when the semaphore that was requested
+        // for the first buffer gets acquired
+        canceled = device.transfers.remove(guard, *this, !device.armed);
+    }
+
+    // cancel succeeded: set buffer ready again
+    // resume application code after the guard, therefore interrupt is enabled at this point
+    if (canceled)
+        setReady(0);
+
+    return true;
+}
+
+void SpiSlave_SPIS2::BufferBase::start() {
+    auto data = uintptr_t(this->p.data);
+
+    // set write data (header and data)
+    NRF_SPIS2->TXD.MAXCNT = (this->op & Op::WRITE) != 0 ? this->p.size : 0;
+    NRF_SPIS2->TXD.PTR = data;
+
+    // set read data, the received bytes replace the sent bytes
+    NRF_SPIS2->RXD.MAXCNT = (this->op & Op::READ) != 0 ? this->p.capacity : 0;
+    NRF_SPIS2->RXD.PTR = data;
+
+    this->device.armed = true;
+}
+
+void SpiSlave_SPIS2::BufferBase::handle() {
+    setReady();
+}
+
+} // namespace coco
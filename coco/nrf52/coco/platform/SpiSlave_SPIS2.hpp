@@ -0,0 +1,122 @@
+#pragma once
+
+#include <coco/BufferDevice.hpp>
+#include <coco/platform/Loop_Queue.hpp>
+#include <coco/platform/gpio.hpp>
+#include <coco/platform/nvic.hpp>
+#include <coco/platform/spi.hpp>
+
+
+namespace coco {
+
+/**
+    Implementation of a SPI slave for nRF52, e.g. for a board that acts as peripheral of a host processor.
+
+    Reference manual:
+        https://infocenter.nordicsemi.com/topic/ps_nrf52840/spis.html
+    Resources:
+        NRF_SPIS2
+
+    Buffers are armed in the order they were started: The EasyDMA pointers of the first buffer are set up while the CPU
+    holds the semaphore of the SPIS, then the semaphore is released so that the SPIS can use the buffer for the next
+    transaction. The buffer completes when CS gets released (END event), then the SPIS hands the semaphore back to the
+    CPU. Start a second buffer to prepare the next response while the first is in use (double buffering).
+*/
+class SpiSlave_SPIS2 : public BufferDevice {
+public:
+    /**
+        Constructor for the SPI slave device
+        @param loop event loop
+        @param sckPin clock pin (SCK)
+        @param misoPin master in slave out pin (MISO)
+        @param mosiPin master out slave in pin (MOSI)
+        @param csPin chip select pin (CSN)
+        @param config configuration such as phase and polarity, the speed is ignored
+    */
+    SpiSlave_SPIS2(Loop_Queue &loop, gpio::Config sckPin, gpio::Config misoPin, gpio::Config mosiPin,
+        gpio::Config csPin, spi::Config config);
+
+    // internal buffer base class, derives from IntrusiveListNode for the list of buffers and Loop_Queue::Handler to be notified from the event loop
+    class BufferBase : public coco::Buffer, public IntrusiveListNode, public Loop_Queue::Handler {
+        friend class SpiSlave_SPIS2;
+    public:
+        /**
+            Constructor
+            @param data data of the buffer
+            @param capacity capacity of the buffer
+            @param device slave device to attach to
+        */
+        BufferBase(uint8_t *data, int capacity, SpiSlave_SPIS2 &device);
+        ~BufferBase() override;
+
+        // Buffer methods
+        bool start(Op op) override;
+        bool cancel() override;
+
+        /**
+            Get number of bytes the master has transferred in the last transaction, limited to the capacity
+        */
+        int getTransferredCount() {return this->transferred;}
+
+    protected:
+        void start();
+        void handle() override;
+
+        SpiSlave_SPIS2 &device;
+
+        Op op;
+        int transferred = 0;
+    };
+
+    /**
+        Buffer for a transaction of the master. On write, the header and data get returned to the master on MISO (0xff
+        after the end), on read, the bytes received on MOSI fill the buffer from the start and size() is the number of
+        bytes received after the header. Both can be combined (Op::READ_WRITE), then the received bytes replace the sent
+        bytes. A transaction can be canceled only until it gets armed
+        @tparam C capacity of buffer
+    */
+    template <int C>
+    class Buffer : public BufferBase {
+    public:
+        Buffer(SpiSlave_SPIS2 &device) : BufferBase(data, C, device) {}
+
+    protected:
+        alignas(4) uint8_t data[C];
+    };
+
+    // BufferDevice methods
+    int getBufferCount();
+    BufferBase &getBuffer(int index);
+
+    /**
+        Get number of transactions of the master while no buffer was armed
+    */
+    int getMissedCount() {return this->missedCount;}
+
+    /**
+        Get number of transactions where the master sent more bytes than a read buffer could take
+    */
+    int getOverflowCount() {return this->overflowCount;}
+
+    /**
+        Call from SPIM2_SPIS2_SPI2_IRQHandler
+    */
+    void SPIS2_IRQHandler();
+
+protected:
+    Loop_Queue &loop;
+
+    // list of buffers
+    IntrusiveList<BufferBase> buffers;
+
+    // list of started transfers, the first is armed
+    InterruptQueue<BufferBase> transfers;
+
+    // set while the first buffer is armed
+    bool armed = false;
+
+    int missedCount = 0;
+    int overflowCount = 0;
+};
+
+} // namespace coco
@@ -1,4 +1,5 @@
 #include "SpiMaster_SPI_DMA.hpp"
+#include <algorithm>
 //#include <coco/debug.hpp>
 
 
@@ -41,7 +42,8 @@ SpiMaster_SPI_DMA::SpiMaster_SPI_DMA(Loop_Queue &loop,
     this->rxChannel = dmaInfo.channel1();
     this->rxChannel.setPeripheralAddress(&spi->DR);
     this->rxDmaIrq = dmaInfo.irq1;
-    nvic::setPriority(this->rxDmaIrq, nvic::Priority::MEDIUM); // interrupt gets enabled in first call to start()
+    nvic::setPriority(this->rxDmaIrq, nvic::Priority::MEDIUM);
+    nvic::enable(this->rxDmaIrq); // also handles submitted transfers (see BufferBase::start())
 
     // configure TX DMA channel
     this->txStatus = dmaInfo.status2();
@@ -56,6 +58,9 @@ SpiMaster_SPI_DMA::SpiMaster_SPI_DMA(Loop_Queue &loop,
     spi->CR1 = spi::CR1(config) // user provided configuration
         | SPI_CR1_MSTR // master mode
         | SPI_CR1_SPE; // enable
+
+    // configured clock prescaler, channels can use a faster clock (see Channel::setSpeed())
+    this->baseDivider = this->divider = (spi->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos;
 }
 
 void SpiMaster_SPI_DMA::DMA_Rx_IRQHandler() {
@@ -79,12 +84,12 @@ void SpiMaster_SPI_DMA::DMA_Rx_IRQHandler() {
             auto &buffer = this->transfers.front();
 
             // set DC pin high to indicate data or keep low when everything is a command
-            if (buffer.channel.dcUsed && (buffer.op & coco::Buffer::Op::COMMAND) == 0)
+            if (buffer.channel->dcUsed && (buffer.op & coco::Buffer::Op::COMMAND) == 0)
                 gpio::setOutput(this->dcPin, true);
 
             int headerSize = buffer.p.headerSize;
             auto data = buffer.p.data + headerSize;
-            int size = buffer.p.size - headerSize;
+            int size = buffer.p.size - headerSize + this->crcCount;
 
             this->rxChannel.setCount(size);
             this->txChannel.setCount(size);
@@ -103,34 +108,343 @@ void SpiMaster_SPI_DMA::DMA_Rx_IRQHandler() {
             // -> DMAx_Rx_IRQHandler()
         } else {
             // end of transfer
+            bool more = false;
             this->transfers.pop(
                 [this](BufferBase &buffer) {
-                    // deactivate CS pin
-                    //if ((buffer.op & BufferBase::Op::PARTIAL) == 0)
-                        gpio::setOutput(buffer.channel.csPin, false);
+                    // receive and check CRC
+                    if (buffer.crc.width != 0)
+                        endCrc(buffer);
+
+                    // deactivate CS pin unless the transfer is partial, then it gets deactivated lazily
+                    if ((buffer.op & BufferBase::Op::PARTIAL) != 0) {
+                        this->selected = buffer.channel;
+                    } else if (buffer.channel->hardwareCs) {
+                        // disable SPI to release NSS when the bus is idle (see reference manual "Procedure for
+                        // disabling the SPI"). The RX DMA has received the last byte, therefore the wait takes only a
+                        // few SPI clocks, bounded so that the interrupt handler can't hang
+#ifdef SPI_SR_FTLVL
+                        constexpr uint32_t busy = SPI_SR_FTLVL | SPI_SR_BSY;
+#else
+                        constexpr uint32_t busy = SPI_SR_BSY;
+#endif
+                        for (int i = 0; i < 1000 && (this->spi->SR & busy) != 0; ++i)
+                            ;
+                        this->spi->CR1 = this->spi->CR1 & ~SPI_CR1_SPE;
+                    } else {
+                        gpio::setOutput(buffer.channel->csPin, false);
+                    }
 
                     // notify app that buffer has finished
-                    this->loop.push(buffer);
+                    complete(buffer);
                     return true;
                 },
-                [](BufferBase &next) {
+                [&more](BufferBase &next) {
                     // start next buffer
+                    more = true;
                     next.start();
                 }
             );
+
+            // notify app about coalesced completions at the end of a burst or when the threshold is reached
+            if (!more || this->completedCount >= this->coalesceCount)
+                flushCompleted();
+        }
+    }
+
+    // continue scripts and status polls whose delay has elapsed, tick() triggers the interrupt
+    if (this->delayed != nullptr)
+        continueDelayed();
+
+    // take transfers that were submitted in the meantime
+    if (!this->submitted.empty())
+        drain(nvic::Guard(this->rxDmaIrq));
+}
+
+void SpiMaster_SPI_DMA::drain(const nvic::Guard &guard) {
+    this->submitted.drain([this, &guard](BufferBase &buffer) {
+        // add to list of pending transfers and start immediately if list was empty
+        if (this->transfers.push(guard, buffer))
+            buffer.start();
+    });
+}
+
+void SpiMaster_SPI_DMA::setCrc(SpiCrc crc) {
+    auto spi = this->spi;
+    this->crcEnabled = crc.width != 0;
+
+    // CRCEN may only be changed while the SPI is disabled, toggling it resets the CRC
+#ifdef SPI_CR1_CRCL
+    uint32_t cr1 = spi->CR1 & ~(SPI_CR1_SPE | SPI_CR1_CRCEN | SPI_CR1_CRCL);
+#else
+    uint32_t cr1 = spi->CR1 & ~(SPI_CR1_SPE | SPI_CR1_CRCEN);
+#endif
+    spi->CR1 = cr1;
+    if (crc.width != 0) {
+        spi->CRCPR = crc.polynomial;
+#ifdef SPI_CR1_CRCL
+        if (crc.width == 16)
+            cr1 |= SPI_CR1_CRCL;
+#else
+        assert(crc.width == 8);
+#endif
+        cr1 |= SPI_CR1_CRCEN;
+        spi->CR1 = cr1;
+    }
+    spi->CR1 = cr1 | SPI_CR1_SPE;
+}
+
+void SpiMaster_SPI_DMA::endCrc(BufferBase &buffer) {
+    auto spi = this->spi;
+    bool read = (buffer.op & BufferBase::Op::READ) != 0;
+    if (this->crcEnabled) {
+        // the RX DMA has received the CRC behind the data, therefore the CRC unit has already checked it. The CRC unit
+        // stays enabled until the next transfer starts
+        if (read)
+            buffer.crcResult = (spi->SR & SPI_SR_CRCERR) == 0 ? SpiCrc::Result::OK : SpiCrc::Result::ERROR;
+        spi->SR = ~SPI_SR_CRCERR;
+    } else if (read) {
+        // compare CRC in software
+        int headerSize = buffer.p.headerSize;
+        int size = buffer.p.size;
+        auto data = buffer.p.data;
+        uint16_t crc = buffer.crc.compute(data + headerSize, size - headerSize);
+        uint16_t received = this->crcCount == 2 ? (data[size] << 8) | data[size + 1] : data[size];
+        buffer.crcResult = crc == received ? SpiCrc::Result::OK : SpiCrc::Result::ERROR;
+    }
+}
+
+void SpiMaster_SPI_DMA::addPoll(SpiPollBase &poll, BufferBase &buffer) {
+    assert(poll.getCommandSize() + poll.getSize() <= buffer.p.capacity);
+    buffer.poll = &poll;
+    buffer.nextPoll = this->polls;
+    this->polls = &buffer;
+}
+
+void SpiMaster_SPI_DMA::tick(uint32_t now) {
+    this->pollTime = now;
+    for (auto buffer = this->polls; buffer != nullptr; buffer = buffer->nextPoll) {
+        if (buffer->poll->due(now, buffer->st.state != BufferBase::State::READY)) {
+            preparePoll(*buffer);
+            buffer->start(BufferBase::Op::READ);
+        }
+    }
+
+    // continue delayed scripts and status polls in the interrupt handler of the master
+    if (this->delayed != nullptr)
+        NVIC_SetPendingIRQ(IRQn_Type(this->rxDmaIrq));
+}
+
+void SpiMaster_SPI_DMA::preparePoll(BufferBase &buffer) {
+    auto &poll = *buffer.poll;
+    auto command = poll.getCommand();
+    int commandSize = poll.getCommandSize();
+    std::copy(command, command + commandSize, buffer.p.data);
+    buffer.p.headerSize = commandSize;
+    buffer.p.size = commandSize + poll.getSize();
+}
+
+void SpiMaster_SPI_DMA::continueScript(BufferBase &buffer) {
+    SpiScriptStep step;
+    buffer.script = SpiScriptStep::decode(buffer.script, step);
+    switch (step.type) {
+    case SpiScriptStep::Type::WRITE:
+        {
+            // copy the write into the buffer where the DMA and the DC handling expect it, all bytes are commands if
+            // there is no data
+            int size = step.commandSize + step.dataSize;
+            assert(size <= buffer.p.capacity);
+            std::copy(step.data, step.data + size, buffer.p.data);
+            buffer.p.headerSize = step.commandSize;
+            buffer.p.size = size;
+            auto op = BufferBase::Op::WRITE;
+            if (step.dataSize == 0)
+                op = op | BufferBase::Op::COMMAND;
+            if (step.keepCs)
+                op = op | BufferBase::Op::PARTIAL;
+            buffer.op = op;
+
+            // buffer stays busy and gets taken from the submitted transfers at the end of the interrupt handler
+            this->submitted.push(buffer);
+        }
+        break;
+    case SpiScriptStep::Type::DELAY:
+        delay(buffer, step.delay);
+        break;
+    default:
+        // end of script: notify app
+        buffer.script = nullptr;
+        complete(buffer);
+        flushCompleted();
+    }
+}
+
+void SpiMaster_SPI_DMA::continueDelayed() {
+    uint32_t now = this->pollTime;
+    auto p = &this->delayed;
+    while (*p != nullptr) {
+        auto buffer = *p;
+        if (int32_t(now - buffer->delayTime) >= 0) {
+            *p = buffer->nextDelayed;
+            if (buffer->script == nullptr)
+                this->submitted.push(*buffer); // next read of status poll
+            else
+                continueScript(*buffer);
+        } else {
+            p = &buffer->nextDelayed;
+        }
+    }
+}
+
+bool SpiMaster_SPI_DMA::repeatStatus(BufferBase &buffer) {
+    ++buffer.statusCount;
+    uint8_t status = buffer.p.data[buffer.p.headerSize];
+    if ((status & buffer.statusMask) == buffer.statusValue || buffer.statusCount == buffer.statusMaxCount) {
+        buffer.statusPoll = false;
+        return false;
+    }
+
+    // set header again as reading overwrites it
+    std::copy(buffer.statusHeader, buffer.statusHeader + buffer.p.headerSize, buffer.p.data);
+
+    // buffer stays busy and gets taken from the submitted transfers at the end of the interrupt handler, behind the
+    // pending transfers of other channels
+    if (buffer.statusInterval > 0)
+        delay(buffer, buffer.statusInterval);
+    else
+        this->submitted.push(buffer);
+    return true;
+}
+
+void SpiMaster_SPI_DMA::delay(BufferBase &buffer, uint32_t ticks) {
+    // wait until tick() reaches the end of the delay, one tick more because the current time is up to one tick later
+    // than the time of the last tick
+    buffer.delayTime = this->pollTime + ticks + 1;
+    buffer.nextDelayed = this->delayed;
+    this->delayed = &buffer;
+}
+
+void SpiMaster_SPI_DMA::deselect(Channel &channel) {
+    if (this->selected == &channel) {
+        gpio::setOutput(channel.csPin, false);
+        this->selected = nullptr;
+    }
+}
+
+void SpiMaster_SPI_DMA::complete(BufferBase &buffer) {
+    // repeat a status read until the condition holds, the app gets notified once
+    if (buffer.statusPoll && repeatStatus(buffer))
+        return;
+
+    // continue a script, the app gets notified at the end of the script
+    if (buffer.script != nullptr) {
+        continueScript(buffer);
+        return;
+    }
+
+    auto poll = buffer.poll;
+    if (poll != nullptr) {
+        // store sample of a periodic read without notifying the app
+        poll->store(buffer.p.data + buffer.p.headerSize, poll->startTime);
+        if (poll->getPeriod() == 0 && poll->isEnabled()) {
+            // chained read starts again, stays busy and gets taken from the submitted transfers at the end of the
+            // interrupt handler
+            preparePoll(buffer);
+            this->submitted.push(buffer);
+        } else {
+            // nobody waits for the buffer of a periodic read, therefore it can be set ready in the interrupt handler
+            buffer.setReady();
+        }
+        return;
+    }
+
+    if (this->coalesceCount <= 1) {
+        // notify app for each buffer
+        this->loop.push(buffer);
+        return;
+    }
+
+    // append to list of completed buffers
+    buffer.nextCompleted = nullptr;
+    if (this->completedFirst == nullptr)
+        this->completedFirst = &buffer;
+    else
+        this->completedLast->nextCompleted = &buffer;
+    this->completedLast = &buffer;
+    ++this->completedCount;
+}
+
+void SpiMaster_SPI_DMA::flushCompleted() {
+    // push completion handler to the event loop unless it is already pending, then it takes the new buffers too
+    if (this->completedFirst != nullptr && !this->completionPending) {
+        this->completionPending = true;
+        ++this->batchCount;
+        this->loop.push(this->completion);
+    }
+}
+
+void SpiMaster_SPI_DMA::Completion::handle() {
+    auto &device = this->device;
+
+    // take list of completed buffers
+    BufferBase *buffer;
+    {
+        nvic::Guard guard(device.rxDmaIrq);
+        buffer = device.completedFirst;
+        device.completedFirst = nullptr;
+        device.completedCount = 0;
+        device.completionPending = false;
+    }
+
+    // notify app for each buffer (may start the buffer again)
+    while (buffer != nullptr) {
+        auto next = buffer->nextCompleted;
+        buffer->handle();
+        buffer = next;
+    }
+}
+
+SpiMaster_SPI_DMA::BufferBase *SpiMaster_SPI_DMA::borrow(Channel &channel, int capacity, bool autoRelease) {
+    nvic::Guard guard(this->rxDmaIrq);
+
+    // find smallest size class with sufficient capacity that has a free buffer
+    for (auto pool = this->pools; pool != nullptr; pool = pool->next) {
+        if (pool->capacity() >= capacity) {
+            auto buffer = pool->allocate();
+            if (buffer != nullptr) {
+                buffer->channel = &channel;
+                buffer->autoRelease = autoRelease;
+                buffer->p.headerSize = 0;
+                buffer->p.size = 0;
+                return buffer;
+            }
         }
     }
+    return nullptr;
+}
+
+void SpiMaster_SPI_DMA::addPool(BufferPool<BufferBase> &pool) {
+    // insert into list of size classes, sorted by capacity
+    auto p = &this->pools;
+    while (*p != nullptr && (*p)->capacity() < pool.capacity())
+        p = &(*p)->next;
+    pool.next = *p;
+    *p = &pool;
 }
 
 
 // BufferBase
 
 SpiMaster_SPI_DMA::BufferBase::BufferBase(uint8_t *data, int capacity, Channel &channel)
-    : coco::Buffer(data, capacity, BufferBase::State::READY), channel(channel)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), channel(&channel)
 {
     channel.buffers.add(*this);
 }
 
+SpiMaster_SPI_DMA::BufferBase::BufferBase(uint8_t *data, int capacity, BufferPool<BufferBase> &pool)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), channel(nullptr), pool(&pool)
+{
+}
+
 SpiMaster_SPI_DMA::BufferBase::~BufferBase() {
 }
 
@@ -144,54 +458,204 @@ bool SpiMaster_SPI_DMA::BufferBase::start(Op op) {
     assert((op & Op::READ_WRITE) != 0);
 
     this->op = op;
-    auto &device = this->channel.device;
+    auto &device = this->channel->device;
+
+    // set state first as the transfer may complete at any time after submitting it
+    setBusy();
+
+    // submit lock-free, the interrupt handler adds the transfer to the list of pending transfers
+    device.submitted.push(*this);
+    NVIC_SetPendingIRQ(IRQn_Type(device.rxDmaIrq)); // -> DMA_Rx_IRQHandler()
+
+    return true;
+}
 
-    // add to list of pending transfers and start immediately if list was empty
-    if (device.transfers.push(nvic::Guard(device.rxDmaIrq), *this))
-        start();
+bool SpiMaster_SPI_DMA::BufferBase::startScript(const uint8_t *script) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+    auto &device = this->channel->device;
 
-    // set state
+    // set state first as the script may complete at any time after the first step
     setBusy();
+    this->script = script;
+
+    // execute first step with interrupt disabled, the interrupt handler takes it from there
+    {
+        nvic::Guard guard(device.rxDmaIrq);
+        device.continueScript(*this);
+    }
+    NVIC_SetPendingIRQ(IRQn_Type(device.rxDmaIrq));
 
     return true;
 }
 
+bool SpiMaster_SPI_DMA::BufferBase::startStatusPoll(uint8_t mask, uint8_t value, int maxCount, uint32_t interval) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+
+    // save header as reading overwrites it
+    int headerSize = this->p.headerSize;
+    assert(headerSize <= int(sizeof(this->statusHeader)));
+    std::copy(this->p.data, this->p.data + headerSize, this->statusHeader);
+    this->statusMask = mask;
+    this->statusValue = value;
+    this->statusMaxCount = maxCount;
+    this->statusInterval = interval;
+    this->statusCount = 0;
+    this->statusPoll = true;
+
+    // read one status byte, the interrupt handler repeats the read
+    this->p.size = headerSize + 1;
+    return start(Op::READ);
+}
+
 bool SpiMaster_SPI_DMA::BufferBase::cancel() {
     if (this->st.state != State::BUSY)
         return false;
-    auto &device = this->channel.device;
+    auto &device = this->channel->device;
+
+    bool canceled = false;
+    {
+        nvic::Guard guard(device.rxDmaIrq);
+
+        // end a status poll after the current read and a script after the current step
+        this->statusPoll = false;
+        bool script = this->script != nullptr;
+        this->script = nullptr;
+
+        // remove from delayed buffers if waiting for the next step of a script or the next read of a status poll
+        for (auto p = &device.delayed; *p != nullptr; p = &(*p)->nextDelayed) {
+            if (*p == this) {
+                *p = this->nextDelayed;
+                canceled = true;
+                break;
+            }
+        }
 
-    // remove from pending transfers if not yet started, otherwise complete normally
-    if (device.transfers.remove(nvic::Guard(device.rxDmaIrq), *this, false)) {
-        // cancel succeeded: set buffer ready again
-        // resume application code, therefore interrupt should be enabled at this point
-        setReady(0);
+        // move submitted transfers to the list of pending transfers, then remove from pending transfers if not yet
+        // started, otherwise complete normally
+        if (!canceled) {
+            device.drain(guard);
+            canceled = device.transfers.remove(guard, *this, false);
+        }
+
+        if (canceled) {
+            // release CS that the previous step of the script has kept active
+            if (script)
+                device.deselect(*this->channel);
+        } else if (script) {
+            // the current step of the script completes normally and releases CS at its end
+            this->op = this->op & ~Op::PARTIAL;
+        }
     }
 
+    // cancel succeeded: set buffer ready again
+    // resume application code after the guard, therefore interrupt is enabled at this point
+    if (canceled)
+        setReady(0);
+
     return true;
 }
 
+void SpiMaster_SPI_DMA::BufferBase::release() {
+    assert(this->pool != nullptr && this->st.state == State::READY);
+    auto &device = this->channel->device;
+    nvic::Guard guard(device.rxDmaIrq);
+
+    // return to size class of shared pool
+    this->pool->release(*this);
+}
+
+void SpiMaster_SPI_DMA::BufferBase::setCrc(SpiCrc crc) {
+    this->crc = crc;
+}
+
 void SpiMaster_SPI_DMA::BufferBase::start() {
-    auto &device = this->channel.device;
+    auto &device = this->channel->device;
+
+    // timestamp of a periodic read is the start of the transfer if a clock is set, otherwise the time of the last tick
+    if (this->poll != nullptr)
+        this->poll->startTime = device.clock != nullptr ? device.clock() : device.pollTime;
 
     int headerSize = this->p.headerSize;
     auto op = this->op & Op::READ_WRITE;
     bool allCommand = (this->op & Op::COMMAND) != 0;
 
+    // CRC of the data phase: The CRC unit can only be reset while the SPI is disabled, therefore it is used when the
+    // whole transfer is data and CS gets activated by this transfer, so that the SPI gets reconfigured before CS is
+    // active. Otherwise the CRC is computed in software as on nRF52
+    this->crcResult = SpiCrc::Result::NONE;
+    int crcCount = this->crc.byteCount();
+    bool crc = crcCount > 0;
+#ifdef SPI_CR1_CRCL
+    bool crcUnit = crc && headerSize == 0 && (this->op & Op::PARTIAL) == 0 && device.selected != this->channel;
+#else
+    // the CRC unit supports 16 bit CRC only with 16 bit data frames
+    bool crcUnit = this->crc.width == 8 && headerSize == 0 && (this->op & Op::PARTIAL) == 0
+        && device.selected != this->channel;
+#endif
+
+    // deactivate CS pin of a different channel that was kept active by a partial transfer first, so that its slave does
+    // not see a change of the clock, of DC or of the pin shared by MISO and DC
+    auto selected = device.selected;
+    if (selected != nullptr && selected != this->channel)
+        gpio::setOutput(selected->csPin, false);
+    device.selected = nullptr;
+
+    // set clock prescaler of the channel (SPI is not busy between transfers)
+    int divider = this->channel->divider;
+    if (divider != device.divider) {
+        device.divider = divider;
+        device.spi->CR1 = (device.spi->CR1 & ~SPI_CR1_BR) | (divider << SPI_CR1_BR_Pos);
+    }
+
     // check if MISO and DC (data/command) share the the same pin
     if (device.sharedPin)
-        gpio::setMode(device.dcPin, this->channel.dcUsed ? gpio::Mode::OUTPUT : gpio::Mode::ALTERNATE);
+        gpio::setMode(device.dcPin, this->channel->dcUsed ? gpio::Mode::OUTPUT : gpio::Mode::ALTERNATE);
 
     // set D/nC pin (low: command, high: data)
-    if (this->channel.dcUsed)
+    if (this->channel->dcUsed)
         gpio::setOutput(device.dcPin, !(headerSize > 0 || allCommand));
 
-    // activate CS pin
-    gpio::setOutput(this->channel.csPin, true);
+    // enable, reset or disable the CRC unit while CS is not active (is never enabled while CS of the channel is still
+    // active after a partial transfer)
+    if (crcUnit || device.crcEnabled)
+        device.setCrc(crcUnit ? this->crc : SPI_CRC_NONE);
+
+    // software CRC: append to data on write, receive after data on read (see endCrc()), the CRC unit appends the CRC
+    // itself but the RX DMA also receives it so that the transfer completes after the CRC
+    device.crcCount = crcCount;
+    if (crc) {
+        assert(this->p.size + crcCount <= this->p.capacity);
+        if (!crcUnit && (this->op & Op::WRITE) != 0) {
+            auto d = this->p.data;
+            int size = this->p.size;
+            uint16_t value = this->crc.compute(d + headerSize, size - headerSize);
+            if (crcCount == 2)
+                d[size++] = value >> 8;
+            d[size] = value;
+        }
+    }
+
+    if (this->channel->hardwareCs) {
+        // enable SPI to assert NSS, optionally pulsed between data frames
+        assert((this->op & Op::PARTIAL) == 0 && !crc);
+#ifdef SPI_CR2_NSSP
+        device.spi->CR2 = (device.spi->CR2 & ~SPI_CR2_NSSP) | (this->channel->csPulse ? SPI_CR2_NSSP : 0);
+#endif
+        device.spi->CR1 = device.spi->CR1 | SPI_CR1_SPE;
+    } else {
+        // activate CS pin (may already be active after a partial transfer on the same channel)
+        gpio::setOutput(this->channel->csPin, true);
+    }
 
     auto data = this->p.data;
     device.txChannel.setMemoryAddress(data);
-    if (headerSize > 0 && !allCommand && this->channel.dcUsed) {
+    if (headerSize > 0 && !allCommand && this->channel->dcUsed) {
         // two transfers for header and data using dc pin
         device.transfer2 = op;
 
@@ -202,9 +666,9 @@ void SpiMaster_SPI_DMA::BufferBase::start() {
         device.rxChannel.enable(dma::Channel::Config::PERIPHERAL_TO_MEMORY | dma::Channel::Config::TRANSFER_COMPLETE_INTERRUPT);
     } else {
         // one transfer
-        int count = this->p.size;
+        int count = this->p.size + crcCount;
         device.rxChannel.setCount(count);
-        device.txChannel.setCount(count);
+        device.txChannel.setCount(crcUnit ? this->p.size : count);
         if (op == Op::WRITE) {
             // start DMA for write only
             device.rxChannel.setMemoryAddress(&device.dummy); // read into dummy
@@ -220,6 +684,11 @@ void SpiMaster_SPI_DMA::BufferBase::start() {
 
 void SpiMaster_SPI_DMA::BufferBase::handle() {
     setReady();
+
+    // return borrowed buffer to the shared pool unless a waiter has started it again, then it gets returned when that
+    // transfer has completed
+    if (this->autoRelease && this->st.state == State::READY)
+        release();
 }
 
 
@@ -227,13 +696,41 @@ void SpiMaster_SPI_DMA::BufferBase::handle() {
 
 SpiMaster_SPI_DMA::Channel::Channel(SpiMaster_SPI_DMA &device, gpio::Config csPin, bool dcUsed)
     : BufferDevice(State::READY)
-    , device(device), csPin(csPin), dcUsed(dcUsed)
+    , device(device), csPin(csPin), dcUsed(dcUsed), divider(device.baseDivider)
 {
     // configure CS pin
     gpio::configureOutput(csPin, false);
+
+    // the NSS output of a channel with hardware CS would also select its slave during transfers of this channel
+    assert(!device.hardwareCs);
+    ++device.channelCount;
 }
 
 SpiMaster_SPI_DMA::Channel::~Channel() {
+    --this->device.channelCount;
+}
+
+void SpiMaster_SPI_DMA::Channel::setSpeed(int level) {
+    // each speed level halves the prescaler, the fastest clock is fPCLK/2 (BR = 0)
+    this->divider = this->device.baseDivider - std::clamp(level, 0, this->device.baseDivider);
+}
+
+void SpiMaster_SPI_DMA::Channel::setHardwareCs(bool enable, bool pulse) {
+    auto spi = this->device.spi;
+    this->hardwareCs = enable;
+    this->csPulse = pulse;
+
+    // NSS is active whenever the SPI is enabled, therefore hardware CS works only for the single channel of a master
+    assert(!enable || this->device.channelCount == 1);
+    this->device.hardwareCs = enable;
+    if (enable) {
+        // NSS is active while SPI is enabled, therefore enable SPI only during transfers
+        spi->CR1 = spi->CR1 & ~SPI_CR1_SPE;
+        gpio::configureAlternate(this->csPin);
+    } else {
+        gpio::configureOutput(this->csPin, false);
+        spi->CR1 = spi->CR1 | SPI_CR1_SPE;
+    }
 }
 
 int SpiMaster_SPI_DMA::Channel::getBufferCount() {
@@ -2,11 +2,18 @@
 
 #include <coco/align.hpp>
 #include <coco/BufferDevice.hpp>
+#include <coco/BufferPool.hpp>
+#include <coco/SpiConcepts.hpp>
+#include <coco/SpiCrc.hpp>
+#include <coco/SpiPoll.hpp>
+#include <coco/SpiScript.hpp>
+#include <coco/SubmitQueue.hpp>
 #include <coco/platform/Loop_Queue.hpp>
 #include <coco/platform/dma.hpp>
 #include <coco/platform/gpio.hpp>
 #include <coco/platform/spi.hpp>
 #include <coco/platform/nvic.hpp>
+#include <utility>
 
 
 namespace coco {
@@ -87,6 +94,7 @@ public:
     // internal buffer base class, derives from IntrusiveListNode for the list of buffers and Loop_Queue::Handler to be notified from the event loop
     class BufferBase : public coco::Buffer, public IntrusiveListNode, public Loop_Queue::Handler {
         friend class SpiMaster_SPI_DMA;
+        friend class Channel;
     public:
         /**
          * Constructor
@@ -95,17 +103,122 @@ public:
          * @param channel channel to attach to
          */
         BufferBase(uint8_t *data, int capacity, Channel &channel);
+
+        /**
+         * Constructor for buffers of the shared pool (see Pool)
+         * @param data data of the buffer
+         * @param capacity capacity of the buffer
+         * @param pool size class of the pool the buffer belongs to
+         */
+        BufferBase(uint8_t *data, int capacity, BufferPool<BufferBase> &pool);
         ~BufferBase() override;
 
-        // Buffer methods
-        bool start(Op op) override;
-        bool cancel() override;
+        // Buffer methods, final so that calls on the concrete type need no vtable (see SpiConcepts.hpp). Only start()
+        // (and startStatusPoll()) submits lock-free and may be called from any interrupt priority. cancel() and
+        // startScript() disable the interrupt of the master, therefore call them only from the application or from
+        // interrupt handlers whose priority is not higher than the one of the master
+        bool start(Op op) final;
+        bool cancel() final;
+
+        /**
+         * Return a buffer that was borrowed using Channel::borrow() to the shared pool of the master.
+         * Must not be called while the buffer is busy, ISR-safe
+         */
+        void release();
+
+        /**
+         * Enable CRC for the data phase of the transfers of this buffer (bytes after the header). On write the CRC
+         * gets appended to the data, on read the CRC that follows the data gets received and checked. The CRC unit of
+         * the SPI peripheral computes the CRC while the DMA transfers the data if the transfer has no header and is
+         * not partial, as the CRC unit gets reset while the SPI is disabled before CS is activated. 16 bit CRC in the
+         * CRC unit needs a peripheral with CRCL bit (e.g. STM32F0, F3, G4). Otherwise the CRC gets computed in
+         * software. The CRC bytes are transferred from/to the buffer behind the data, therefore the capacity has to be
+         * sufficient
+         * @param crc CRC configuration, SPI_CRC_NONE to disable
+         */
+        void setCrc(SpiCrc crc);
+
+        /**
+         * Get result of the CRC check of the last read transfer
+         */
+        SpiCrc::Result getCrcResult() {return this->crcResult;}
+
+        /**
+         * Start a script of writes and delays (see SpiScript) that the master runs from its interrupt handler without
+         * notifying the app for each step, the buffer gets ready at the end of the script. Each write gets copied into the
+         * buffer, therefore its capacity must hold the largest write of the script. Delays need the timer that calls tick()
+         * @param script table of the script
+         * @return true if the script was started
+         */
+        bool startScript(const uint8_t *script);
+
+        /**
+         * Run a script of writes and delays
+         * @param script script
+         * @return awaitable that completes at the end of the script
+         */
+        template <int N>
+        [[nodiscard]] auto runScript(const SpiScript<N> &script) {
+            startScript(script.data());
+            return untilReadyOrDisabled();
+        }
+
+        /**
+         * Start reading a status byte repeatedly until a condition holds (see Channel::pollStatus()). The header of the
+         * buffer is the command that reads the status
+         * @param mask mask applied to the status byte
+         * @param value expected value of the masked status byte
+         * @param maxCount maximum number of reads, 0 for no limit
+         * @param interval time between two reads in ticks of the timer that calls tick(), 0 for back to back reads
+         * @return true if the status poll was started
+         */
+        bool startStatusPoll(uint8_t mask, uint8_t value, int maxCount = 0, uint32_t interval = 0);
+
+        /**
+         * Get number of status reads of the last status poll
+         */
+        int getStatusCount() {return this->statusCount;}
 
     protected:
         void start();
-        void handle() override;
+        void handle() final;
 
-        Channel &channel;
+        // channel, can change for buffers of the shared pool
+        Channel *channel;
+
+        // size class of the shared pool if the buffer was borrowed
+        BufferPool<BufferBase> *pool = nullptr;
+        bool autoRelease = false;
+
+        // next buffer in list of coalesced completions
+        BufferBase *nextCompleted;
+
+        // next buffer in queue of submitted transfers
+        BufferBase *nextSubmitted;
+
+        // periodic read that owns the buffer (see addPoll())
+        SpiPollBase *poll = nullptr;
+        BufferBase *nextPoll;
+
+        // next step of a running script
+        const uint8_t *script = nullptr;
+
+        // status poll: saved header, condition, maximum number of reads, interval and number of reads
+        bool statusPoll = false;
+        uint8_t statusHeader[4];
+        uint8_t statusMask;
+        uint8_t statusValue;
+        int statusMaxCount;
+        uint32_t statusInterval;
+        int statusCount = 0;
+
+        // end of the current delay of a script or status poll and next buffer in list of delayed buffers
+        uint32_t delayTime;
+        BufferBase *nextDelayed;
+
+        // CRC configuration and result of last transfer
+        SpiCrc crc;
+        SpiCrc::Result crcResult = SpiCrc::Result::NONE;
 
         Op op;
     };
@@ -126,9 +239,72 @@ public:
         Channel(SpiMaster_SPI_DMA &device, gpio::Config csPin, bool dcUsed = false);
         ~Channel();
 
-        // BufferDevice methods
-        int getBufferCount();
-        BufferBase &getBuffer(int index);
+        // BufferDevice methods, final so that calls on the concrete type need no vtable
+        int getBufferCount() final;
+        BufferBase &getBuffer(int index) final;
+
+        /**
+         * Borrow a buffer from the shared pool of the master in O(1), ISR-safe. The smallest free buffer with sufficient
+         * capacity is returned, its header is cleared
+         * @param capacity minimum capacity of the buffer
+         * @param autoRelease return the buffer to the pool when the transfer has completed, e.g. for fire-and-forget writes
+         * @return buffer or nullptr if no buffer is available
+         */
+        BufferBase *borrow(int capacity, bool autoRelease = false) {return this->device.borrow(*this, capacity, autoRelease);}
+
+        /**
+         * Set speed level of the channel relative to the clock configured for the master, e.g. as result of calibrate()
+         * @param level speed level, 0 is the configured clock and each level doubles the clock (halves the prescaler), gets limited to getMaxSpeed()
+         */
+        void setSpeed(int level);
+
+        /**
+         * Get current speed level of the channel
+         */
+        int getSpeed() {return this->device.baseDivider - this->divider;}
+
+        /**
+         * Get maximum speed level of the channel
+         */
+        int getMaxSpeed() {return this->device.baseDivider;}
+
+        /**
+         * Let the SPI peripheral drive the CS pin (hardware NSS output) instead of software. NSS is active while the SPI
+         * peripheral is enabled, therefore it gets disabled between transfers. Only for the single channel of a master
+         * (fast path) because transfers of other channels would select the slave too. The CS pin must be given with
+         * the alternate function of NSS (see data sheet). Setup and hold time are not configurable on these
+         * peripherals. Hardware CS does not support Op::PARTIAL and CRC
+         * @param enable true to enable hardware CS
+         * @param pulse generate a pulse on NSS between data frames (NSSP, only for clock phase 0), e.g. for DACs
+         */
+        void setHardwareCs(bool enable, bool pulse = false);
+
+
+        /**
+         * Read a status byte repeatedly until a condition holds, e.g. until the write in progress bit of a flash is
+         * cleared or the data ready bit of a sensor is set. The master issues the reads from its interrupt handler without
+         * notifying the app, each read is queued at the tail so that pending transfers of other channels run in between.
+         * The buffer gets ready once when the condition holds or the maximum number of reads is reached, then its data
+         * holds the last status. Canceling ends the status poll after the current read
+         * @param buffer buffer of this channel, the header is the command that reads the status
+         * @param mask mask applied to the status byte
+         * @param value expected value of the masked status byte
+         * @param maxCount maximum number of reads, 0 for no limit
+         * @param interval time between two reads in ticks of the timer that calls tick(), 0 for back to back reads
+         * @return awaitable that completes at the end of the status poll, getStatusCount() is 0 if the status poll
+         * was not started because the buffer was busy with a different transfer or disabled
+         */
+        [[nodiscard]] auto pollStatus(BufferBase &buffer, uint8_t mask, uint8_t value, int maxCount = 0,
+            uint32_t interval = 0)
+        {
+            assert(buffer.channel == this);
+
+            // if the status poll can't be started, the caller waits for the end of the current transfer and sees that
+            // no status was read
+            if (!buffer.startStatusPoll(mask, value, maxCount, interval) && !buffer.statusPoll)
+                buffer.statusCount = 0;
+            return buffer.untilReadyOrDisabled();
+        }
 
     protected:
         // list of buffers
@@ -137,11 +313,22 @@ public:
         SpiMaster_SPI_DMA &device;
         gpio::Config csPin;
         bool dcUsed;
+
+        // clock prescaler (BR bits of CR1)
+        int divider;
+
+        // hardware CS with optional pulse between data frames
+        bool hardwareCs = false;
+        bool csPulse = false;
     };
 
     /**
      * Buffer for transferring data to/from a SPI slave.
      * Note that the header may get overwritten when reading data, therefore always set the header before read() or transfer()
+     * A transfer started with Op::PARTIAL keeps CS active, e.g. for protocols that poll for tokens. CS gets deactivated
+     * after the next transfer of the channel without Op::PARTIAL or before a transfer of a different channel starts,
+     * which ends the sequence for the slave. Therefore a sequence of partial transfers needs the bus exclusively, i.e.
+     * other channels must not start transfers until it is finished (e.g. SdCard)
      * @tparam C capacity of buffer
      */
     template <int C>
@@ -153,12 +340,121 @@ public:
         alignas(4) uint8_t data[C];
     };
 
+    /**
+     * Size class of the shared buffer pool of the master. Instead of provisioning buffers for each channel, channels
+     * borrow buffers on demand using Channel::borrow(), which saves RAM when only few transfers are in flight.
+     * Use BufferPool methods for statistics such as the high-water mark.
+     * @tparam C capacity of buffers
+     * @tparam N number of buffers
+     */
+    template <int C, int N>
+    class Pool : public BufferPool<BufferBase> {
+    public:
+        Pool(SpiMaster_SPI_DMA &device) : Pool(device, std::make_index_sequence<N>()) {}
+
+    protected:
+        template <std::size_t... I>
+        Pool(SpiMaster_SPI_DMA &device, std::index_sequence<I...>)
+            : BufferPool<BufferBase>(C, pointers, N)
+            , pointers{&buffers[I]...}
+            , buffers{BufferBase(data[I], C, *this)...}
+        {
+            device.addPool(*this);
+        }
+
+        BufferBase *pointers[N];
+        BufferBase buffers[N];
+        alignas(4) uint8_t data[N][C];
+    };
+
+    /**
+     * Set interrupt coalescing: Completed buffers are collected in the interrupt handler and handed to the event loop
+     * as one batch when the given number of buffers has completed or when the last queued transfer has completed,
+     * therefore the latency of the last transfer of a burst does not increase
+     * @param count number of buffers to collect, 1 to notify each buffer separately (default)
+     */
+    void setCoalescing(int count) {this->coalesceCount = count;}
+
+    /**
+     * Get number of batches of completed buffers handed to the event loop when coalescing is enabled
+     */
+    int getBatchCount() {return this->batchCount;}
+
+    /**
+     * Add a periodic read that gets started by tick() or, if its period is 0, by the completion of the previous read.
+     * The samples are stored in the ring buffer of the poll in the interrupt handler without notifying the application.
+     * The buffer is dedicated to the poll, its capacity must hold the command and the sample. Add all polls before the
+     * timer that calls tick() gets started
+     * @param poll periodic read
+     * @param buffer buffer of the channel of the slave
+     */
+    void addPoll(SpiPollBase &poll, BufferBase &buffer);
+
+    /**
+     * Start periodic reads that are due and continue scripts whose delay has elapsed, call from the interrupt
+     * handler of a hardware timer (any priority). The samples get the time of the last tick as timestamp unless a clock
+     * is set (see setClock())
+     * @param now current time of the timer in the unit of the periods of the polls
+     */
+    void tick(uint32_t now);
+
+    /**
+     * Set a function that returns the current time of the timer that calls tick(). Then the samples of periodic reads
+     * get the time when their transfer actually starts as timestamp, e.g. behind transfers of other channels
+     * @param clock function that returns the current time in the unit of the periods of the polls
+     */
+    void setClock(uint32_t (*clock)()) {this->clock = clock;}
+
     /**
      * Call from interrupt handler for the RX DMA channel (first channel of dma::DualChannel)
      */
     void DMA_Rx_IRQHandler();
 
 protected:
+    // enable/disable CRC unit which also resets the CRC, disables the SPI for a short time, therefore only call while
+    // no CS is active
+    void setCrc(SpiCrc crc);
+
+    // check the CRC that was received after the data, gets called from interrupt handler
+    void endCrc(BufferBase &buffer);
+
+    // move submitted transfers to the list of pending transfers, gets called from interrupt handler or with the
+    // interrupt disabled by the guard
+    void drain(const nvic::Guard &guard);
+
+    // set command and size of a periodic read, the command has to be set each time as reading overwrites it
+    void preparePoll(BufferBase &buffer);
+
+    // execute the next step of a script, gets called from interrupt handler or with the interrupt disabled
+    void continueScript(BufferBase &buffer);
+
+    // check the status of a status poll and repeat the read, returns false when the status poll has ended
+    bool repeatStatus(BufferBase &buffer);
+
+    // wait until tick() reaches the end of a delay, then continue the script or status poll in continueDelayed()
+    void delay(BufferBase &buffer, uint32_t ticks);
+
+    // deactivate CS pin of a channel if it was kept active by a partial transfer
+    void deselect(Channel &channel);
+    void continueDelayed();
+
+    // notify app about a completed buffer, gets called from interrupt handler
+    void complete(BufferBase &buffer);
+    void flushCompleted();
+
+    // handler for a batch of coalesced completions
+    class Completion : public Loop_Queue::Handler {
+    public:
+        Completion(SpiMaster_SPI_DMA &device) : device(device) {}
+        void handle() override;
+
+        SpiMaster_SPI_DMA &device;
+    };
+
+    // shared buffer pool
+    BufferBase *borrow(Channel &channel, int capacity, bool autoRelease);
+    void addPool(BufferPool<BufferBase> &pool);
+
     Loop_Queue &loop;
 
     // pins
@@ -167,6 +463,8 @@ protected:
 
     // spi
     SPI_TypeDef *spi;
+    int baseDivider; // configured clock prescaler
+    int divider; // current clock prescaler
 
     // dma
     dma::Status rxStatus;
@@ -178,8 +476,47 @@ protected:
 
     BufferBase::Op transfer2;
 
+    // CRC unit enabled and number of CRC bytes transferred behind the data of the current transfer
+    bool crcEnabled = false;
+    int crcCount = 0;
+
+    // size classes of shared buffer pool, sorted by capacity
+    BufferPool<BufferBase> *pools = nullptr;
+
+    // transfers submitted lock-free from any priority, moved to the list of active transfers by the interrupt handler
+    SubmitQueue<BufferBase, &BufferBase::nextSubmitted> submitted;
+
     // list of active transfers
     InterruptQueue<BufferBase> transfers;
+
+    // buffers of periodic reads and time of last tick
+    BufferBase *polls = nullptr;
+    uint32_t pollTime = 0;
+
+    // current time of the timer that calls tick(), optional
+    uint32_t (*clock)() = nullptr;
+
+    // buffers of scripts and status polls that wait for a delay
+    BufferBase *delayed = nullptr;
+
+    // channel whose CS pin is still active after a partial transfer
+    Channel *selected = nullptr;
+
+    // number of channels, set when the single channel uses hardware CS (see Channel::setHardwareCs())
+    int channelCount = 0;
+    bool hardwareCs = false;
+
+    // coalesced completions
+    int coalesceCount = 1;
+    BufferBase *completedFirst = nullptr;
+    BufferBase *completedLast;
+    int completedCount = 0;
+    bool completionPending = false;
+    int batchCount = 0;
+    Completion completion{*this};
 };
 
+// usable by drivers that are templates over the concrete types of the master (see SpiConcepts.hpp)
+static_assert(SpiMasterType<SpiMaster_SPI_DMA>);
+
 } // namespace coco
@@ -0,0 +1,218 @@
+#include "SpiSlave_SPI_DMA.hpp"
+#include <algorithm>
+
+
+namespace coco {
+
+// SpiSlave_SPI_DMA
+
+SpiSlave_SPI_DMA::SpiSlave_SPI_DMA(Loop_Queue &loop,
+    gpio::Config sckPin, gpio::Config misoPin, gpio::Config mosiPin, gpio::Config csPin, int csIrq,
+    const spi::Info &spiInfo, const dma::Info2 &dmaInfo, spi::Config config)
+    : BufferDevice(State::READY)
+    , loop(loop), csPin(csPin), csIrq(csIrq), spiInfo(spiInfo)
+{
+    // enable clocks (note two cycles wait time until peripherals can be accessed, see STM32G4 reference manual section 7.2.17)
+    spiInfo.rcc.enableClock();
+    dmaInfo.rcc.enableClock();
+
+    // configure pins, CS is the hardware NSS input of the SPI peripheral
+    gpio::configureAlternate(sckPin);
+    if (misoPin != gpio::Config::NONE)
+        gpio::configureAlternate(misoPin);
+    if (mosiPin != gpio::Config::NONE)
+        gpio::configureAlternate(mosiPin);
+    gpio::configureAlternate(csPin);
+
+    // configure SPI
+    auto spi = this->spi = spiInfo.spi;
+    this->cr2 = spi::CR2(config) // user provided configuration
+        | SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN; // enable DMA
+    spi->CR2 = this->cr2;
+
+    // configure DMA channels
+    this->rxChannel = dmaInfo.channel1();
+    this->rxChannel.setPeripheralAddress(&spi->DR);
+    this->txChannel = dmaInfo.channel2();
+    this->txChannel.setPeripheralAddress(&spi->DR);
+
+    // map DMA to SPI
+    spiInfo.map(dmaInfo);
+
+    // enable SPI in slave mode with hardware NSS (MSTR and SSM cleared), the prescaler has no effect
+    this->cr1 = (spi::CR1(config) & ~SPI_CR1_BR) // user provided configuration
+        | SPI_CR1_SPE; // enable
+    spi->CR1 = this->cr1;
+
+    // enable interrupt of the EXTI line of the CS pin
+    nvic::setPriority(this->csIrq, nvic::Priority::MEDIUM);
+    nvic::enable(this->csIrq);
+}
+
+int SpiSlave_SPI_DMA::getBufferCount() {
+    return this->buffers.count();
+}
+
+SpiSlave_SPI_DMA::BufferBase &SpiSlave_SPI_DMA::getBuffer(int index) {
+    return this->buffers.get(index);
+}
+
+void SpiSlave_SPI_DMA::CS_IRQHandler() {
+    auto spi = this->spi;
+
+    // number of bytes the DMA has received, a buffer stays armed if the master did not transfer any bytes
+    int transferred = 0;
+    if (this->armed) {
+        transferred = this->count - this->rxChannel.getCount();
+        if (transferred == 0)
+            return;
+
+        // disable DMA
+        this->rxChannel.disable();
+        this->txChannel.disable();
+    }
+
+    // received data that was not taken by the DMA indicates that the master sent more bytes than were armed
+    bool more = (spi->SR & (SPI_SR_RXNE | SPI_SR_OVR)) != 0;
+
+    // reset SPI to flush the FIFOs and clear the overrun flag, then configure again for the next transaction. Disabling
+    // the SPI does not flush the transmit FIFO which still holds the bytes the DMA has written ahead, they would be
+    // sent at the start of the next transaction
+    this->spiInfo.rcc.reset();
+    spi->CR2 = this->cr2;
+    spi->CR1 = this->cr1;
+
+    if (!this->armed) {
+        if (more)
+            ++this->missedCount;
+
+        // arm a buffer that was started during the transaction
+        if (!this->transfers.empty())
+            this->transfers.front().start();
+        return;
+    }
+    this->armed = false;
+
+    // end of transaction
+    this->transfers.pop(
+        [this, transferred, more](BufferBase &buffer) {
+            buffer.transferred = transferred;
+            if ((buffer.op & BufferBase::Op::READ) != 0) {
+                if (more)
+                    ++this->overflowCount;
+                buffer.p.size = std::max(transferred, buffer.p.headerSize);
+            }
+
+            // notify app that buffer has finished
+            this->loop.push(buffer);
+            return true;
+        },
+        [](BufferBase &next) {
+            // arm next buffer for the next transaction
+            next.start();
+        }
+    );
+}
+
+
+// BufferBase
+
+SpiSlave_SPI_DMA::BufferBase::BufferBase(uint8_t *data, int capacity, SpiSlave_SPI_DMA &device)
+    : coco::Buffer(data, capacity, BufferBase::State::READY), device(device)
+{
+    device.buffers.add(*this);
+}
+
+SpiSlave_SPI_DMA::BufferBase::~BufferBase() {
+}
+
+bool SpiSlave_SPI_DMA::BufferBase::start(Op op) {
+    if (this->st.state != State::READY) {
+        assert(this->st.state != State::BUSY);
+        return false;
+    }
+
+    // check if READ or WRITE flag is set
+    assert((op & Op::READ_WRITE) != 0);
+
+    this->op = op;
+    auto &device = this->device;
+
+    // pad with 0xff after the data, the transmit DMA always covers the capacity
+    int size = (op & Op::WRITE) != 0 ? this->p.size : 0;
+    std::fill(this->p.data + size, this->p.data + this->p.capacity, 0xff);
+
+    // add to list of started transfers and arm immediately if list was empty and no transaction is in progress
+    // (CS is active low), otherwise the buffer gets armed in CS_IRQHandler()
+    {
+        nvic::Guard guard(device.csIrq);
+        if (device.transfers.push(guard, *this) && gpio::getInput(device.csPin)) {
+            start();
+
+            // check CS again because the master may have started a transaction while the DMA was being armed. Then
+            // disarm, the transaction counts as missed and the buffer gets armed in CS_IRQHandler() at its end
+            if (!gpio::getInput(device.csPin)) {
+                device.rxChannel.disable();
+                device.txChannel.disable();
+                device.armed = false;
+            }
+        }
+    }
+
+    // set state
+    setBusy();
+
+    return true;
+}
+
+bool SpiSlave_SPI_DMA::BufferBase::cancel() {
+    if (this->st.state != State::BUSY)
+        return false;
+    auto &device = this->device;
+
+    bool canceled;
+    {
+        nvic::Guard guard(device.csIrq);
+
+        // remove from started transfers if not yet armed, otherwise complete normally. The first buffer may be removed
+        // too while it is not armed, then CS_IRQHandler() arms the next buffer at the end of a transaction that started
+        // before the first buffer was armed
+        canceled = device.transfers.remove(guard, *this, !device.armed);
+    }
+
+    // cancel succeeded: set buffer ready again
+    // resume application code after the guard, therefore interrupt is enabled at this point
+    if (canceled)
+        setReady(0);
+
+    return true;
+}
+
+void SpiSlave_SPI_DMA::BufferBase::start() {
+    auto &device = this->device;
+    auto data = this->p.data;
+    int capacity = this->p.capacity;
+
+    // arm DMA for a transaction of up to the capacity of the buffer
+    device.count = capacity;
+    device.rxChannel.setCount(capacity);
+    device.txChannel.setCount(capacity);
+    device.txChannel.setMemoryAddress(data);
+    if ((this->op & Op::READ) != 0) {
+        // receive into the buffer, the DMA reads each byte to send before the received byte overwrites it
+        device.rxChannel.setMemoryAddress(data);
+        device.rxChannel.enable(dma::Channel::Config::RX);
+    } else {
+        // receive into dummy to count the transferred bytes
+        device.rxChannel.setMemoryAddress(&device.dummy);
+        device.rxChannel.enable(dma::Channel::Config::PERIPHERAL_TO_MEMORY);
+    }
+    device.txChannel.enable(dma::Channel::Config::TX);
+    device.armed = true;
+}
+
+void SpiSlave_SPI_DMA::BufferBase::handle() {
+    setReady();
+}
+
+} // namespace coco
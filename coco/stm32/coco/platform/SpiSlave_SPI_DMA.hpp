@@ -0,0 +1,160 @@
+#pragma once
+
+#include <coco/BufferDevice.hpp>
+#include <coco/platform/Loop_Queue.hpp>
+#include <coco/platform/dma.hpp>
+#include <coco/platform/gpio.hpp>
+#include <coco/platform/spi.hpp>
+#include <coco/platform/nvic.hpp>
+
+
+namespace coco {
+
+/**
+ * Implementation of a SPI slave using DMA for stm32, e.g. for a board that acts as peripheral of a host processor.
+ *
+ * Reference manual:
+ *   f0:
+ *     https://www.st.com/resource/en/reference_manual/dm00031936-stm32f0x1stm32f0x2stm32f0x8-advanced-armbased-32bit-mcus-stmicroelectronics.pdf
+ *       SPI: section 28, slave mode: section 28.5.5
+ *       DMA: section 10, table 29
+ *   f3:
+ *     https://www.st.com/resource/en/reference_manual/rm0364-stm32f334xx-advanced-armbased-32bit-mcus-stmicroelectronics.pdf
+ *       SPI: section 29
+ *       DMA: section 11, table 31
+ *   g4:
+ *     https://www.st.com/resource/en/reference_manual/rm0440-stm32g4-series-advanced-armbased-32bit-mcus-stmicroelectronics.pdf
+ *       SPI: section 39
+ *       DMA: section 12
+ *       DMAMUX: section 13
+ *       EXTI: section 15
+ * Resources:
+ *   SPIx: SPI slave with hardware NSS input
+ *   DMAx
+ *     RX channel (read)
+ *     TX channel (write)
+ *   EXTI line of the CS pin (rising edge), configured by the application
+ *
+ * Buffers are armed in the order they were started: The DMA of the first buffer is set up before CS gets asserted
+ * and the buffer completes when CS gets released. Start a second buffer to prepare the next response while the first
+ * is in use (double buffering). The end of a transaction is detected by an interrupt on the rising edge of the CS pin,
+ * therefore configure the EXTI line of the CS pin for the rising edge and call CS_IRQHandler() from its handler.
+ */
+class SpiSlave_SPI_DMA : public BufferDevice {
+public:
+    /**
+     * Constructor for the SPI slave device
+     * @param loop event loop
+     * @param sckPin clock pin, port and alternate function (SCK, see data sheet)
+     * @param misoPin master in / slave out pin and alternate function (MISO, see data sheet), can be NONE
+     * @param mosiPin master out / slave in pin and alternate function (MOSI, see data sheet), can be NONE
+     * @param csPin chip select pin and alternate function (NSS, see data sheet)
+     * @param csIrq interrupt of the EXTI line of the CS pin (e.g. EXTI4_IRQn), see CS_IRQHandler()
+     * @param spiInfo info of SPI instance to use
+     * @param dmaInfo info of DMA channels to use
+     * @param config configuration (clock phase and polarity, prescaler is ignored)
+     */
+    SpiSlave_SPI_DMA(Loop_Queue &loop,
+        gpio::Config sckPin, gpio::Config misoPin, gpio::Config mosiPin, gpio::Config csPin, int csIrq,
+        const spi::Info &spiInfo, const dma::Info2 &dmaInfo, spi::Config config);
+
+    // internal buffer base class, derives from IntrusiveListNode for the list of buffers and Loop_Queue::Handler to be notified from the event loop
+    class BufferBase : public coco::Buffer, public IntrusiveListNode, public Loop_Queue::Handler {
+        friend class SpiSlave_SPI_DMA;
+    public:
+        /**
+         * Constructor
+         * @param data data of the buffer
+         * @param capacity capacity of the buffer
+         * @param device slave device to attach to
+         */
+        BufferBase(uint8_t *data, int capacity, SpiSlave_SPI_DMA &device);
+        ~BufferBase() override;
+
+        // Buffer methods
+        bool start(Op op) override;
+        bool cancel() override;
+
+        /**
+         * Get number of bytes the master has transferred in the last transaction, limited to the capacity
+         */
+        int getTransferredCount() {return this->transferred;}
+
+    protected:
+        void start();
+        void handle() override;
+
+        SpiSlave_SPI_DMA &device;
+
+        Op op;
+        int transferred = 0;
+    };
+
+    /**
+     * Buffer for a transaction of the master. On write, the header and data get returned to the master on MISO (0xff
+     * after the end up to the capacity), on read, the bytes received on MOSI fill the buffer from the start and size()
+     * is the number of bytes received after the header. Both can be combined (Op::READ_WRITE), then the received bytes
+     * replace the sent bytes. A transaction can be canceled only until it gets armed
+     * @tparam C capacity of buffer
+     */
+    template <int C>
+    class Buffer : public BufferBase {
+    public:
+        Buffer(SpiSlave_SPI_DMA &device) : BufferBase(data, C, device) {}
+
+    protected:
+        alignas(4) uint8_t data[C];
+    };
+
+    // BufferDevice methods
+    int getBufferCount();
+    BufferBase &getBuffer(int index);
+
+    /**
+     * Get number of transactions of the master while no buffer was armed
+     */
+    int getMissedCount() {return this->missedCount;}
+
+    /**
+     * Get number of transactions where the master sent more bytes than a read buffer could take
+     */
+    int getOverflowCount() {return this->overflowCount;}
+
+    /**
+     * Call from interrupt handler of the EXTI line of the CS pin (after clearing the pending flag of the line)
+     */
+    void CS_IRQHandler();
+
+protected:
+    Loop_Queue &loop;
+
+    // pins
+    gpio::Config csPin;
+    int csIrq;
+
+    // spi, configuration gets restored after the reset at the end of each transaction
+    const spi::Info &spiInfo;
+    SPI_TypeDef *spi;
+    uint32_t cr1;
+    uint32_t cr2;
+
+    // dma
+    dma::Channel rxChannel;
+    dma::Channel txChannel;
+    uint8_t dummy;
+
+    // list of buffers
+    IntrusiveList<BufferBase> buffers;
+
+    // list of started transfers, the first is armed
+    InterruptQueue<BufferBase> transfers;
+
+    // set while the first buffer is armed, number of bytes the DMA was armed for
+    bool armed = false;
+    int count;
+
+    int missedCount = 0;
+    int overflowCount = 0;
+};
+
+} // namespace coco
@@ -0,0 +1,994 @@
+#include <SpiEmulationTest.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+using namespace coco;
+
+// benchmark of driver level throughput on the emulated bus, all times are simulated bus times, the test fails if a
+// benchmark detects an error
+
+// number of failed checks
+int failureCount = 0;
+
+void check(bool condition, const char *message) {
+	if (!condition) {
+		printf("FAILED: %s\n", message);
+		++failureCount;
+	}
+}
+
+const uint8_t writeEnable[] = {0x06};
+const uint8_t readStatus[] = {0x05};
+
+AwaitableCoroutine benchmarkFlash(Drivers &drivers, int pageCount) {
+	Buffer &command = drivers.flashCommand;
+	Buffer &status = drivers.flashStatus;
+	Buffer &buffer = drivers.flashPage;
+	int64_t start = drivers.spi.getTime();
+	for (int page = 0; page < pageCount; ++page) {
+		// write enable
+		co_await command.writeArray(writeEnable);
+
+		// page program
+		int address = page * 256;
+		uint8_t header[] = {0x02, uint8_t(address >> 16), uint8_t(address >> 8), uint8_t(address)};
+		buffer.setHeader(header);
+		for (int i = 0; i < 256; ++i)
+			buffer.data()[i] = uint8_t(page + i);
+		co_await buffer.write(256);
+
+		// poll status register until write in progress (WIP) is cleared (set header each time as reading overwrites it)
+		do {
+			status.setHeader(readStatus);
+			co_await status.read(1);
+		} while ((status.data()[0] & SpiSlaveModel_Flash::WIP) != 0);
+	}
+	double seconds = double(drivers.spi.getTime() - start) * 1e-9;
+	printf("flash: %d pages, %.1f pages/s, %d busy accesses\n", pageCount, pageCount / seconds,
+		drivers.flash.getBusyAccessCount());
+	check(drivers.flash.getBusyAccessCount() == 0, "flash: no access while busy");
+}
+
+AwaitableCoroutine benchmarkFlashDriver(Drivers &drivers, int size) {
+	auto &flash = drivers.flashDriver;
+	uint8_t data[100];
+
+	// erase
+	for (int address = 0; address < size; address += SpiFlashBase::SECTOR_SIZE)
+		co_await flash.eraseSector(address);
+	co_await flash.flush();
+
+	// sequential write in small pieces that get coalesced into pages
+	int64_t start = drivers.spi.getTime();
+	for (int address = 0; address < size; address += sizeof(data)) {
+		int n = std::min(size - address, int(sizeof(data)));
+		for (int i = 0; i < n; ++i)
+			data[i] = uint8_t((address + i) * 7);
+		co_await flash.write(address, data, n);
+	}
+	co_await flash.flush();
+	double seconds = double(drivers.spi.getTime() - start) * 1e-9;
+	printf("flash driver: write %.1f kB/s, %d page programs\n", size / seconds * 1e-3, flash.getProgramCount());
+	check(flash.getProgramCount() == size / 256, "flash driver: writes coalesced into one program per page");
+
+	// sequential read in small pieces
+	start = drivers.spi.getTime();
+	int errorCount = 0;
+	for (int address = 0; address < size; address += sizeof(data)) {
+		int n = std::min(size - address, int(sizeof(data)));
+		co_await flash.read(address, data, n);
+		for (int i = 0; i < n; ++i) {
+			if (data[i] != uint8_t((address + i) * 7))
+				++errorCount;
+		}
+	}
+	seconds = double(drivers.spi.getTime() - start) * 1e-9;
+	printf("flash driver: read %.1f kB/s, %d hits, %d misses, %d read-ahead hits, %d errors\n", size / seconds * 1e-3,
+		flash.getCacheHitCount(), flash.getCacheMissCount(), flash.getReadAheadHitCount(), errorCount);
+	check(errorCount == 0, "flash driver: read back written data");
+}
+
+AwaitableCoroutine benchmarkSdCard(Drivers &drivers, int blockCount) {
+	auto &sdCard = drivers.sdCardDriver;
+	co_await sdCard.init();
+	if (!sdCard.ready()) {
+		check(false, "sd card: init");
+		co_return;
+	}
+
+	// single-block writes (CMD24), each waits for the card before the next command
+	uint8_t block[512];
+	int64_t start = drivers.spi.getTime();
+	for (int i = 0; i < blockCount; ++i) {
+		for (int j = 0; j < 512; ++j)
+			block[j] = uint8_t(i + j * 3);
+		co_await sdCard.write(i, block, 1);
+	}
+	double seconds = double(drivers.spi.getTime() - start) * 1e-9;
+	printf("sd card: single-block write %.1f kB/s\n", blockCount * 512 / seconds * 1e-3);
+
+	// logging of small records with multi-block streaming (CMD25) and pre-erase hint (ACMD23)
+	uint8_t record[100];
+	int size = blockCount * 512;
+	start = drivers.spi.getTime();
+	co_await sdCard.startStream(blockCount, blockCount);
+	for (int offset = 0; offset < size; offset += sizeof(record)) {
+		int n = std::min(size - offset, int(sizeof(record)));
+		for (int i = 0; i < n; ++i)
+			record[i] = uint8_t((offset + i) * 5);
+		co_await sdCard.append(record, n);
+	}
+	co_await sdCard.stopStream();
+	seconds = double(drivers.spi.getTime() - start) * 1e-9;
+
+	// limit of the card: transfer of token, block and CRC at 8MHz plus program time of a pre-erased block
+	double limit = 512 / (515 * 1e-6 + drivers.sdCard.getTiming().preErasedBlockWrite * 1e-9);
+	printf("sd card: streaming write %.1f kB/s (limit %.1f kB/s), %d busy polls\n", size / seconds * 1e-3,
+		limit * 1e-3, sdCard.getBusyPollCount());
+	check(size / seconds >= limit * 0.9, "sd card: streaming write near the limit of the card");
+
+	// multi-block read (CMD18) and verify
+	uint8_t data[8 * 512];
+	int errorCount = 0;
+	int tokenPollCount = sdCard.getTokenPollCount();
+	start = drivers.spi.getTime();
+	for (int i = 0; i < blockCount * 2; i += 8) {
+		int count = std::min(blockCount * 2 - i, 8);
+		co_await sdCard.read(i, data, count);
+		for (int j = 0; j < count * 512; ++j) {
+			int b = i * 512 + j;
+			uint8_t expected = b < size ? uint8_t((b >> 9) + (b & 511) * 3) : uint8_t((b - size) * 5);
+			if (data[j] != expected)
+				++errorCount;
+		}
+	}
+	seconds = double(drivers.spi.getTime() - start) * 1e-9;
+	tokenPollCount = sdCard.getTokenPollCount() - tokenPollCount;
+	printf("sd card: multi-block read %.1f kB/s, %.1f token polls per block, %d errors, %d driver errors\n",
+		blockCount * 2 * 512 / seconds * 1e-3, double(tokenPollCount) / (blockCount * 2), errorCount,
+		sdCard.getErrorCount());
+	check(errorCount == 0 && sdCard.getErrorCount() == 0, "sd card: read back written blocks");
+
+	// the access time of the card is one byte per microsecond at 8MHz, the token poll reads 8 bytes at a time
+	int accessBytes = int(drivers.sdCard.getTiming().readAccess / 1000);
+	check(tokenPollCount <= blockCount * 2 * (accessBytes / 8 + 2), "sd card: start token polled several bytes at a time");
+}
+
+AwaitableCoroutine benchmarkDisplay(Drivers &drivers, int frameCount) {
+	Buffer &buffer = drivers.displayBuffer;
+	int64_t start = drivers.spi.getTime();
+	for (int frame = 0; frame < frameCount; ++frame) {
+		// set window to full screen
+		const uint8_t caset[] = {0x2a};
+		const uint8_t raset[] = {0x2b};
+		const uint8_t window[] = {0, 0, 0, 239};
+		buffer.setHeader(caset);
+		co_await buffer.writeArray(window);
+		buffer.setHeader(raset);
+		co_await buffer.writeArray(window);
+
+		// write pixels in chunks, first chunk with RAMWR, following chunks with RAMWRC
+		int size = 240 * 240 * 2;
+		bool first = true;
+		while (size > 0) {
+			const uint8_t ramwr[] = {0x2c};
+			const uint8_t ramwrc[] = {0x3c};
+			if (first)
+				buffer.setHeader(ramwr);
+			else
+				buffer.setHeader(ramwrc);
+			int chunkSize = std::min(size, 1022);
+			for (int i = 0; i < chunkSize; ++i)
+				buffer.data()[i] = uint8_t(frame);
+			co_await buffer.write(chunkSize);
+			size -= chunkSize;
+			first = false;
+		}
+	}
+	double seconds = double(drivers.spi.getTime() - start) * 1e-9;
+	printf("display: %d frames, %.1f frames/s, %d violations\n", frameCount, frameCount / seconds,
+		drivers.display.getViolationCount());
+	check(drivers.display.getViolationCount() == 0, "display: no timing violations");
+}
+
+AwaitableCoroutine benchmarkDisplayFlush(Drivers &drivers, int frameCount, int size) {
+	auto &flush = drivers.displayFlush;
+
+	// initial full update
+	flush.invalidate();
+	co_await flush.flush();
+
+	int64_t start = drivers.spi.getTime();
+	for (int frame = 0; frame < frameCount; ++frame) {
+		// draw two small squares that move
+		int x = (frame * 7) % (240 - size);
+		int y = (frame * 3) % (240 - size);
+		for (int j = 0; j < size; ++j) {
+			for (int i = 0; i < size; ++i) {
+				drivers.frameBuffer[x + i + (y + j) * 240] = uint16_t(frame);
+				drivers.frameBuffer[y + i + (x + j) * 240] = uint16_t(frame);
+			}
+		}
+		flush.invalidate(x, y, size, size);
+		flush.invalidate(y, x, size, size);
+		co_await flush.flush();
+	}
+	double seconds = double(drivers.spi.getTime() - start) * 1e-9;
+
+	// compare display memory with frame buffer
+	int errorCount = 0;
+	for (int i = 0; i < 240 * 240; ++i) {
+		if (drivers.display.data()[i] != drivers.frameBuffer[i])
+			++errorCount;
+	}
+	printf("display flush: %dx%d regions, %.1f frames/s, %d rectangles, %lld pixels, %d errors\n", size, size,
+		frameCount / seconds, flush.getRectCount(), (long long)flush.getPixelCount(), errorCount);
+	check(errorCount == 0, "display flush: display memory matches frame buffer");
+}
+
+AwaitableCoroutine benchmarkSensor(Drivers &drivers, int sampleCount) {
+	Buffer &buffer = drivers.sensorBuffer;
+
+	// discard sample that was taken while nobody was reading, then the sensor counts the samples that get missed
+	const uint8_t sample[] = {0x80 | 0x28};
+	buffer.setHeader(sample);
+	co_await buffer.read(6);
+	int missedCount = drivers.sensor.getMissedSampleCount();
+
+	int64_t start = drivers.spi.getTime();
+	int count = 0;
+	while (count < sampleCount) {
+		// read status register
+		const uint8_t readStatus[] = {0x80 | 0x27};
+		buffer.setHeader(readStatus);
+		co_await buffer.read(1);
+		if ((buffer.data()[0] & 0x01) == 0)
+			continue;
+
+		// read sample
+		buffer.setHeader(sample);
+		co_await buffer.read(6);
+		++count;
+	}
+	double seconds = double(drivers.spi.getTime() - start) * 1e-9;
+	missedCount = drivers.sensor.getMissedSampleCount() - missedCount;
+	printf("sensor: %d samples, %.1f samples/s, %d missed\n", sampleCount, sampleCount / seconds, missedCount);
+	check(missedCount == 0, "sensor: no missed samples");
+}
+
+AwaitableCoroutine benchmarkCalibration(Drivers &drivers) {
+	auto &channel = drivers.sensorChannel;
+
+	// read WHO_AM_I register of sensor
+	const uint8_t whoAmI[] = {0x80 | 0x0f};
+	const uint8_t expected[] = {0x33};
+	SpiReadbackCheck readback(drivers.sensorBuffer, whoAmI, expected);
+	int speed;
+	co_await calibrate(channel, readback, speed);
+
+	// verify that the calibrated speed is reliable
+	int errorCount = 0;
+	for (int i = 0; i < 1000; ++i) {
+		bool ok;
+		co_await readback(ok);
+		if (!ok)
+			++errorCount;
+	}
+	printf("calibration: speed level %d of %d, %d errors\n", speed, channel.getMaxSpeed(), errorCount);
+	check(errorCount == 0, "calibration: no errors on calibrated speed");
+
+	// expected level: highest level where the doubled clock of the master (8MHz) does not exceed the maximum
+	// frequency of the sensor, reduced by the default margin of one level as the next level fails
+	int expectedSpeed = 0;
+	while ((8'000'000LL << (expectedSpeed + 1)) <= drivers.sensor.maxFrequency)
+		++expectedSpeed;
+	check(speed == expectedSpeed - 1 && channel.getSpeed() == speed,
+		"calibration: fastest reliable level minus margin");
+
+	// the margin applies also if the maximum level passes, a check that fails on the configured clock is an error
+	auto pass = [](bool &ok) -> AwaitableCoroutine {ok = true; co_return;};
+	auto fail = [](bool &ok) -> AwaitableCoroutine {ok = false; co_return;};
+	int passSpeed;
+	co_await calibrate(channel, pass, passSpeed);
+	int failSpeed;
+	co_await calibrate(channel, fail, failSpeed);
+	check(passSpeed == channel.getMaxSpeed() - 1 && failSpeed == -1 && channel.getSpeed() == 0,
+		"calibration: margin below the maximum level and error on the configured clock");
+	channel.setSpeed(speed);
+
+	// benchmark sensor on calibrated speed, then restore configured speed
+	co_await benchmarkSensor(drivers, 100);
+	channel.setSpeed(0);
+}
+
+// configuration sequence of a sensor as driver code does it, bit fields of control registers get modified one by one
+struct RegisterOp {
+	uint8_t address;
+	uint8_t mask;
+	uint8_t value;
+};
+const RegisterOp sensorConfig[] = {
+	{0x20, 0xf0, 0x50}, // output data rate
+	{0x20, 0x07, 0x07}, // enable axes
+	{0x21, 0x0c, 0x08}, // high-pass filter
+	{0x22, 0x10, 0x10}, // data-ready interrupt
+	{0x23, 0x30, 0x20}, // full scale
+	{0x23, 0x08, 0x08}, // high resolution
+	{0x24, 0x40, 0x40}, // FIFO enable
+	{0x25, 0x02, 0x02}, // interrupt polarity
+	{0x20, 0x07, 0x07}, // enable axes again
+	{0x23, 0x30, 0x20}, // full scale again
+};
+
+AwaitableCoroutine benchmarkRegisterMap(Drivers &drivers) {
+	auto &sensor = drivers.sensor;
+	Buffer &buffer = drivers.sensorBuffer;
+	auto &registers = drivers.sensorRegisters;
+	const uint8_t defaults[] = {0x07, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+	// read-modify-write on the bus for each operation
+	for (int i = 0; i < 6; ++i)
+		sensor.set(0x20 + i, defaults[i]);
+	int64_t start = drivers.spi.getTransferCount();
+	for (auto &op : sensorConfig) {
+		const uint8_t read[] = {uint8_t(0x80 | op.address)};
+		buffer.setHeader(read);
+		co_await buffer.read(1);
+		uint8_t value = (buffer.data()[0] & ~op.mask) | op.value;
+		const uint8_t write[] = {op.address};
+		buffer.setHeader(write);
+		buffer.data()[0] = value;
+		co_await buffer.write(1);
+	}
+	int naiveCount = int(drivers.spi.getTransferCount() - start);
+	uint8_t expected[6];
+	for (int i = 0; i < 6; ++i)
+		expected[i] = sensor.get(0x20 + i);
+
+	// register map: load control registers, modify the shadow copy and write in one burst
+	for (int i = 0; i < 6; ++i)
+		sensor.set(0x20 + i, defaults[i]);
+	start = drivers.spi.getTransferCount();
+	co_await registers.load(0x20, 6);
+	for (auto &op : sensorConfig)
+		co_await registers.modify(op.address, op.mask, op.value);
+	co_await registers.flush();
+	int mapCount = int(drivers.spi.getTransferCount() - start);
+
+	// apply the same configuration again, e.g. after a mode switch
+	start = drivers.spi.getTransferCount();
+	for (auto &op : sensorConfig)
+		co_await registers.modify(op.address, op.mask, op.value);
+	co_await registers.flush();
+	int againCount = int(drivers.spi.getTransferCount() - start);
+
+	int errorCount = 0;
+	for (int i = 0; i < 6; ++i) {
+		if (sensor.get(0x20 + i) != expected[i])
+			++errorCount;
+	}
+	printf("register map: %d operations, %d transfers read-modify-write, %d transfers with shadow copy, %d when applied again, %d errors\n",
+		int(std::size(sensorConfig)), naiveCount, mapCount, againCount, errorCount);
+	check(errorCount == 0, "register map: same configuration as read-modify-write");
+	check(mapCount == 2 && againCount == 0, "register map: one burst read and one burst write, nothing when applied again");
+
+	// window of the registers starting at 0x08, relative address 0x07 is WHO_AM_I (0x0f)
+	constexpr auto WINDOW_LAYOUT = RegisterLayout{.registerCount = 16, .baseAddress = 0x08, .readFlag = 0x80};
+	RegisterMap<WINDOW_LAYOUT> window(drivers.sensorBuffer);
+	uint8_t whoAmI = 0;
+	co_await window.read(0x07, whoAmI);
+	check(whoAmI == 0x33, "register map: relative address in a window with base address");
+}
+
+AwaitableCoroutine benchmarkHardwareCs(Drivers &drivers, int transferCount) {
+	auto &channel = drivers.sensorChannel;
+	Buffer &buffer = drivers.sensorBuffer;
+	const uint8_t whoAmI[] = {0x80 | 0x0f};
+
+	// short register reads with CS toggled in software, then driven by hardware with 50ns setup and hold time
+	double rates[2];
+	for (int hardware = 0; hardware < 2; ++hardware) {
+		channel.setHardwareCs(hardware != 0, 50);
+		int64_t start = drivers.spi.getTime();
+		for (int i = 0; i < transferCount; ++i) {
+			buffer.setHeader(whoAmI);
+			co_await buffer.read(1);
+		}
+		rates[hardware] = transferCount / (double(drivers.spi.getTime() - start) * 1e-9);
+	}
+	channel.setHardwareCs(false);
+	printf("hardware cs: %.0f transfers/s with software CS, %.0f transfers/s with hardware CS\n", rates[0],
+		rates[1]);
+	check(rates[1] > rates[0], "hardware cs: faster than software CS");
+}
+
+AwaitableCoroutine benchmarkBufferPool(Drivers &drivers) {
+	auto &channel = drivers.sensorChannel;
+	auto &smallPool = drivers.smallPool;
+	auto &largePool = drivers.largePool;
+	const uint8_t whoAmI[] = {0x80 | 0x0f};
+
+	// borrow from the smallest size class, then from the next larger one when it is exhausted
+	Drivers::SpiMaster::BufferBase *buffers[3];
+	for (auto &buffer : buffers)
+		buffer = channel.borrow(8);
+	check(buffers[0] != nullptr && buffers[1] != nullptr && buffers[2] != nullptr
+		&& buffers[0]->capacity() == 16 && buffers[1]->capacity() == 16 && buffers[2]->capacity() == 64,
+		"buffer pool: smallest size class with a free buffer");
+	check(channel.borrow(8) == nullptr && channel.borrow(100) == nullptr, "buffer pool: exhausted");
+	check(smallPool.highWaterMark() == 2 && largePool.highWaterMark() == 1 && smallPool.failCount() == 2
+		&& largePool.failCount() == 1, "buffer pool: statistics");
+
+	// transfer on a borrowed buffer, then return all buffers
+	int errorCount = 0;
+	for (auto buffer : buffers) {
+		buffer->setHeader(whoAmI);
+		co_await buffer->read(1);
+		if (buffer->data()[0] != 0x33)
+			++errorCount;
+		buffer->release();
+	}
+	check(errorCount == 0, "buffer pool: transfer on borrowed buffers");
+	check(smallPool.usedCount() == 0 && largePool.usedCount() == 0, "buffer pool: returned");
+
+	// fire-and-forget write that returns its buffer when it has completed, the read on the same channel is queued
+	// behind it
+	auto buffer = channel.borrow(1, true);
+	const uint8_t writeRegister[] = {0x30};
+	buffer->setHeader(writeRegister);
+	buffer->data()[0] = 0x5a;
+	buffer->startWrite(1);
+	Buffer &readBuffer = drivers.sensorBuffer;
+	const uint8_t readRegister[] = {0x80 | 0x30};
+	readBuffer.setHeader(readRegister);
+	co_await readBuffer.read(1);
+	check(readBuffer.data()[0] == 0x5a && smallPool.usedCount() == 0, "buffer pool: auto release after write");
+
+	// auto release gets deferred when a waiter starts the buffer again
+	buffer = channel.borrow(1, true);
+	for (int i = 0; i < 2; ++i) {
+		buffer->setHeader(whoAmI);
+		co_await buffer->read(1);
+	}
+	readBuffer.setHeader(readRegister);
+	co_await readBuffer.read(1);
+	check(smallPool.usedCount() == 0, "buffer pool: auto release after restart");
+
+	printf("buffer pool: high-water mark %d of %d and %d of %d, %d and %d failed allocations, %d errors\n",
+		smallPool.highWaterMark(), smallPool.count(), largePool.highWaterMark(), largePool.count(),
+		smallPool.failCount(), largePool.failCount(), errorCount);
+}
+
+AwaitableCoroutine benchmarkCoalescing(Drivers &drivers) {
+	auto &spi = drivers.spi;
+	Buffer *buffers[] = {&drivers.flashCommand, &drivers.flashStatus, &drivers.flashPage, &drivers.flashPage2,
+		&drivers.sensorBuffer};
+	const int count = std::size(buffers);
+	const uint8_t whoAmI[] = {0x80 | 0x0f};
+
+	// burst of transfers on two channels without coalescing, with a threshold above and below the burst size
+	int batchCounts[3];
+	int errorCount = 0;
+	const int thresholds[] = {1, 8, 2};
+	for (int round = 0; round < 3; ++round) {
+		spi.setCoalescing(thresholds[round]);
+		int batchCount = spi.getBatchCount();
+		for (int i = 0; i < count; ++i) {
+			if (i < count - 1)
+				buffers[i]->setHeader(readStatus);
+			else
+				buffers[i]->setHeader(whoAmI);
+			buffers[i]->startRead(1);
+		}
+		for (auto buffer : buffers)
+			co_await buffer->untilReadyOrDisabled();
+		for (int i = 0; i < count; ++i) {
+			if (buffers[i]->data()[0] != (i < count - 1 ? 0x00 : 0x33))
+				++errorCount;
+		}
+		batchCounts[round] = spi.getBatchCount() - batchCount;
+	}
+
+	// cancel a buffer from the event loop while its coalesced completion is pending, the completion is delivered
+	// normally
+	struct Cancel : public Loop_native::YieldHandler {
+		Buffer &buffer;
+		bool result = false;
+		Cancel(Buffer &buffer) : buffer(buffer) {}
+		void handle() override {this->result = this->buffer.cancel();}
+	};
+	spi.setCoalescing(8);
+	Buffer &status = drivers.flashStatus;
+	Cancel cancel(status);
+	status.setHeader(readStatus);
+	status.startRead(1);
+	drivers.loop.yield(cancel);
+	co_await status.untilReadyOrDisabled();
+	check(cancel.result && status.data()[0] == 0x00, "coalescing: cancel while the completion is pending");
+	spi.setCoalescing(1);
+
+	printf("coalescing: %d completions in %d batches with threshold 8, %d batches with threshold 2, %d errors\n",
+		count, batchCounts[1], batchCounts[2], errorCount);
+	check(errorCount == 0, "coalescing: data of all buffers");
+	check(batchCounts[0] == 0, "coalescing: disabled");
+	check(batchCounts[1] == 1, "coalescing: partial batch at the end of a burst");
+	check(batchCounts[2] > 1 && batchCounts[2] <= (count + 1) / 2, "coalescing: batch when the threshold is reached");
+}
+
+// threads that stand in for interrupts start transfers and cancel them concurrently while the event loop waits, each
+// started transfer must either be canceled or get transferred exactly once when the event loop continues
+AwaitableCoroutine stressThreads(Drivers &drivers, int roundCount) {
+	constexpr int THREAD_COUNT = 4;
+	constexpr int START_COUNT = 1000;
+	using SpiMaster = Drivers::SpiMaster;
+	struct Worker {
+		SpiMaster::Channel channel;
+		SpiMaster::Buffer<16> buffers[4];
+		int startCount = 0;
+		int cancelCount = 0;
+
+		Worker(SpiMaster &spi, int csPin) : channel(spi, csPin), buffers{channel, channel, channel, channel} {}
+
+		void run(std::atomic<int> &waiting) {
+			// wait until all threads are running so that they overlap
+			--waiting;
+			while (waiting > 0)
+				std::this_thread::yield();
+
+			for (int i = 0; i < START_COUNT; ++i) {
+				// start if the event loop has not completed the buffer yet
+				auto &buffer = this->buffers[i & 3];
+				if (buffer.ready()) {
+					buffer.resize(4);
+					buffer.start(Buffer::Op::WRITE);
+					++this->startCount;
+				}
+
+				// cancel a different buffer, it gets ready again if its transfer was not started yet
+				auto &other = this->buffers[(i + 1) & 3];
+				if (other.cancel() && other.ready())
+					++this->cancelCount;
+			}
+		}
+	};
+	auto &spi = drivers.spi;
+	// static as the completion of the last buffer resumes this coroutine which must not destroy the buffer
+	static std::vector<std::unique_ptr<Worker>> workers;
+	for (int i = 0; i < THREAD_COUNT; ++i)
+		workers.push_back(std::make_unique<Worker>(spi, 10 + i));
+
+	int64_t transferCount = spi.getTransferCount();
+	bool ready = true;
+	for (int round = 0; round < roundCount; ++round) {
+		std::atomic<int> waiting = THREAD_COUNT;
+		std::vector<std::thread> threads;
+		for (auto &worker : workers)
+			threads.emplace_back(&Worker::run, worker.get(), std::ref(waiting));
+		for (auto &thread : threads)
+			thread.join();
+
+		// let the event loop complete the transfers that were not canceled
+		for (auto &worker : workers) {
+			for (auto &buffer : worker->buffers) {
+				co_await buffer.untilReadyOrDisabled();
+				ready &= buffer.ready();
+			}
+		}
+	}
+
+	int startCount = 0;
+	int cancelCount = 0;
+	for (auto &worker : workers) {
+		startCount += worker->startCount;
+		cancelCount += worker->cancelCount;
+	}
+	transferCount = spi.getTransferCount() - transferCount;
+	printf("threads: %d started, %d canceled, %d transferred\n", startCount, cancelCount, int(transferCount));
+	check(ready && cancelCount > 0 && transferCount == startCount - cancelCount,
+		"threads: each started transfer gets canceled or transferred once");
+}
+
+// emulated slave device: answers each transaction with a response that was prepared while the previous transaction
+// was in progress and checks the received command
+Coroutine slaveDevice(Drivers &drivers, int transactionCount, int &errorCount) {
+	Buffer *buffers[] = {&drivers.slaveBuffer, &drivers.slaveBuffer2};
+
+	// prepare responses of the first two transactions
+	for (int k = 0; k < 2; ++k) {
+		for (int i = 0; i < 64; ++i)
+			buffers[k]->data()[i] = uint8_t(k + i);
+		buffers[k]->resize(64);
+		buffers[k]->start(Buffer::Op::READ_WRITE);
+	}
+
+	for (int k = 0; k < transactionCount; ++k) {
+		Buffer &buffer = *buffers[k & 1];
+		co_await buffer.untilReadyOrDisabled();
+
+		// check command of the host
+		if (buffer.size() != 64)
+			++errorCount;
+		for (int i = 0; i < buffer.size(); ++i) {
+			if (buffer.data()[i] != uint8_t(k * 3 + i))
+				++errorCount;
+		}
+
+		// prepare response of the transaction after the next and arm the buffer again
+		if (k + 2 < transactionCount) {
+			for (int i = 0; i < 64; ++i)
+				buffer.data()[i] = uint8_t(k + 2 + i);
+			buffer.resize(64);
+			buffer.start(Buffer::Op::READ_WRITE);
+		}
+	}
+}
+
+AwaitableCoroutine benchmarkSlave(Drivers &drivers, int transactionCount) {
+	Buffer &buffer = drivers.hostBuffer;
+	int errorCount = 0;
+	slaveDevice(drivers, transactionCount, errorCount);
+
+	int64_t start = drivers.spi.getTime();
+	for (int k = 0; k < transactionCount; ++k) {
+		// send command and receive response of the slave in the same transaction
+		for (int i = 0; i < 64; ++i)
+			buffer.data()[i] = uint8_t(k * 3 + i);
+		co_await buffer.transfer(64);
+		for (int i = 0; i < 64; ++i) {
+			if (buffer.data()[i] != uint8_t(k + i))
+				++errorCount;
+		}
+	}
+	double seconds = double(drivers.spi.getTime() - start) * 1e-9;
+	printf("slave: %d transactions, %.1f kB/s, %d missed, %d overflows, %d errors\n", transactionCount,
+		transactionCount * 64 / seconds / 1000, drivers.slave.getMissedCount(), drivers.slave.getOverflowCount(),
+		errorCount);
+	check(errorCount == 0 && drivers.slave.getMissedCount() == 0 && drivers.slave.getOverflowCount() == 0,
+		"slave: all responses and commands received");
+
+	// a transaction without bytes does not complete the armed buffer of the slave
+	Buffer &slaveBuffer = drivers.slaveBuffer;
+	co_await slaveBuffer.untilReadyOrDisabled();
+	slaveBuffer.resize(64);
+	slaveBuffer.start(Buffer::Op::READ_WRITE);
+	co_await buffer.write(0);
+	bool armed = !slaveBuffer.ready();
+	co_await buffer.write(64);
+	co_await slaveBuffer.untilReadyOrDisabled();
+	check(armed && slaveBuffer.size() == 64, "slave: empty transaction keeps the buffer armed");
+}
+
+AwaitableCoroutine benchmarkPoll(Drivers &drivers, int64_t duration) {
+	auto &samplePoll = drivers.samplePoll;
+	auto &whoAmIPoll = drivers.whoAmIPoll;
+	Buffer &buffer = drivers.sensorBuffer;
+	const uint8_t readConfig[] = {0x80 | 0x20};
+
+	// polls run from an emulated 50us timer while the application keeps the bus busy with its own transfers and
+	// takes the samples from the ring buffers now and then
+	drivers.spi.setTimer(50'000);
+	int64_t end = drivers.spi.getTime() + duration;
+	int sampleCount = 0;
+	int lostCount = 0;
+	int errorCount = 0;
+	int last = -1;
+	while (drivers.spi.getTime() < end) {
+		for (int i = 0; i < 16; ++i) {
+			buffer.setHeader(readConfig);
+			co_await buffer.read(6);
+		}
+
+		// sensor counts its samples, sampling at twice the rate reads each sample once or twice
+		uint8_t data[6];
+		uint32_t timestamp;
+		while (samplePoll.read(data, timestamp)) {
+			int counter = data[0] | (data[1] << 8);
+			if (last >= 0 && counter != last && counter != ((last + 1) & 0xffff))
+				++lostCount;
+			if (counter != last)
+				++sampleCount;
+			last = counter;
+		}
+		while (whoAmIPoll.read(data, timestamp)) {
+			if (data[0] != 0x33)
+				++errorCount;
+		}
+	}
+	drivers.spi.setTimer(0);
+	samplePoll.setEnabled(false);
+	whoAmIPoll.setEnabled(false);
+
+	// let the last chained read complete
+	buffer.setHeader(readConfig);
+	co_await buffer.read(6);
+
+	printf("poll: %d sensor samples, %d lost, %d reads, %d missed, %d overruns, interval %.1f-%.1fus, jitter %.2fus mean %.2fus max\n",
+		sampleCount, lostCount, samplePoll.getSampleCount(), samplePoll.getMissedCount(), samplePoll.getOverrunCount(),
+		samplePoll.getMinInterval() * 1e-3, samplePoll.getMaxInterval() * 1e-3,
+		samplePoll.getMeanJitter() * 1e-3, samplePoll.getMaxJitter() * 1e-3);
+	printf("poll: %d chained reads, %d overruns, %d errors\n", whoAmIPoll.getSampleCount(),
+		whoAmIPoll.getOverrunCount(), errorCount);
+	check(lostCount == 0 && samplePoll.getMissedCount() == 0 && samplePoll.getOverrunCount() == 0,
+		"poll: no lost samples, missed reads or overruns");
+	check(whoAmIPoll.getSampleCount() > 0 && errorCount == 0, "poll: chained reads");
+
+	// a read that is due while the previous read is still in progress gets missed, the interval that spans it does not
+	// count as jitter
+	const uint8_t command[] = {0x80};
+	SpiPoll<1, 2, 4> poll(command, 100);
+	uint8_t sample[2] = {};
+	poll.due(0, false);
+	poll.store(sample, 0);
+	poll.due(100, false);
+	poll.store(sample, 101);
+	poll.due(200, true);
+	poll.due(300, false);
+	poll.store(sample, 300);
+	check(poll.getMissedCount() == 1 && poll.getMaxJitter() == 1, "poll: interval across a missed read is no jitter");
+}
+
+AwaitableCoroutine benchmarkScript(Drivers &drivers) {
+	auto &display = drivers.display;
+
+	// count steps, without script each write would be a round trip through the event loop
+	int writeCount = 0;
+	int delayCount = 0;
+	const uint8_t *script = displayInit.data();
+	SpiScriptStep step;
+	while ((script = SpiScriptStep::decode(script, step), step.type != SpiScriptStep::Type::END)) {
+		if (step.type == SpiScriptStep::Type::WRITE)
+			++writeCount;
+		else
+			++delayCount;
+	}
+
+	// script run by the master from the emulated timer, the application gets notified once at the end
+	drivers.spi.setTimer(10'000);
+	int violationCount = display.getViolationCount();
+	int64_t start = drivers.spi.getTime();
+	co_await drivers.displayBuffer.runScript(displayInit);
+	double time = double(drivers.spi.getTime() - start) * 1e-6;
+	drivers.spi.setTimer(0);
+
+	printf("script: %d byte table, %d writes, %d delays, init %.2f ms, %d violations, 1 notification instead of %d\n",
+		displayInit.size(), writeCount, delayCount, time, display.getViolationCount() - violationCount, writeCount);
+	check(display.getViolationCount() == violationCount, "script: no timing violations");
+	check(time >= 10.0, "script: delays");
+}
+
+// page program whose CS is kept active over a delay, gets canceled during the delay
+constexpr auto programScript = SpiScript<32>()
+	.command(0x06) // write enable
+	.write({0x02, 0x3f, 0xff, 0x00}, {0x11, 0x22, 0x33, 0x44}, true) // page program of the last page, keep CS active
+	.delay(1'000'000)
+	.write({}, {0x55, 0x66, 0x77, 0x88});
+
+// waits without transfers on the bus which would release the CS of the flash
+constexpr auto waitScript = SpiScript<8>().delay(100'000);
+
+AwaitableCoroutine cancelScript(Drivers &drivers) {
+	Drivers::SpiMaster::BufferBase &buffer = drivers.flashCommand;
+
+	// cancel while the script waits in the delay after the page program
+	drivers.spi.setTimer(10'000);
+	buffer.startScript(programScript.data());
+	co_await drivers.sensorBuffer.runScript(waitScript);
+	buffer.cancel();
+	bool canceled = buffer.ready();
+
+	// the buffer is usable again: wait until the flash has programmed the first part, then read the page back
+	buffer.setHeader(readStatus);
+	co_await drivers.flashChannel.pollStatus(buffer, SpiSlaveModel_Flash::WIP, 0);
+	drivers.spi.setTimer(0);
+	const uint8_t readPage[] = {0x03, 0x3f, 0xff, 0x00};
+	buffer.setHeader(readPage);
+	co_await buffer.read(8);
+	const uint8_t expected[] = {0x11, 0x22, 0x33, 0x44, 0xff, 0xff, 0xff, 0xff};
+	check(canceled && std::equal(expected, expected + 8, buffer.data()),
+		"script: cancel releases CS and the buffer can be reused");
+}
+
+// reads the sensor back to back on another channel while the flash is busy
+Coroutine readSensorWhile(Drivers &drivers, const bool &running, int &readCount) {
+	Buffer &buffer = drivers.sensorBuffer;
+	const uint8_t readSample[] = {0x80 | 0x28};
+	while (running) {
+		buffer.setHeader(readSample);
+		co_await buffer.read(6);
+		++readCount;
+	}
+}
+
+AwaitableCoroutine benchmarkStatusPoll(Drivers &drivers, int pageCount) {
+	auto &channel = drivers.flashChannel;
+	Buffer &command = drivers.flashCommand;
+	Drivers::SpiMaster::BufferBase &status = drivers.flashStatus;
+	Buffer &buffer = drivers.flashPage;
+
+	// 0: status polled by the application, 1: back to back status reads by the master, 2: status reads every 50us
+	for (int mode = 0; mode < 3; ++mode) {
+		bool running = true;
+		int sensorCount = 0;
+		readSensorWhile(drivers, running, sensorCount);
+		if (mode == 2)
+			drivers.spi.setTimer(10'000);
+
+		int statusCount = 0;
+		int notificationCount = 0;
+		int64_t start = drivers.spi.getTime();
+		for (int page = 0; page < pageCount; ++page) {
+			// write enable (the flash driver has left a header in the command buffer)
+			command.setHeader(writeEnable);
+			co_await command.write(0);
+
+			// page program behind the pages of the other benchmarks
+			int address = 0x100000 + (mode * pageCount + page) * 256;
+			uint8_t header[] = {0x02, uint8_t(address >> 16), uint8_t(address >> 8), uint8_t(address)};
+			buffer.setHeader(header);
+			for (int i = 0; i < 256; ++i)
+				buffer.data()[i] = uint8_t(page + i);
+			co_await buffer.write(256);
+
+			// wait until write in progress (WIP) is cleared
+			if (mode == 0) {
+				do {
+					status.setHeader(readStatus);
+					co_await status.read(1);
+					++statusCount;
+					++notificationCount;
+				} while ((status.data()[0] & SpiSlaveModel_Flash::WIP) != 0);
+			} else {
+				status.setHeader(readStatus);
+				co_await channel.pollStatus(status, SpiSlaveModel_Flash::WIP, 0, 0, mode == 2 ? 50'000 : 0);
+				statusCount += status.getStatusCount();
+				++notificationCount;
+			}
+		}
+		double seconds = double(drivers.spi.getTime() - start) * 1e-9;
+		drivers.spi.setTimer(0);
+
+		// let the last sensor read complete
+		running = false;
+		co_await drivers.sensorBuffer.untilReadyOrDisabled();
+
+		const char *modes[] = {"application loop", "master back to back", "master every 50us"};
+		printf("status poll (%s): %d pages, %.1f pages/s, %d status reads, %d notifications, %d sensor reads\n",
+			modes[mode], pageCount, pageCount / seconds, statusCount, notificationCount, sensorCount);
+		check(statusCount > pageCount && notificationCount == (mode == 0 ? statusCount : pageCount),
+			"status poll: one notification per page when the master polls");
+		check(sensorCount > 0, "status poll: transfers of other channels in between");
+	}
+}
+
+// driver code that works on the virtual interface (coco::Buffer) and on the concrete buffer type of the master
+template <SpiBufferType B>
+AwaitableCoroutine readIdentification(B &buffer, int count) {
+	const uint8_t whoAmI[] = {0x80 | 0x0f};
+	for (int i = 0; i < count; ++i) {
+		buffer.setHeader(whoAmI);
+		co_await spi::read(buffer, 1);
+	}
+}
+
+AwaitableCoroutine benchmarkStaticDispatch(Drivers &drivers, int callCount) {
+	Drivers::SpiMaster::BufferBase &buffer = drivers.sensorBuffer;
+
+	// the same driver code reads WHO_AM_I through the virtual interface and through the concrete buffer type
+	buffer.data()[0] = 0;
+	co_await readIdentification<Buffer>(buffer, 1);
+	bool dynamicOk = buffer.data()[0] == 0x33;
+	buffer.data()[0] = 0;
+	co_await readIdentification(buffer, 1);
+	bool concreteOk = buffer.data()[0] == 0x33;
+
+	// CPU time of cancel() on a ready buffer which returns at once, therefore the time is the cost of the call. The
+	// pointers are volatile so that the compiler can not resolve the type of the buffer for the virtual call
+	Buffer *volatile dynamicBuffer = &buffer;
+	Drivers::SpiMaster::BufferBase *volatile concreteBuffer = &buffer;
+	int canceled = 0;
+	double times[2];
+	for (int round = 0; round < 2; ++round) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < callCount; ++i)
+			canceled += dynamicBuffer->cancel();
+		auto middle = std::chrono::steady_clock::now();
+		for (int i = 0; i < callCount; ++i)
+			canceled += concreteBuffer->cancel();
+		std::chrono::duration<double, std::nano> dynamic = middle - start;
+		std::chrono::duration<double, std::nano> concrete = std::chrono::steady_clock::now() - middle;
+		times[0] = dynamic.count() / callCount;
+		times[1] = concrete.count() / callCount;
+	}
+	printf("static dispatch: %.2f ns per call of cancel() with virtual calls, %.2f ns with static dispatch\n",
+		times[0], times[1]);
+	check(dynamicOk && concreteOk && canceled == 0, "static dispatch: same data through both interfaces");
+}
+
+AwaitableCoroutine benchmarkCrc(Drivers &drivers, int blockCount) {
+	// CPU time of the software CRC per SD card data block, which the CRC unit of the STM32 SPI peripheral saves
+	uint8_t block[512];
+	for (int i = 0; i < 512; ++i)
+		block[i] = uint8_t(i * 13);
+	auto start = std::chrono::steady_clock::now();
+	volatile uint16_t crc = 0;
+	for (int i = 0; i < blockCount; ++i)
+		crc = SPI_CRC16_CCITT.compute(block, 512, crc);
+	std::chrono::duration<double, std::micro> duration = std::chrono::steady_clock::now() - start;
+
+	// read from the emulated slave device that sends data and CRC, then the same block with a flipped bit
+	Drivers::SpiMaster::BufferBase &host = drivers.hostBuffer;
+	Buffer &slave = drivers.slaveBuffer;
+	host.setCrc(SPI_CRC16_CCITT);
+	SpiCrc::Result results[2];
+	for (int corrupt = 0; corrupt < 2; ++corrupt) {
+		uint8_t *data = slave.data();
+		for (int i = 0; i < 62; ++i)
+			data[i] = uint8_t(i * 7);
+		uint16_t value = SPI_CRC16_CCITT.compute(data, 62);
+		data[62] = uint8_t(value >> 8);
+		data[63] = uint8_t(value);
+		if (corrupt != 0)
+			data[10] ^= 0x04;
+		slave.startWrite(64);
+		co_await host.read(62);
+		results[corrupt] = host.getCrcResult();
+	}
+
+	// write to the slave device which receives the data and the appended CRC
+	slave.startRead(64);
+	for (int i = 0; i < 62; ++i)
+		host.data()[i] = uint8_t(i * 3);
+	co_await host.write(62);
+	co_await slave.untilReadyOrDisabled();
+	uint16_t value = SPI_CRC16_CCITT.compute(host.data(), 62);
+	bool written = slave.size() == 64 && slave.data()[62] == uint8_t(value >> 8) && slave.data()[63] == uint8_t(value);
+	host.setCrc(SPI_CRC_NONE);
+
+	printf("crc: software CRC16 %.2f us per 512 byte block, corrupted block %s\n", duration.count() / blockCount,
+		results[1] == SpiCrc::Result::ERROR ? "reported" : "not reported");
+	check(results[0] == SpiCrc::Result::OK, "crc: correct block");
+	check(results[1] == SpiCrc::Result::ERROR, "crc: corrupted block reported");
+	check(written, "crc: appended on write");
+}
+
+// set when all benchmarks have finished, checked in main() as a transfer that never completes ends the test early
+bool finished = false;
+
+Coroutine benchmark(Drivers &drivers) {
+	co_await benchmarkFlash(drivers, 256);
+	co_await benchmarkFlashDriver(drivers, 65536);
+	co_await benchmarkSdCard(drivers, 64);
+	co_await benchmarkDisplay(drivers, 4);
+	co_await benchmarkDisplayFlush(drivers, 100, 16);
+	co_await benchmarkDisplayFlush(drivers, 100, 64);
+	co_await benchmarkSensor(drivers, 100);
+	co_await benchmarkCalibration(drivers);
+	co_await benchmarkRegisterMap(drivers);
+	co_await benchmarkHardwareCs(drivers, 1000);
+	co_await benchmarkBufferPool(drivers);
+	co_await benchmarkCoalescing(drivers);
+	co_await stressThreads(drivers, 100);
+	co_await benchmarkSlave(drivers, 1000);
+	co_await benchmarkPoll(drivers, 100'000'000);
+	co_await benchmarkScript(drivers);
+	co_await cancelScript(drivers);
+	co_await benchmarkStatusPoll(drivers, 16);
+	co_await benchmarkStaticDispatch(drivers, 10'000'000);
+	co_await benchmarkCrc(drivers, 1000);
+	finished = true;
+	drivers.loop.exit();
+}
+
+int main() {
+	benchmark(drivers);
+
+	drivers.loop.run();
+	check(finished, "all benchmarks finished");
+	return failureCount == 0 ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+#include <coco/SubmitQueue.hpp>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+
+using namespace coco;
+
+// stress test of the lock-free submission queue: several producer threads submit concurrently while a consumer thread
+// drains, each element must arrive exactly once and the elements of each producer in the order they were submitted
+
+constexpr int PRODUCER_COUNT = 4;
+constexpr int ELEMENT_COUNT = 64;
+constexpr int SUBMIT_COUNT = 200000;
+
+struct Element {
+	Element *next;
+
+	// producer and sequence number of the current submission
+	int producer;
+	int sequence;
+
+	// set by the producer when submitting, cleared by the consumer when received
+	std::atomic<bool> pending = false;
+};
+
+using Queue = SubmitQueue<Element, &Element::next>;
+
+Element elements[PRODUCER_COUNT][ELEMENT_COUNT];
+
+void produce(Queue &queue, int producer) {
+	for (int sequence = 0; sequence < SUBMIT_COUNT; ++sequence) {
+		// reuse element only after the consumer has received it (as a buffer is started again only when ready)
+		auto &element = elements[producer][sequence % ELEMENT_COUNT];
+		while (element.pending.load(std::memory_order_acquire))
+			std::this_thread::yield();
+
+		element.producer = producer;
+		element.sequence = sequence;
+		element.pending.store(true, std::memory_order_relaxed);
+		queue.push(element);
+	}
+}
+
+int main() {
+	Queue queue;
+	std::atomic<int> running = PRODUCER_COUNT;
+
+	int next[PRODUCER_COUNT] = {};
+	int received = 0;
+	int errors = 0;
+	int drainCount = 0;
+	std::thread consumer([&] {
+		while (true) {
+			// check before draining so that no element submitted by the last producer gets lost
+			bool done = running.load() == 0;
+			if (queue.empty()) {
+				if (done)
+					break;
+				std::this_thread::yield();
+				continue;
+			}
+			queue.drain([&](Element &element) {
+				// check order of submissions
+				if (element.sequence != next[element.producer])
+					++errors;
+				next[element.producer] = element.sequence + 1;
+				++received;
+				element.pending.store(false, std::memory_order_release);
+			});
+			++drainCount;
+		}
+	});
+
+	std::vector<std::thread> producers;
+	for (int i = 0; i < PRODUCER_COUNT; ++i) {
+		producers.emplace_back([&queue, &running, i] {
+			produce(queue, i);
+			--running;
+		});
+	}
+	for (auto &producer : producers)
+		producer.join();
+	consumer.join();
+
+	int expected = PRODUCER_COUNT * SUBMIT_COUNT;
+	if (received != expected || !queue.empty())
+		++errors;
+	printf("submit queue: %d producers, %d of %d received in %d drains, %d errors\n", PRODUCER_COUNT, received,
+		expected, drainCount, errors);
+	return errors == 0 ? 0 : 1;
+}
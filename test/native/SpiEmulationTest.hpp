@@ -0,0 +1,116 @@
+#pragma once
+
+#include <coco/DisplayFlush.hpp>
+#include <coco/RegisterMap.hpp>
+#include <coco/SdCard.hpp>
+#include <coco/SpiCalibration.hpp>
+#include <coco/SpiConcepts.hpp>
+#include <coco/SpiFlash.hpp>
+#include <coco/SpiPoll.hpp>
+#include <coco/SpiScript.hpp>
+#include <coco/platform/Loop_native.hpp>
+#include <coco/platform/SpiMaster_native.hpp>
+#include <coco/platform/SpiSlave_native.hpp>
+#include <coco/platform/SpiSlaveModel_Flash.hpp>
+#include <coco/platform/SpiSlaveModel_Registers.hpp>
+#include <coco/platform/SpiSlaveModel_SdCard.hpp>
+#include <coco/platform/SpiSlaveModel_ST7789.hpp>
+
+
+using namespace coco;
+
+// register map of the emulated sensor, status and sample registers are volatile
+constexpr auto SENSOR_LAYOUT = RegisterLayout{.registerCount = 128, .readFlag = 0x80}.withVolatile(0x27, 7);
+
+// commands of periodic reads of the sensor: sample registers and identification register (WHO_AM_I)
+const uint8_t readSample[] = {0x80 | 0x28};
+const uint8_t readWhoAmI[] = {0x80 | 0x0f};
+
+// init sequence of the display, delays in nanoseconds of the emulated timer (controller is busy for 5ms after reset
+// and sleep out)
+constexpr auto displayInit = SpiScript<64>()
+	.command(0x01).delay(5'000'000) // SWRESET
+	.command(0x11).delay(5'000'000) // SLPOUT
+	.command(0x3a, {0x55}) // COLMOD: 16 bit color
+	.command(0x36, {0x00}) // MADCTL
+	.command(0x2a, {0, 0, 0, 239}) // CASET
+	.command(0x2b, {0, 0, 0, 239}) // RASET
+	.command(0x21) // INVON
+	.command(0x29); // DISPON
+
+// drivers for SpiEmulationTest
+struct Drivers {
+	Loop_native loop;
+
+	// emulated slaves
+	SpiSlaveModel_Flash flash{4 * 1024 * 1024};
+	SpiSlaveModel_ST7789 display{240, 240};
+	SpiSlaveModel_SdCard sdCard{2048};
+	SpiSlaveModel_Registers sensor{{.statusRegister = 0x27, .sampleRegister = 0x28, .sampleSize = 6, .samplePeriod = 1'000'000}};
+
+	// emulated slave device with double-buffered responses
+	SpiSlave_native slave{loop};
+	SpiSlave_native::Buffer<64> slaveBuffer{slave};
+	SpiSlave_native::Buffer<64> slaveBuffer2{slave};
+
+	using SpiMaster = SpiMaster_native;
+	static_assert(SpiMasterType<SpiMaster>);
+	SpiMaster spi{loop, 8'000'000};
+	SpiMaster::Channel flashChannel{spi, 1};
+	SpiMaster::Channel displayChannel{spi, 2, true};
+	SpiMaster::Channel sensorChannel{spi, 3};
+	SpiMaster::Channel sdCardChannel{spi, 4};
+	SpiMaster::Channel slaveChannel{spi, 5};
+	SpiMaster::Channel clockChannel{spi, 6};
+	SpiMaster::Buffer<16> flashCommand{flashChannel};
+	SpiMaster::Buffer<16> flashStatus{flashChannel};
+	SpiMaster::Buffer<261> flashPage{flashChannel};
+	SpiMaster::Buffer<261> flashPage2{flashChannel};
+	SpiMaster::Buffer<1024> displayBuffer{displayChannel};
+	SpiMaster::Buffer<1024> displayBuffer2{displayChannel};
+	SpiMaster::Buffer<16> sensorBuffer{sensorChannel};
+	SpiMaster::Buffer<16> sdCardCommand{sdCardChannel};
+	SpiMaster::Buffer<515> sdCardBlock{sdCardChannel};
+	SpiMaster::Buffer<515> sdCardBlock2{sdCardChannel};
+	SpiMaster::Buffer<16> sdCardClock{clockChannel};
+	SpiMaster::Buffer<64> hostBuffer{slaveChannel};
+	SpiMaster::Buffer<16> samplePollBuffer{sensorChannel};
+	SpiMaster::Buffer<16> whoAmIPollBuffer{sensorChannel};
+
+	// shared buffer pool with two size classes
+	SpiMaster::Pool<16, 2> smallPool{spi};
+	SpiMaster::Pool<64, 1> largePool{spi};
+
+	// flash driver with 8 cache lines
+	SpiFlash<8> flashDriver{flashCommand, flashPage, flashPage2};
+
+	// register map of sensor
+	RegisterMap<SENSOR_LAYOUT> sensorRegisters{sensorBuffer};
+
+	// periodic reads of the sensor: samples every 500us (twice the sample rate), WHO_AM_I chained
+	SpiPoll<1, 6, 64> samplePoll{readSample, 500'000};
+	SpiPoll<1, 1, 64> whoAmIPoll{readWhoAmI, 0};
+
+	// SD card driver, the wake-up clocks are sent on a channel without slave
+	SdCard sdCardDriver{sdCardCommand, sdCardBlock, sdCardBlock2, &sdCardClock};
+
+	// display flush engine
+	uint16_t frameBuffer[240 * 240];
+	DisplayFlush displayFlush{displayBuffer, displayBuffer2, frameBuffer, 240, 240};
+
+	Drivers() {
+		spi.attach(1, flash);
+		spi.attach(2, display);
+		spi.attach(3, sensor);
+		spi.attach(4, sdCard);
+		spi.attach(5, slave);
+		spi.addPoll(samplePoll, samplePollBuffer);
+		spi.addPoll(whoAmIPoll, whoAmIPollBuffer);
+
+		// identification register of sensor (WHO_AM_I), sensor corrupts bits above 40MHz
+		sensor.set(0x0f, 0x33);
+		sensor.maxFrequency = 40'000'000;
+	}
+};
+
+Drivers drivers;